@@ -7,6 +7,10 @@
 
 #include <gst/gst.h>
 
+#if defined(_USE_SSE) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "gstdumbdec.h"
 
 #include "dumb/include/internal/it.h"
@@ -20,7 +24,8 @@ enum
 {
 	PROP_0,
 	PROP_RESAMPLING_QUALITY,
-	PROP_RAMP_STYLE
+	PROP_RAMP_STYLE,
+	PROP_RENDER_THREADS
 };
 
 
@@ -35,13 +40,21 @@ enum
 /* property defaults */
 #define DEFAULT_RESAMPLING_QUALITY DUMB_RQ_CUBIC
 #define DEFAULT_RAMP_STYLE DUMB_RAMP_STYLE_NONE
+#define DEFAULT_RENDER_THREADS 1
 
 /* caps negotiation defaults */
+#define DEFAULT_SAMPLE_FORMAT GST_AUDIO_FORMAT_F32
 #define DEFAULT_SAMPLE_RATE 48000
 #define DEFAULT_NUM_CHANNELS 2
 
-#define RENDER_BIT_DEPTH 16
-#define AUDIO_FORMAT GST_AUDIO_FORMAT_S16
+/* DUMB mixes into 24 bit fixed point samples; this is the full scale value */
+#define DUMB_SAMPLE_FULL_SCALE 8388608.0f
+
+/* number of samples per output buffer */
+#define RENDER_BLOCK_SIZE 1024
+
+/* how far parallel renders may get ahead of the output, in seconds */
+#define RENDER_AHEAD_MAX_SECONDS 10
 
 
 
@@ -59,17 +72,25 @@ static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE(
 	GST_STATIC_CAPS("audio/x-mod " MOD_CAPS_TYPESTR)
 );
 
+#define SRC_CAPS \
+	"audio/x-raw, " \
+	"format = (string) { " GST_AUDIO_NE(F32) ", " GST_AUDIO_NE(S16) " }, " \
+	"layout = (string) interleaved, " \
+	"rate = (int) [ 1, 48000 ], " \
+	"channels = (int) { 1, 2 } "
+
 static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE(
 	"src",
 	GST_PAD_SRC,
 	GST_PAD_ALWAYS,
-	GST_STATIC_CAPS(
-		"audio/x-raw, "
-		"format = (string) " GST_AUDIO_NE(S16) ", "
-		"layout = (string) interleaved, "
-		"rate = (int) [ 1, 48000 ], "
-		"channels = (int) { 1, 2 } "
-	)
+	GST_STATIC_CAPS(SRC_CAPS)
+);
+
+static GstStaticPadTemplate stem_src_template = GST_STATIC_PAD_TEMPLATE(
+	GST_NONSTREAM_AUDIO_DECODER_STEM_SRC_NAME,
+	GST_PAD_SRC,
+	GST_PAD_REQUEST,
+	GST_STATIC_CAPS(SRC_CAPS)
 );
 
 
@@ -86,6 +107,8 @@ static GType gst_dumb_dec_ramp_style_get_type(void);
 
 static void gst_dumb_dec_finalize(GObject *object);
 
+static GstStateChangeReturn gst_dumb_dec_change_state(GstElement *element, GstStateChange transition);
+
 static void gst_dumb_dec_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec);
 static void gst_dumb_dec_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec);
 
@@ -97,6 +120,9 @@ static gboolean gst_dumb_dec_load_from_buffer(GstNonstreamAudioDecoder *dec, Gst
 
 static gboolean gst_dumb_dec_set_current_subsong(GstNonstreamAudioDecoder *dec, guint subsong, GstClockTime *initial_position);
 static guint gst_dumb_dec_get_current_subsong(GstNonstreamAudioDecoder *dec);
+static gboolean gst_dumb_dec_start_subsong(GstDumbDec *dumb_dec, guint subsong);
+static gboolean gst_dumb_dec_advance_subsong(GstDumbDec *dumb_dec);
+static gboolean gst_dumb_dec_set_subsong_mode(GstNonstreamAudioDecoder *dec, GstNonstreamAudioSubsongMode mode, GstClockTime *initial_position);
 
 static guint gst_dumb_dec_get_num_subsongs(GstNonstreamAudioDecoder *dec);
 static GstClockTime gst_dumb_dec_get_subsong_duration(GstNonstreamAudioDecoder *dec, guint subsong);
@@ -109,11 +135,39 @@ static guint gst_dumb_dec_get_supported_output_modes(GstNonstreamAudioDecoder *d
 static gboolean gst_dumb_dec_set_output_mode(GstNonstreamAudioDecoder *dec, GstNonstreamAudioOutputMode mode, GstClockTime *current_position);
 
 static gboolean gst_dumb_dec_decode(GstNonstreamAudioDecoder *dec, GstBuffer **buffer, guint *num_samples);
+static long gst_dumb_dec_render(GstDumbDec *dumb_dec, DUH_SIGRENDERER *sr, long num_samples, gpointer dest);
+static long gst_dumb_dec_render_samples(DUH_SIGRENDERER *sr, GstAudioFormat sample_format, gint sample_rate, gint num_channels, sample_t ***sample_buffer, long *sample_buffer_length, long num_samples, gpointer dest);
+static void gst_dumb_dec_convert_to_float(gfloat *dest, sample_t const *src, gsize num_values);
+
+static gboolean gst_dumb_dec_set_quality_degradation(GstNonstreamAudioDecoder *dec, guint degradation);
+static gboolean gst_dumb_dec_get_module_position(GstNonstreamAudioDecoder *dec, gint *order, gint *pattern, gint *row);
+static gboolean gst_dumb_dec_apply_render_settings(GstDumbDec *dumb_dec, guint degradation);
 
-static gboolean gst_dumb_dec_init_sigrenderer_at_pos(GstDumbDec *dumb_dec, long seek_pos);
+static guint gst_dumb_dec_get_num_stems(GstNonstreamAudioDecoder *dec);
+static gboolean gst_dumb_dec_decode_stems(GstNonstreamAudioDecoder *dec, guint const *stem_indices, GstBuffer **buffers, guint num_stems, guint num_samples);
+static DUH_SIGRENDERER* gst_dumb_dec_create_stem_sigrenderer(GstDumbDec *dumb_dec, guint stem_index);
+static void gst_dumb_dec_end_stem_sigrenderers(GstDumbDec *dumb_dec);
+
+static gboolean gst_dumb_dec_init_sigrenderer_at_pos(GstDumbDec *dumb_dec, DUH *duh, long seek_pos);
 static gboolean gst_dumb_dec_init_sigrenderer_at_order(GstDumbDec *dumb_dec, int order);
 static void gst_dumb_dec_init_sigrenderer_common(GstDumbDec *dumb_dec);
 
+static DUH* gst_dumb_dec_read_psm_duh(guint8 const *data, gsize size, int subsong);
+static DUH* gst_dumb_dec_read_psm_subsongs(GstDumbDec *dumb_dec, guint8 const *data, gsize size, int num_psm_subsongs, guint initial_subsong);
+static void gst_dumb_dec_read_psm_subsong_func(gpointer data, gpointer user_data);
+
+static void gst_dumb_dec_start_checkpoint_build(GstDumbDec *dumb_dec);
+static gpointer gst_dumb_dec_checkpoint_thread(gpointer user_data);
+static DUH* gst_dumb_dec_get_checkpoint_duh(GstDumbDec *dumb_dec);
+static gboolean gst_dumb_dec_has_checkpoints_for(GstDumbDec *dumb_dec, guint subsong);
+
+static void gst_dumb_dec_start_renders(GstDumbDec *dumb_dec);
+static void gst_dumb_dec_stop_renders(GstDumbDec *dumb_dec);
+static void gst_dumb_dec_render_subsong_func(gpointer data, gpointer user_data);
+static int gst_dumb_dec_render_loop_callback(void *ptr);
+static gboolean gst_dumb_dec_take_rendered_buffer(GstDumbDec *dumb_dec, GstBuffer **rendered);
+
+static gpointer gst_dumb_scan_vblank_thread(gpointer user_data);
 static void gst_dumb_scan_for_subsongs(GstDumbDec *dumb_dec);
 
 
@@ -134,6 +188,8 @@ void gst_dumb_dec_class_init(GstDumbDecClass *klass)
 	object_class->set_property = GST_DEBUG_FUNCPTR(gst_dumb_dec_set_property);
 	object_class->get_property = GST_DEBUG_FUNCPTR(gst_dumb_dec_get_property);
 
+	element_class->change_state = GST_DEBUG_FUNCPTR(gst_dumb_dec_change_state);
+
 	dec_class->seek = GST_DEBUG_FUNCPTR(gst_dumb_dec_seek);
 	dec_class->tell = GST_DEBUG_FUNCPTR(gst_dumb_dec_tell);
 	dec_class->load_from_buffer = GST_DEBUG_FUNCPTR(gst_dumb_dec_load_from_buffer);
@@ -144,12 +200,18 @@ void gst_dumb_dec_class_init(GstDumbDecClass *klass)
 	dec_class->decode = GST_DEBUG_FUNCPTR(gst_dumb_dec_decode);
 	dec_class->set_current_subsong = GST_DEBUG_FUNCPTR(gst_dumb_dec_set_current_subsong);
 	dec_class->get_current_subsong = GST_DEBUG_FUNCPTR(gst_dumb_dec_get_current_subsong);
+	dec_class->set_subsong_mode = GST_DEBUG_FUNCPTR(gst_dumb_dec_set_subsong_mode);
 	dec_class->get_num_subsongs = GST_DEBUG_FUNCPTR(gst_dumb_dec_get_num_subsongs);
 	dec_class->get_subsong_duration = GST_DEBUG_FUNCPTR(gst_dumb_dec_get_subsong_duration);
 	dec_class->get_subsong_tags = GST_DEBUG_FUNCPTR(gst_dumb_dec_get_subsong_tags);
+	dec_class->set_quality_degradation = GST_DEBUG_FUNCPTR(gst_dumb_dec_set_quality_degradation);
+	dec_class->get_module_position = GST_DEBUG_FUNCPTR(gst_dumb_dec_get_module_position);
+	dec_class->get_num_stems = GST_DEBUG_FUNCPTR(gst_dumb_dec_get_num_stems);
+	dec_class->decode_stems = GST_DEBUG_FUNCPTR(gst_dumb_dec_decode_stems);
 
 	gst_element_class_add_pad_template(element_class, gst_static_pad_template_get(&sink_template));
 	gst_element_class_add_pad_template(element_class, gst_static_pad_template_get(&src_template));
+	gst_element_class_add_pad_template(element_class, gst_static_pad_template_get(&stem_src_template));
 
 	gst_element_class_set_static_metadata(
 		element_class,
@@ -183,11 +245,29 @@ void gst_dumb_dec_class_init(GstDumbDecClass *klass)
 			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
 		)
 	);
+	g_object_class_install_property(
+		object_class,
+		PROP_RENDER_THREADS,
+		g_param_spec_uint(
+			"render-threads",
+			"Render threads",
+			"Number of threads for rendering subsongs in parallel when all subsongs are played without looping (1 = no parallel rendering); "
+			"each thread renders at most " G_STRINGIFY(RENDER_AHEAD_MAX_SECONDS) " seconds ahead, which are kept in memory until they are output; "
+			"with PSM modules, each thread also holds its own copy of the module, including the samples",
+			1, 64,
+			DEFAULT_RENDER_THREADS,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		)
+	);
 }
 
 
 void gst_dumb_dec_init(GstDumbDec *dumb_dec)
 {
+	dumb_dec->sample_format = DEFAULT_SAMPLE_FORMAT;
+	dumb_dec->sample_buffer = NULL;
+	dumb_dec->sample_buffer_length = 0;
+
 	dumb_dec->cur_loop_count = 0;
 	dumb_dec->num_loops = 0;
 	dumb_dec->loop_end_reached = FALSE;
@@ -204,6 +284,34 @@ void gst_dumb_dec_init(GstDumbDec *dumb_dec)
 	dumb_dec->num_subsongs = 0;
 	dumb_dec->subsongs_explicit = FALSE;
 	dumb_dec->cur_subsong_start_pos = 0;
+	dumb_dec->module_data = NULL;
+	dumb_dec->tempos_converted = FALSE;
+
+	g_mutex_init(&(dumb_dec->checkpoint_mutex));
+	dumb_dec->checkpoint_duh = NULL;
+	dumb_dec->checkpoint_subsong = 0;
+	dumb_dec->checkpoint_generation = 0;
+	dumb_dec->checkpoint_build_running = FALSE;
+	dumb_dec->sigrenderer_duh = NULL;
+
+	dumb_dec->subsong_mode = GST_NONSTREM_AUDIO_SUBSONG_MODE_SINGLE;
+	dumb_dec->subsongs_played_length = 0;
+
+	dumb_dec->render_threads = DEFAULT_RENDER_THREADS;
+	dumb_dec->render_pool = NULL;
+	dumb_dec->subsong_renders = NULL;
+	g_mutex_init(&(dumb_dec->render_mutex));
+	g_cond_init(&(dumb_dec->render_cond));
+	dumb_dec->stop_renders = 0;
+	dumb_dec->render_generation = 0;
+	dumb_dec->render_max_buffers = 0;
+	dumb_dec->cur_render = NULL;
+	dumb_dec->render_pos = 0;
+
+	memset(dumb_dec->stem_sigrenderers, 0, sizeof(dumb_dec->stem_sigrenderers));
+	dumb_dec->sigrenderer_start_order = -1;
+	dumb_dec->sigrenderer_start_pos = 0;
+	dumb_dec->block_start_pos = 0;
 }
 
 
@@ -265,19 +373,66 @@ static void gst_dumb_dec_finalize(GObject *object)
 	g_return_if_fail(GST_IS_DUMB_DEC(object));
 	dumb_dec = GST_DUMB_DEC(object);
 
+	/* no checkpoint build can be running here, since builds hold a reference */
+	gst_dumb_dec_stop_renders(dumb_dec);
+	g_mutex_clear(&(dumb_dec->render_mutex));
+	g_cond_clear(&(dumb_dec->render_cond));
+
 	if (dumb_dec->subsongs != NULL)
 		g_array_free(dumb_dec->subsongs, TRUE);
 
+	gst_dumb_dec_end_stem_sigrenderers(dumb_dec);
+
 	if (dumb_dec->duh_sigrenderer != NULL)
 		duh_end_sigrenderer(dumb_dec->duh_sigrenderer);
 
 	if (dumb_dec->duh != NULL)
 		unload_duh(dumb_dec->duh);
 
+	/* unloaded after the sigrenderers, since these may have been started from it */
+	if (dumb_dec->checkpoint_duh != NULL)
+		unload_duh(dumb_dec->checkpoint_duh);
+	g_mutex_clear(&(dumb_dec->checkpoint_mutex));
+
+	if (dumb_dec->module_data != NULL)
+		gst_buffer_unref(dumb_dec->module_data);
+
+	if (dumb_dec->sample_buffer != NULL)
+		destroy_sample_buffer(dumb_dec->sample_buffer);
+
 	G_OBJECT_CLASS(gst_dumb_dec_parent_class)->finalize(object);
 }
 
 
+static GstStateChangeReturn gst_dumb_dec_change_state(GstElement *element, GstStateChange transition)
+{
+	GstStateChangeReturn ret;
+
+	ret = GST_ELEMENT_CLASS(gst_dumb_dec_parent_class)->change_state(element, transition);
+	if (ret == GST_STATE_CHANGE_FAILURE)
+		return ret;
+
+	switch (transition)
+	{
+		case GST_STATE_CHANGE_PAUSED_TO_READY:
+		{
+			/* the output task is stopped at this point; drop the renders,
+			 * so they are not reused after the module is loaded again */
+			GstNonstreamAudioDecoder *dec = GST_NONSTREAM_AUDIO_DECODER(element);
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			gst_dumb_dec_stop_renders(GST_DUMB_DEC(element));
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+			break;
+		}
+
+		default:
+			break;
+	}
+
+	return ret;
+}
+
+
 static void gst_dumb_dec_set_property(GObject *object, guint prop_id, const GValue *value, G_GNUC_UNUSED GParamSpec *pspec)
 {
 	GstNonstreamAudioDecoder *dec;
@@ -290,30 +445,27 @@ static void gst_dumb_dec_set_property(GObject *object, guint prop_id, const GVal
 	{
 		case PROP_RESAMPLING_QUALITY:
 		{
-			DUMB_IT_SIGRENDERER *itsr;
-
 			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
 			dumb_dec->resampling_quality = g_value_get_enum(value);
-			if (dumb_dec->duh_sigrenderer != NULL)
-			{
-				itsr = duh_get_it_sigrenderer(dumb_dec->duh_sigrenderer);
-				dumb_it_set_resampling_quality(itsr, dumb_dec->resampling_quality);
-			}
+			gst_dumb_dec_apply_render_settings(dumb_dec, dec->quality_degradation);
 			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
 
 			break;
 		}
 		case PROP_RAMP_STYLE:
 		{
-			DUMB_IT_SIGRENDERER *itsr;
-
 			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
 			dumb_dec->ramp_style = g_value_get_enum(value);
-			if (dumb_dec->duh_sigrenderer != NULL)
-			{
-				itsr = duh_get_it_sigrenderer(dumb_dec->duh_sigrenderer);
-				dumb_it_set_ramp_style(itsr, dumb_dec->ramp_style);
-			}
+			gst_dumb_dec_apply_render_settings(dumb_dec, dec->quality_degradation);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+
+			break;
+		}
+		case PROP_RENDER_THREADS:
+		{
+			/* takes effect the next time parallel rendering is started */
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			dumb_dec->render_threads = g_value_get_uint(value);
 			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
 
 			break;
@@ -343,6 +495,12 @@ static void gst_dumb_dec_get_property(GObject *object, guint prop_id, GValue *va
 			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(object);
 			break;
 
+		case PROP_RENDER_THREADS:
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(object);
+			g_value_set_uint(value, dumb_dec->render_threads);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(object);
+			break;
+
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
 			break;
@@ -353,6 +511,8 @@ static void gst_dumb_dec_get_property(GObject *object, guint prop_id, GValue *va
 static gboolean gst_dumb_dec_seek(GstNonstreamAudioDecoder *dec, GstClockTime *new_position)
 {
 	GstClockTime pos;
+	gboolean ret;
+	DUH *checkpoint_duh;
 	GstDumbDec *dumb_dec = GST_DUMB_DEC(dec);
 
 	if (dumb_dec->duh == NULL)
@@ -362,9 +522,66 @@ static gboolean gst_dumb_dec_seek(GstNonstreamAudioDecoder *dec, GstClockTime *n
 	}
 
 	dumb_dec->cur_loop_count = 0;
-	pos = gst_util_uint64_scale_int(*new_position, 65536, GST_SECOND) + dumb_dec->cur_subsong_start_pos;
+	pos = gst_util_uint64_scale_int(*new_position, 65536, GST_SECOND);
+
+	/* In the ALL subsong mode, the position covers all subsongs; find the
+	 * subsong it lies in. Parallel rendering restarts after that subsong. */
+	if (dumb_dec->subsong_mode == GST_NONSTREM_AUDIO_SUBSONG_MODE_ALL)
+	{
+		guint subsong = 0;
+		long subsong_start = 0;
 
-	if (!gst_dumb_dec_init_sigrenderer_at_pos(GST_DUMB_DEC(dec), pos))
+		gst_dumb_dec_stop_renders(dumb_dec);
+
+		while ((subsong + 1) < dumb_dec->num_subsongs)
+		{
+			long length = g_array_index(dumb_dec->subsongs, gst_dumb_dec_subsong_info, subsong).length;
+			if ((GstClockTime)(subsong_start + length) > pos)
+				break;
+			subsong_start += length;
+			++subsong;
+		}
+
+		if (!gst_dumb_dec_start_subsong(dumb_dec, subsong))
+		{
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+			GST_ELEMENT_ERROR(dec, STREAM, DECODE, (NULL), ("cannot reinitialize DUMB decoding"));
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			return FALSE;
+		}
+
+		dumb_dec->subsongs_played_length = subsong_start;
+		pos -= subsong_start;
+	}
+
+	pos += dumb_dec->cur_subsong_start_pos;
+
+	/* DUMB starts sigrenderers at the nearest checkpoint before the position and
+	 * renders the rest. If the checkpoints of the current subsong are not built
+	 * yet, the whole way from the subsong start has to be rendered. The
+	 * checkpoints of the main DUH (if any) always start at order 0. */
+	checkpoint_duh = gst_dumb_dec_get_checkpoint_duh(dumb_dec);
+	if (checkpoint_duh != NULL)
+	{
+		GST_DEBUG_OBJECT(dec, "seeking using the checkpoints of the current subsong");
+		ret = gst_dumb_dec_init_sigrenderer_at_pos(dumb_dec, checkpoint_duh, pos);
+	}
+	else if (dumb_dec->cur_subsong_info->start_order == 0)
+		ret = gst_dumb_dec_init_sigrenderer_at_pos(dumb_dec, dumb_dec->duh, pos);
+	else
+	{
+		GST_DEBUG_OBJECT(dec, "checkpoints are not ready yet - rendering from start order %ld", dumb_dec->cur_subsong_info->start_order);
+		ret = gst_dumb_dec_init_sigrenderer_at_order(dumb_dec, dumb_dec->cur_subsong_info->start_order);
+		if (ret && (pos > dumb_dec->sigrenderer_start_pos))
+		{
+			/* with a NULL sample buffer, DUMB only advances the playback state */
+			long skip_length = gst_util_uint64_scale_int(pos - dumb_dec->sigrenderer_start_pos, dumb_dec->sample_rate, 65536);
+			duh_sigrenderer_generate_samples(dumb_dec->duh_sigrenderer, 1.0f, 65536.0f / dumb_dec->sample_rate, skip_length, NULL);
+			dumb_dec->block_start_pos = duh_sigrenderer_get_position(dumb_dec->duh_sigrenderer);
+		}
+	}
+
+	if (!ret)
 	{
 		GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
 		GST_ELEMENT_ERROR(dec, STREAM, DECODE, (NULL), ("cannot reinitialize DUMB decoding"));
@@ -375,6 +592,7 @@ static gboolean gst_dumb_dec_seek(GstNonstreamAudioDecoder *dec, GstClockTime *n
 	{
 		*new_position = gst_dumb_dec_tell(dec);
 		GST_DEBUG_OBJECT(dec, "position after seeking: %" GST_TIME_FORMAT, GST_TIME_ARGS(*new_position));
+		gst_dumb_dec_start_renders(dumb_dec);
 		return TRUE;
 	}
 
@@ -387,13 +605,19 @@ static GstClockTime gst_dumb_dec_tell(GstNonstreamAudioDecoder *dec)
 	GstClockTime pos;
 	GstDumbDec *dumb_dec = GST_DUMB_DEC(dec);
 
-	if (dumb_dec->duh_sigrenderer == NULL)
+	if (dumb_dec->cur_render != NULL)
+		pos = gst_util_uint64_scale_int(dumb_dec->render_pos, GST_SECOND, dumb_dec->sample_rate);
+	else if (dumb_dec->duh_sigrenderer != NULL)
+	{
+		pos = duh_sigrenderer_get_position(dumb_dec->duh_sigrenderer) - dumb_dec->cur_subsong_start_pos;
+		if (!dumb_dec->do_actual_looping)
+			pos += dumb_dec->cur_subsong_info->length * dumb_dec->cur_loop_count;
+		pos = gst_util_uint64_scale_int(pos, GST_SECOND, 65536);
+	}
+	else
 		return 0;
 
-	pos = duh_sigrenderer_get_position(dumb_dec->duh_sigrenderer) - dumb_dec->cur_subsong_start_pos;
-	if (!dumb_dec->do_actual_looping)
-		pos += dumb_dec->cur_subsong_info->length * dumb_dec->cur_loop_count;
-	pos = gst_util_uint64_scale_int(pos, GST_SECOND, 65536);
+	pos += gst_util_uint64_scale_int(dumb_dec->subsongs_played_length, GST_SECOND, 65536);
 
 	return pos;
 }
@@ -411,14 +635,27 @@ static guint gst_dumb_dec_check_initial_subsong_index(GstDumbDec *dumb_dec, guin
 }
 
 
-static gboolean gst_dumb_dec_load_from_buffer(GstNonstreamAudioDecoder *dec, GstBuffer *source_data, guint initial_subsong, G_GNUC_UNUSED GstNonstreamAudioSubsongMode initial_subsong_mode, GstClockTime *initial_position, GstNonstreamAudioOutputMode *initial_output_mode, gint *initial_num_loops)
+static gboolean gst_dumb_dec_load_from_buffer(GstNonstreamAudioDecoder *dec, GstBuffer *source_data, guint initial_subsong, GstNonstreamAudioSubsongMode initial_subsong_mode, GstClockTime *initial_position, GstNonstreamAudioOutputMode *initial_output_mode, gint *initial_num_loops)
 {
 	gboolean ret;
+	gboolean checkpoints_built = FALSE;
 	GstDumbDec *dumb_dec = GST_DUMB_DEC(dec);
 
+	/* renders of a previously loaded module must not be output */
+	gst_dumb_dec_stop_renders(dumb_dec);
+
+	/* in the ALL subsong mode, playback always starts at the first subsong */
+	dumb_dec->subsong_mode = initial_subsong_mode;
+	dumb_dec->subsongs_played_length = 0;
+	if (initial_subsong_mode == GST_NONSTREM_AUDIO_SUBSONG_MODE_ALL)
+		initial_subsong = 0;
+
+	dumb_dec->sample_format = DEFAULT_SAMPLE_FORMAT;
 	dumb_dec->sample_rate = DEFAULT_SAMPLE_RATE;
 	dumb_dec->num_channels = DEFAULT_NUM_CHANNELS;
-	gst_nonstream_audio_decoder_get_downstream_info(dec, NULL, &(dumb_dec->sample_rate), &(dumb_dec->num_channels));
+	gst_nonstream_audio_decoder_get_downstream_info(dec, &(dumb_dec->sample_format), &(dumb_dec->sample_rate), &(dumb_dec->num_channels));
+	if ((dumb_dec->sample_format != GST_AUDIO_FORMAT_S16) && (dumb_dec->sample_format != GST_AUDIO_FORMAT_F32))
+		dumb_dec->sample_format = DEFAULT_SAMPLE_FORMAT;
 
 	{
 		GstMapInfo map;
@@ -427,8 +664,7 @@ static gboolean gst_dumb_dec_load_from_buffer(GstNonstreamAudioDecoder *dec, Gst
 		gst_buffer_map(source_data, &map, GST_MAP_READ);
 
 		{
-			int subsong_idx, num_psm_subsongs;
-			DUH *psm_duh;
+			int num_psm_subsongs;
 
 			dumb_dec->subsongs = NULL;
 
@@ -439,37 +675,31 @@ static gboolean gst_dumb_dec_load_from_buffer(GstNonstreamAudioDecoder *dec, Gst
 			if (num_psm_subsongs > 0)
 			{
 				GST_INFO_OBJECT(dec, "song data contains information about %d subsongs - reading", num_psm_subsongs);
-				gst_dumb_dec_subsong_info *subsong_info;
-				dumb_dec->subsongs = g_array_new(FALSE, FALSE, sizeof(gst_dumb_dec_subsong_info));
-				g_array_set_size(dumb_dec->subsongs, num_psm_subsongs);
-				subsong_info = (gst_dumb_dec_subsong_info *)(dumb_dec->subsongs->data);
-
-				for (subsong_idx = 0; subsong_idx < num_psm_subsongs; ++subsong_idx)
-				{
-					dumbfile = dumbfile_open_memory((char const *)(map.data), map.size);
-					psm_duh = dumb_read_any(dumbfile, 0/*restrict_*/, subsong_idx);
-					if (psm_duh != NULL)
-					{
-						long len = dumb_it_build_checkpoints(duh_get_it_sigdata(psm_duh), 0);
-						GST_DEBUG_OBJECT(dumb_dec, "subsong %d: length %ld", subsong_idx, len);
-						unload_duh(psm_duh);
-						subsong_info[subsong_idx].start_order = 0;
-						subsong_info[subsong_idx].length = len;
-					}
-					dumbfile_close(dumbfile);
-				}
 
 				dumb_dec->subsongs_explicit = TRUE;
 				dumb_dec->num_subsongs = num_psm_subsongs;
 				initial_subsong = gst_dumb_dec_check_initial_subsong_index(dumb_dec, initial_subsong);
+
+				/* The DUH of the initial subsong is read along with the others, so the song data
+				 * is parsed exactly once per subsong. The data is kept for subsong switches. */
+				dumb_dec->duh = gst_dumb_dec_read_psm_subsongs(dumb_dec, map.data, map.size, num_psm_subsongs, initial_subsong);
+				dumb_dec->module_data = gst_buffer_ref(source_data);
+
+				/* the subsongs are read with checkpoints, starting at order 0 */
+				checkpoints_built = TRUE;
 			}
 		}
 
-		dumbfile = dumbfile_open_memory((char const *)(map.data), map.size);
-
-		dumb_dec->duh = dumb_read_any(dumbfile, 0/*restrict_*/, dumb_dec->subsongs_explicit ? initial_subsong : (guint)0);
+		/* The quick variant skips the initial runthrough that builds the checkpoints.
+		 * These are built in the background instead. */
+		if (!(dumb_dec->subsongs_explicit))
+		{
+			dumbfile = dumbfile_open_memory((char const *)(map.data), map.size);
+			dumb_dec->duh = dumb_read_any_quick(dumbfile, 0/*restrict_*/, 0);
+			dumbfile_close(dumbfile);
+			dumb_dec->module_data = gst_buffer_ref(source_data);
+		}
 
-		dumbfile_close(dumbfile);
 		gst_buffer_unmap(source_data, &map);
 
 		if (dumb_dec->duh == NULL)
@@ -501,7 +731,11 @@ static gboolean gst_dumb_dec_load_from_buffer(GstNonstreamAudioDecoder *dec, Gst
 	if (dumb_dec->subsongs->len < 1)
 	{
 		gst_dumb_dec_subsong_info info;
-	
+
+		/* the length is only known after the runthrough; this builds the checkpoints as well */
+		dumb_it_do_initial_runthrough(dumb_dec->duh);
+		checkpoints_built = TRUE;
+
 		info.start_order = 0;
 		info.length = duh_get_length(dumb_dec->duh);
 
@@ -520,7 +754,7 @@ static gboolean gst_dumb_dec_load_from_buffer(GstNonstreamAudioDecoder *dec, Gst
 
 	if (dumb_dec->cur_subsong_info->start_order == 0)
 	{
-		ret = gst_dumb_dec_init_sigrenderer_at_pos(dumb_dec, 0);
+		ret = gst_dumb_dec_init_sigrenderer_at_pos(dumb_dec, dumb_dec->duh, 0);
 		dumb_dec->cur_subsong_start_pos = 0;
 	}
 	else
@@ -540,11 +774,16 @@ static gboolean gst_dumb_dec_load_from_buffer(GstNonstreamAudioDecoder *dec, Gst
 		return FALSE;
 	}
 
+	if (!checkpoints_built)
+		gst_dumb_dec_start_checkpoint_build(dumb_dec);
+
+	gst_dumb_dec_start_renders(dumb_dec);
+
 	/* Set output format */
 	if (!gst_nonstream_audio_decoder_set_output_format_simple(
 		dec,
 		dumb_dec->sample_rate,
-		GST_AUDIO_FORMAT_S16,
+		dumb_dec->sample_format,
 		dumb_dec->num_channels
 	))
 		return FALSE;
@@ -573,7 +812,6 @@ static gboolean gst_dumb_dec_load_from_buffer(GstNonstreamAudioDecoder *dec, Gst
 
 static gboolean gst_dumb_dec_set_current_subsong(GstNonstreamAudioDecoder *dec, guint subsong, GstClockTime *initial_position)
 {
-	gst_dumb_dec_subsong_info *subsong_info;
 	GstDumbDec *dumb_dec = GST_DUMB_DEC(dec);
 
 	if (dumb_dec->duh == NULL)
@@ -582,16 +820,75 @@ static gboolean gst_dumb_dec_set_current_subsong(GstNonstreamAudioDecoder *dec,
 		return FALSE;
 	}
 
+	/* setting the current subsong switches to the SINGLE subsong mode
+	 * (the base class switches its subsong mode as well) */
+	gst_dumb_dec_stop_renders(dumb_dec);
+	dumb_dec->subsong_mode = GST_NONSTREM_AUDIO_SUBSONG_MODE_SINGLE;
+	dumb_dec->subsongs_played_length = 0;
+
+	if (gst_dumb_dec_start_subsong(dumb_dec, subsong))
+	{
+		*initial_position = 0;
+		return TRUE;
+	}
+	else
+		return FALSE;
+}
+
+
+static gboolean gst_dumb_dec_start_subsong(GstDumbDec *dumb_dec, guint subsong)
+{
+	/* Starts the main sigrenderer at the beginning of the given subsong.
+	 * The caller must stop any parallel renders that refer to the DUH first. */
+
+	gst_dumb_dec_subsong_info *subsong_info;
+
 	subsong_info = &g_array_index(dumb_dec->subsongs, gst_dumb_dec_subsong_info, subsong);
 
+	/* Every PSM subsong is a separate DUH; the current one cannot play another subsong */
+	if (dumb_dec->subsongs_explicit && (subsong != dumb_dec->cur_subsong))
+	{
+		GstMapInfo map;
+		DUH *psm_duh;
+
+		gst_buffer_map(dumb_dec->module_data, &map, GST_MAP_READ);
+		psm_duh = gst_dumb_dec_read_psm_duh(map.data, map.size, subsong);
+		gst_buffer_unmap(dumb_dec->module_data, &map);
+
+		if (psm_duh == NULL)
+		{
+			GST_ERROR_OBJECT(dumb_dec, "could not read PSM subsong %u", subsong);
+			return FALSE;
+		}
+
+		/* the sigrenderers refer to the old DUH, so they must be ended before it is unloaded */
+		gst_dumb_dec_end_stem_sigrenderers(dumb_dec);
+		if (dumb_dec->duh_sigrenderer != NULL)
+		{
+			duh_end_sigrenderer(dumb_dec->duh_sigrenderer);
+			dumb_dec->duh_sigrenderer = NULL;
+		}
+		unload_duh(dumb_dec->duh);
+		dumb_dec->duh = psm_duh;
+		dumb_dec->cur_subsong = subsong;
+		dumb_dec->cur_subsong_info = subsong_info;
+	}
+
 	if (gst_dumb_dec_init_sigrenderer_at_order(dumb_dec, subsong_info->start_order))
 	{
 		long subsong_start_pos = dumb_dec->subsongs_explicit ? (long)0 : duh_sigrenderer_get_position(dumb_dec->duh_sigrenderer);
+		gboolean checkpoints_current = gst_dumb_dec_has_checkpoints_for(dumb_dec, subsong);
 
-		*initial_position = 0;
 		dumb_dec->cur_subsong = subsong;
 		dumb_dec->cur_subsong_info = subsong_info;
 		dumb_dec->cur_subsong_start_pos = subsong_start_pos;
+		dumb_dec->cur_render = NULL;
+		dumb_dec->render_pos = 0;
+
+		/* seeks within the same subsong keep using its checkpoints */
+		if (!checkpoints_current)
+			gst_dumb_dec_start_checkpoint_build(dumb_dec);
+
 		return TRUE;
 	}
 	else
@@ -599,6 +896,82 @@ static gboolean gst_dumb_dec_set_current_subsong(GstNonstreamAudioDecoder *dec,
 }
 
 
+static gboolean gst_dumb_dec_advance_subsong(GstDumbDec *dumb_dec)
+{
+	/* Called in the ALL subsong mode when the current subsong ended. The
+	 * next subsong is output from its parallel render if there is one, and
+	 * played by the main sigrenderer otherwise. */
+
+	guint next_subsong = dumb_dec->cur_subsong + 1;
+	long played_length = dumb_dec->cur_subsong_info->length;
+
+	if (next_subsong >= dumb_dec->num_subsongs)
+		return FALSE;
+
+	if ((dumb_dec->cur_render == NULL) && !(dumb_dec->do_actual_looping))
+		played_length *= dumb_dec->cur_loop_count + 1;
+	dumb_dec->subsongs_played_length += played_length;
+
+	if ((dumb_dec->subsong_renders != NULL) && (g_ptr_array_index(dumb_dec->subsong_renders, next_subsong) != NULL))
+	{
+		GST_DEBUG_OBJECT(dumb_dec, "continuing with subsong %u from its parallel render", next_subsong);
+
+		/* the stems are silent while a parallel render is output */
+		gst_dumb_dec_end_stem_sigrenderers(dumb_dec);
+
+		dumb_dec->cur_subsong = next_subsong;
+		dumb_dec->cur_subsong_info = &g_array_index(dumb_dec->subsongs, gst_dumb_dec_subsong_info, next_subsong);
+		dumb_dec->cur_render = g_ptr_array_index(dumb_dec->subsong_renders, next_subsong);
+		dumb_dec->render_pos = 0;
+	}
+	else
+	{
+		GST_DEBUG_OBJECT(dumb_dec, "continuing with subsong %u", next_subsong);
+
+		if (!gst_dumb_dec_start_subsong(dumb_dec, next_subsong))
+			return FALSE;
+	}
+
+	gst_nonstream_audio_decoder_handle_subsong_change(GST_NONSTREAM_AUDIO_DECODER(dumb_dec), next_subsong);
+
+	return TRUE;
+}
+
+
+static gboolean gst_dumb_dec_set_subsong_mode(GstNonstreamAudioDecoder *dec, GstNonstreamAudioSubsongMode mode, GstClockTime *initial_position)
+{
+	/* Entering the ALL subsong mode restarts playback at the first subsong,
+	 * leaving it restarts the current subsong. */
+
+	GstDumbDec *dumb_dec = GST_DUMB_DEC(dec);
+	guint subsong;
+
+	if (dumb_dec->duh == NULL)
+	{
+		dumb_dec->subsong_mode = mode;
+		*initial_position = GST_CLOCK_TIME_NONE;
+		return TRUE;
+	}
+
+	gst_dumb_dec_stop_renders(dumb_dec);
+
+	subsong = (mode == GST_NONSTREM_AUDIO_SUBSONG_MODE_ALL) ? 0 : dumb_dec->cur_subsong;
+	if (!gst_dumb_dec_start_subsong(dumb_dec, subsong))
+	{
+		GST_ERROR_OBJECT(dumb_dec, "could not restart playback at subsong %u", subsong);
+		return FALSE;
+	}
+
+	dumb_dec->subsong_mode = mode;
+	dumb_dec->subsongs_played_length = 0;
+	*initial_position = 0;
+
+	gst_dumb_dec_start_renders(dumb_dec);
+
+	return TRUE;
+}
+
+
 static guint gst_dumb_dec_get_current_subsong(GstNonstreamAudioDecoder *dec)
 {
 	GstDumbDec *dumb_dec = GST_DUMB_DEC(dec);
@@ -677,6 +1050,50 @@ static gboolean gst_dumb_dec_decode(GstNonstreamAudioDecoder *dec, GstBuffer **b
 
 	dumb_dec = GST_DUMB_DEC(dec);
 
+	if (dumb_dec->cur_render != NULL)
+	{
+		GstBuffer *rendered;
+
+		if (gst_dumb_dec_take_rendered_buffer(dumb_dec, &rendered))
+		{
+			gsize size;
+
+			/* the renders were stopped while waiting; continue at the new position */
+			if (rendered == NULL)
+				return gst_dumb_dec_decode(dec, buffer, num_samples);
+
+			/* Rendered blocks are copied into buffers from the negotiated
+			 * allocator. The render threads cannot allocate these themselves,
+			 * since allocating may renegotiate, which requires the decoder lock. */
+			size = gst_buffer_get_size(rendered);
+			outbuf = gst_nonstream_audio_decoder_allocate_output_buffer(dec, size);
+			if (G_LIKELY(outbuf != NULL))
+			{
+				gst_buffer_map(rendered, &map, GST_MAP_READ);
+				gst_buffer_fill(outbuf, 0, map.data, size);
+				gst_buffer_unmap(rendered, &map);
+			}
+			gst_buffer_unref(rendered);
+
+			if (G_UNLIKELY(outbuf == NULL))
+				return FALSE;
+
+			*buffer = outbuf;
+			*num_samples = size / (dumb_dec->num_channels * gst_audio_format_get_info(dumb_dec->sample_format)->width / 8);
+			dumb_dec->render_pos += *num_samples;
+
+			return TRUE;
+		}
+
+		if (!gst_dumb_dec_advance_subsong(dumb_dec))
+		{
+			GST_INFO_OBJECT(dumb_dec, "reached end of last subsong");
+			return FALSE;
+		}
+
+		return gst_dumb_dec_decode(dec, buffer, num_samples);
+	}
+
 	if (dumb_dec->loop_end_reached)
 	{
 		dumb_dec->loop_end_reached = FALSE;
@@ -684,27 +1101,34 @@ static gboolean gst_dumb_dec_decode(GstNonstreamAudioDecoder *dec, GstBuffer **b
 			gst_nonstream_audio_decoder_handle_loop(dec, gst_dumb_dec_tell(dec));
 	}
 
-	num_samples_per_outbuf = 1024;
-	num_bytes_per_outbuf = num_samples_per_outbuf * dumb_dec->num_channels * RENDER_BIT_DEPTH / 8;
+	num_samples_per_outbuf = RENDER_BLOCK_SIZE;
+	num_bytes_per_outbuf = num_samples_per_outbuf * dumb_dec->num_channels * gst_audio_format_get_info(dumb_dec->sample_format)->width / 8;
 
 	outbuf = gst_nonstream_audio_decoder_allocate_output_buffer(dec, num_bytes_per_outbuf);
 	if (G_UNLIKELY(outbuf == NULL))
 		return FALSE;
 
+	/* the stems of this block are rendered starting at the same position */
+	dumb_dec->block_start_pos = duh_sigrenderer_get_position(dumb_dec->duh_sigrenderer);
+
 	gst_buffer_map(outbuf, &map, GST_MAP_WRITE);
-	actual_num_samples_read = duh_render(dumb_dec->duh_sigrenderer, RENDER_BIT_DEPTH, 0, 1.0f, 65536.0f / dumb_dec->sample_rate, num_samples_per_outbuf, map.data);
+	actual_num_samples_read = gst_dumb_dec_render(dumb_dec, dumb_dec->duh_sigrenderer, num_samples_per_outbuf, map.data);
 	gst_buffer_unmap(outbuf, &map);
 
 	if (actual_num_samples_read == 0)
 	{
 		gst_buffer_unref(outbuf);
+
+		if ((dumb_dec->subsong_mode == GST_NONSTREM_AUDIO_SUBSONG_MODE_ALL) && gst_dumb_dec_advance_subsong(dumb_dec))
+			return gst_dumb_dec_decode(dec, buffer, num_samples);
+
 		GST_INFO_OBJECT(dumb_dec, "DUMB reached end of module");
 		return FALSE;
 	}
 	else
 	{
 		if (actual_num_samples_read != num_samples_per_outbuf)
-			gst_buffer_set_size(outbuf, actual_num_samples_read * dumb_dec->num_channels * RENDER_BIT_DEPTH / 8);
+			gst_buffer_set_size(outbuf, actual_num_samples_read * dumb_dec->num_channels * gst_audio_format_get_info(dumb_dec->sample_format)->width / 8);
 
 		*buffer = outbuf;
 		*num_samples = actual_num_samples_read;
@@ -714,6 +1138,72 @@ static gboolean gst_dumb_dec_decode(GstNonstreamAudioDecoder *dec, GstBuffer **b
 }
 
 
+static long gst_dumb_dec_render(GstDumbDec *dumb_dec, DUH_SIGRENDERER *sr, long num_samples, gpointer dest)
+{
+	return gst_dumb_dec_render_samples(
+		sr,
+		dumb_dec->sample_format, dumb_dec->sample_rate, dumb_dec->num_channels,
+		&(dumb_dec->sample_buffer), &(dumb_dec->sample_buffer_length),
+		num_samples, dest
+	);
+}
+
+
+static long gst_dumb_dec_render_samples(DUH_SIGRENDERER *sr, GstAudioFormat sample_format, gint sample_rate, gint num_channels, sample_t ***sample_buffer, long *sample_buffer_length, long num_samples, gpointer dest)
+{
+	/* For S16, duh_render() converts and clips DUMB's fixed point samples.
+	 * For F32, the samples are mixed into DUMB's own buffer and converted
+	 * without clipping. DUMB's buffers are interleaved for up to 2 channels,
+	 * so no reordering is necessary. */
+
+	long num_rendered;
+
+	if (sample_format == GST_AUDIO_FORMAT_S16)
+		return duh_render(sr, 16, 0, 1.0f, 65536.0f / sample_rate, num_samples, dest);
+
+	if (*sample_buffer_length < num_samples)
+	{
+		if (*sample_buffer != NULL)
+			destroy_sample_buffer(*sample_buffer);
+		*sample_buffer = allocate_sample_buffer(num_channels, num_samples);
+		if (*sample_buffer == NULL)
+		{
+			*sample_buffer_length = 0;
+			GST_ERROR("could not allocate sample buffer");
+			return 0;
+		}
+		*sample_buffer_length = num_samples;
+	}
+
+	/* DUMB adds to the existing buffer contents */
+	dumb_silence((*sample_buffer)[0], num_channels * num_samples);
+	num_rendered = duh_sigrenderer_generate_samples(sr, 1.0f, 65536.0f / sample_rate, num_samples, *sample_buffer);
+
+	gst_dumb_dec_convert_to_float((gfloat *)dest, (*sample_buffer)[0], num_rendered * num_channels);
+
+	return num_rendered;
+}
+
+
+static void gst_dumb_dec_convert_to_float(gfloat *dest, sample_t const *src, gsize num_values)
+{
+	gsize i = 0;
+
+#if defined(_USE_SSE) && defined(__SSE2__)
+	__m128 scale = _mm_set1_ps(1.0f / DUMB_SAMPLE_FULL_SCALE);
+
+	for (; (i + 4) <= num_values; i += 4)
+	{
+		__m128i values = _mm_loadu_si128((__m128i const *)(src + i));
+		_mm_storeu_ps(dest + i, _mm_mul_ps(_mm_cvtepi32_ps(values), scale));
+	}
+#endif
+
+	for (; i < num_values; ++i)
+		dest[i] = src[i] * (1.0f / DUMB_SAMPLE_FULL_SCALE);
+}
+
+
 static int gst_dumb_dec_loop_callback(void *ptr)
 {
 	gboolean continue_loop;
@@ -751,41 +1241,261 @@ static int gst_dumb_dec_loop_callback(void *ptr)
 }
 
 
-static gboolean gst_dumb_dec_init_sigrenderer_at_pos(GstDumbDec *dumb_dec, long seek_pos)
+static gboolean gst_dumb_dec_set_quality_degradation(GstNonstreamAudioDecoder *dec, guint degradation)
 {
-	DUH_SIGRENDERER *new_sr;
+	return gst_dumb_dec_apply_render_settings(GST_DUMB_DEC(dec), degradation);
+}
 
-	g_return_val_if_fail(dumb_dec->duh != NULL, FALSE);
 
-	new_sr = duh_start_sigrenderer(
-		dumb_dec->duh,
-		0,
-		dumb_dec->num_channels,
-		seek_pos
-	);
-	if (new_sr == NULL)
+static gboolean gst_dumb_dec_get_module_position(GstNonstreamAudioDecoder *dec, gint *order, gint *pattern, gint *row)
+{
+	GstDumbDec *dumb_dec = GST_DUMB_DEC(dec);
+	DUMB_IT_SIGRENDERER *itsr;
+	DUMB_IT_SIGDATA *itsd;
+
+	/* parallel renders do not report their position */
+	if ((dumb_dec->duh_sigrenderer == NULL) || (dumb_dec->cur_render != NULL))
 		return FALSE;
 
-	if (dumb_dec->duh_sigrenderer != NULL)
-		duh_end_sigrenderer(dumb_dec->duh_sigrenderer);
+	itsr = duh_get_it_sigrenderer(dumb_dec->duh_sigrenderer);
+	itsd = duh_get_it_sigdata(dumb_dec->duh);
 
-	dumb_dec->duh_sigrenderer = new_sr;
+	*order = dumb_it_sr_get_current_order(itsr);
+	*row = dumb_it_sr_get_current_row(itsr);
 
-	gst_dumb_dec_init_sigrenderer_common(dumb_dec);
+	/* order list entries >= n_patterns are skip and end markers */
+	if ((*order >= 0) && (*order < itsd->n_orders) && (itsd->order[*order] < itsd->n_patterns))
+		*pattern = itsd->order[*order];
+	else
+		*pattern = -1;
 
 	return TRUE;
 }
 
 
-static gboolean gst_dumb_dec_init_sigrenderer_at_order(GstDumbDec *dumb_dec, int order)
+static gboolean gst_dumb_dec_apply_render_settings(GstDumbDec *dumb_dec, guint degradation)
 {
-	DUH_SIGRENDERER *new_sr;
+	/* The QoS degradation is applied on top of the configured resampling
+	 * quality and ramp style. Each degradation level lowers the resampling
+	 * quality by one step; once aliasing is reached, the next level turns
+	 * off volume ramping. If the degradation goes beyond that, the cheapest
+	 * settings are applied, and FALSE is returned. */
 
-	g_return_val_if_fail(dumb_dec->duh != NULL, FALSE);
+	gint resampling_quality = dumb_dec->resampling_quality;
+	gint ramp_style = dumb_dec->ramp_style;
+	guint num_resampling_steps = resampling_quality - DUMB_RQ_ALIASING;
+	guint max_degradation = num_resampling_steps + ((ramp_style != DUMB_RAMP_STYLE_NONE) ? 1 : 0);
 
-	new_sr = dumb_it_start_at_order(
-		dumb_dec->duh,
-		dumb_dec->num_channels,
+	resampling_quality -= MIN(degradation, num_resampling_steps);
+	if (degradation > num_resampling_steps)
+		ramp_style = DUMB_RAMP_STYLE_NONE;
+
+	if (dumb_dec->duh_sigrenderer != NULL)
+	{
+		DUMB_IT_SIGRENDERER *itsr = duh_get_it_sigrenderer(dumb_dec->duh_sigrenderer);
+		dumb_it_set_resampling_quality(itsr, resampling_quality);
+		dumb_it_set_ramp_style(itsr, ramp_style);
+	}
+
+	{
+		guint i;
+		for (i = 0; i < GST_DUMB_DEC_MAX_STEMS; ++i)
+		{
+			DUMB_IT_SIGRENDERER *itsr;
+
+			if (dumb_dec->stem_sigrenderers[i] == NULL)
+				continue;
+
+			itsr = duh_get_it_sigrenderer(dumb_dec->stem_sigrenderers[i]);
+			dumb_it_set_resampling_quality(itsr, resampling_quality);
+			dumb_it_set_ramp_style(itsr, ramp_style);
+		}
+	}
+
+	GST_DEBUG_OBJECT(dumb_dec, "degradation %u: using resampling quality %d ramp style %d", degradation, resampling_quality, ramp_style);
+
+	return (degradation <= max_degradation);
+}
+
+
+static guint gst_dumb_dec_get_num_stems(GstNonstreamAudioDecoder *dec)
+{
+	/* one stem per module channel */
+	GstDumbDec *dumb_dec = GST_DUMB_DEC(dec);
+	DUMB_IT_SIGDATA *itsd;
+
+	if (dumb_dec->duh == NULL)
+		return 0;
+
+	itsd = duh_get_it_sigdata(dumb_dec->duh);
+	return MIN(itsd->n_pchannels, GST_DUMB_DEC_MAX_STEMS);
+}
+
+
+static gboolean gst_dumb_dec_decode_stems(GstNonstreamAudioDecoder *dec, guint const *stem_indices, GstBuffer **buffers, guint num_stems, guint num_samples)
+{
+	/* DUMB mixes all channels into one output, and cannot provide the
+	 * individual channel signals. Instead, each stem has its own sigrenderer
+	 * which plays the same song with all other channels muted. Muted channels
+	 * are not mixed, but every stem sigrenderer still processes the entire
+	 * module (patterns, effects, envelopes) on its own, so N stem pads cost
+	 * about N additional full renders. */
+
+	GstDumbDec *dumb_dec = GST_DUMB_DEC(dec);
+	guint num_module_stems = gst_dumb_dec_get_num_stems(dec);
+	gsize bytes_per_sample = dumb_dec->num_channels * gst_audio_format_get_info(dumb_dec->sample_format)->width / 8;
+	guint i;
+
+	/* Subsongs from parallel renders have no stem sigrenderers; the base
+	 * class fills the stems with silence */
+	if (dumb_dec->cur_render != NULL)
+		return TRUE;
+
+	for (i = 0; i < num_stems; ++i)
+	{
+		guint stem_index = stem_indices[i];
+		DUH_SIGRENDERER *sr;
+		GstMapInfo map;
+		long num_rendered;
+
+		/* unknown stems are left to the base class, which fills them with silence */
+		if (stem_index >= num_module_stems)
+			continue;
+
+		sr = dumb_dec->stem_sigrenderers[stem_index];
+		if (sr == NULL)
+		{
+			sr = gst_dumb_dec_create_stem_sigrenderer(dumb_dec, stem_index);
+			if (sr == NULL)
+			{
+				GST_WARNING_OBJECT(dumb_dec, "could not create sigrenderer for stem %u", stem_index);
+				continue;
+			}
+		}
+
+		buffers[i] = gst_nonstream_audio_decoder_allocate_output_buffer(dec, num_samples * bytes_per_sample);
+		if (G_UNLIKELY(buffers[i] == NULL))
+			return FALSE;
+
+		gst_buffer_map(buffers[i], &map, GST_MAP_WRITE);
+		num_rendered = gst_dumb_dec_render(dumb_dec, sr, num_samples, map.data);
+		/* the stem sigrenderer can end slightly earlier than the main one */
+		if (num_rendered < (long)num_samples)
+			memset(map.data + num_rendered * bytes_per_sample, 0, (num_samples - num_rendered) * bytes_per_sample);
+		gst_buffer_unmap(buffers[i], &map);
+	}
+
+	return TRUE;
+}
+
+
+static int gst_dumb_dec_stem_loop_callback(G_GNUC_UNUSED void *ptr)
+{
+	/* the main sigrenderer decides when playback ends */
+	return 0;
+}
+
+
+static DUH_SIGRENDERER* gst_dumb_dec_create_stem_sigrenderer(GstDumbDec *dumb_dec, guint stem_index)
+{
+	DUH_SIGRENDERER *sr;
+	DUMB_IT_SIGRENDERER *itsr;
+	int channel;
+
+	/* Start the stem where the current block started. Positions of
+	 * sigrenderers started at an order are relative to that order, so
+	 * in that case, start at the same order and skip ahead. */
+	if (dumb_dec->sigrenderer_start_order >= 0)
+	{
+		sr = dumb_it_start_at_order(dumb_dec->duh, dumb_dec->num_channels, dumb_dec->sigrenderer_start_order);
+		if (sr == NULL)
+			return NULL;
+
+		/* with a NULL sample buffer, DUMB only advances the playback state */
+		if (dumb_dec->block_start_pos > dumb_dec->sigrenderer_start_pos)
+		{
+			long skip_length = gst_util_uint64_scale_int(dumb_dec->block_start_pos - dumb_dec->sigrenderer_start_pos, dumb_dec->sample_rate, 65536);
+			duh_sigrenderer_generate_samples(sr, 1.0f, 65536.0f / dumb_dec->sample_rate, skip_length, NULL);
+		}
+	}
+	else
+	{
+		sr = duh_start_sigrenderer(dumb_dec->sigrenderer_duh, 0, dumb_dec->num_channels, dumb_dec->block_start_pos);
+		if (sr == NULL)
+			return NULL;
+	}
+
+	itsr = duh_get_it_sigrenderer(sr);
+
+	for (channel = 0; channel < GST_DUMB_DEC_MAX_STEMS; ++channel)
+		dumb_it_sr_set_channel_muted(itsr, channel, channel != (int)stem_index);
+
+	dumb_it_set_loop_callback(itsr, &gst_dumb_dec_stem_loop_callback, NULL);
+	dumb_it_set_xm_speed_zero_callback(itsr, &gst_dumb_dec_stem_loop_callback, NULL);
+	dumb_it_set_global_volume_zero_callback(itsr, &gst_dumb_dec_stem_loop_callback, NULL);
+
+	dumb_dec->stem_sigrenderers[stem_index] = sr;
+	gst_dumb_dec_apply_render_settings(dumb_dec, GST_NONSTREAM_AUDIO_DECODER(dumb_dec)->quality_degradation);
+
+	GST_DEBUG_OBJECT(dumb_dec, "created sigrenderer for stem %u at position %ld", stem_index, dumb_dec->block_start_pos);
+
+	return sr;
+}
+
+
+static void gst_dumb_dec_end_stem_sigrenderers(GstDumbDec *dumb_dec)
+{
+	guint i;
+
+	for (i = 0; i < GST_DUMB_DEC_MAX_STEMS; ++i)
+	{
+		if (dumb_dec->stem_sigrenderers[i] != NULL)
+		{
+			duh_end_sigrenderer(dumb_dec->stem_sigrenderers[i]);
+			dumb_dec->stem_sigrenderers[i] = NULL;
+		}
+	}
+}
+
+
+static gboolean gst_dumb_dec_init_sigrenderer_at_pos(GstDumbDec *dumb_dec, DUH *duh, long seek_pos)
+{
+	DUH_SIGRENDERER *new_sr;
+
+	g_return_val_if_fail(duh != NULL, FALSE);
+
+	new_sr = duh_start_sigrenderer(
+		duh,
+		0,
+		dumb_dec->num_channels,
+		seek_pos
+	);
+	if (new_sr == NULL)
+		return FALSE;
+
+	if (dumb_dec->duh_sigrenderer != NULL)
+		duh_end_sigrenderer(dumb_dec->duh_sigrenderer);
+
+	dumb_dec->duh_sigrenderer = new_sr;
+	dumb_dec->sigrenderer_duh = duh;
+	dumb_dec->sigrenderer_start_order = -1;
+	dumb_dec->sigrenderer_start_pos = seek_pos;
+
+	gst_dumb_dec_init_sigrenderer_common(dumb_dec);
+
+	return TRUE;
+}
+
+
+static gboolean gst_dumb_dec_init_sigrenderer_at_order(GstDumbDec *dumb_dec, int order)
+{
+	DUH_SIGRENDERER *new_sr;
+
+	g_return_val_if_fail(dumb_dec->duh != NULL, FALSE);
+
+	new_sr = dumb_it_start_at_order(
+		dumb_dec->duh,
+		dumb_dec->num_channels,
 		order
 	);
 	if (new_sr == NULL)
@@ -795,6 +1505,9 @@ static gboolean gst_dumb_dec_init_sigrenderer_at_order(GstDumbDec *dumb_dec, int
 		duh_end_sigrenderer(dumb_dec->duh_sigrenderer);
 
 	dumb_dec->duh_sigrenderer = new_sr;
+	dumb_dec->sigrenderer_duh = dumb_dec->duh;
+	dumb_dec->sigrenderer_start_order = order;
+	dumb_dec->sigrenderer_start_pos = duh_sigrenderer_get_position(new_sr);
 
 	gst_dumb_dec_init_sigrenderer_common(dumb_dec);
 
@@ -806,12 +1519,15 @@ static void gst_dumb_dec_init_sigrenderer_common(GstDumbDec *dumb_dec)
 {
 	dumb_dec->cur_loop_count = 0;
 	dumb_dec->loop_end_reached = FALSE;
+	dumb_dec->block_start_pos = dumb_dec->sigrenderer_start_pos;
+
+	/* the stems restart along with the main sigrenderer */
+	gst_dumb_dec_end_stem_sigrenderers(dumb_dec);
 
 	{
 		DUMB_IT_SIGRENDERER *itsr = duh_get_it_sigrenderer(dumb_dec->duh_sigrenderer);
 
-		dumb_it_set_resampling_quality(itsr, dumb_dec->resampling_quality);
-		dumb_it_set_ramp_style(itsr, dumb_dec->ramp_style);
+		gst_dumb_dec_apply_render_settings(dumb_dec, GST_NONSTREAM_AUDIO_DECODER(dumb_dec)->quality_degradation);
 
 		dumb_it_set_loop_callback(itsr, &gst_dumb_dec_loop_callback, dumb_dec);
 		dumb_it_set_xm_speed_zero_callback(itsr, &gst_dumb_dec_loop_callback, dumb_dec);
@@ -872,10 +1588,586 @@ static void dumb_it_convert_tempos( DUMB_IT_SIGDATA * itsd, gboolean vsync )
 }
 
 
+typedef struct
+{
+	guint8 const *data;
+	gsize size;
+	int subsong;
+	gboolean keep_duh;
+	DUH *duh;
+	long length;
+} gst_dumb_psm_subsong_task;
+
+
+static DUH* gst_dumb_dec_read_psm_duh(guint8 const *data, gsize size, int subsong)
+{
+	DUMBFILE *dumbfile;
+	DUH *duh;
+
+	/* the quick variant does not build checkpoints; this is done separately */
+	dumbfile = dumbfile_open_memory((char const *)data, size);
+	duh = dumb_read_any_quick(dumbfile, 0/*restrict_*/, subsong);
+	dumbfile_close(dumbfile);
+
+	return duh;
+}
+
+
+static void gst_dumb_dec_read_psm_subsong_func(gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+	/* Runs in a thread pool. Each task uses its own DUMBFILE and DUH, and
+	 * only reads the shared song data, so no locking is necessary. Building
+	 * the checkpoints yields the length as well. */
+
+	gst_dumb_psm_subsong_task *task = (gst_dumb_psm_subsong_task *)data;
+
+	task->duh = gst_dumb_dec_read_psm_duh(task->data, task->size, task->subsong);
+	if (task->duh == NULL)
+		return;
+
+	task->length = dumb_it_build_checkpoints(duh_get_it_sigdata(task->duh), 0);
+
+	if (!(task->keep_duh))
+	{
+		unload_duh(task->duh);
+		task->duh = NULL;
+	}
+}
+
+
+static DUH* gst_dumb_dec_read_psm_subsongs(GstDumbDec *dumb_dec, guint8 const *data, gsize size, int num_psm_subsongs, guint initial_subsong)
+{
+	/* PSM subsongs are separate songs that share the same file, and DUMB
+	 * reads (and decodes the samples of) one of them per dumb_read_any_quick()
+	 * call. Reading is sample-decoding bound, so the subsongs are read in
+	 * parallel, each one exactly once. Only the DUH of the initial subsong
+	 * is kept; the other subsongs are read again if they are switched to.
+	 * Subsongs that cannot be read get a length of 0. */
+
+	gst_dumb_psm_subsong_task *tasks;
+	gst_dumb_dec_subsong_info *subsong_info;
+	GThreadPool *pool;
+	GError *error = NULL;
+	gint max_threads;
+	DUH *initial_duh;
+	int subsong_idx;
+
+#if GLIB_CHECK_VERSION(2, 36, 0)
+	max_threads = MIN((gint)g_get_num_processors(), num_psm_subsongs);
+#else
+	max_threads = MIN(4, num_psm_subsongs);
+#endif
+
+	tasks = g_new0(gst_dumb_psm_subsong_task, num_psm_subsongs);
+
+	pool = NULL;
+	if (max_threads > 1)
+	{
+		pool = g_thread_pool_new(gst_dumb_dec_read_psm_subsong_func, NULL, max_threads, FALSE, &error);
+		if (pool == NULL)
+		{
+			GST_WARNING_OBJECT(dumb_dec, "could not create thread pool: %s - reading subsongs sequentially", error->message);
+			g_error_free(error);
+		}
+	}
+
+	for (subsong_idx = 0; subsong_idx < num_psm_subsongs; ++subsong_idx)
+	{
+		gst_dumb_psm_subsong_task *task = &(tasks[subsong_idx]);
+
+		task->data = data;
+		task->size = size;
+		task->subsong = subsong_idx;
+		task->keep_duh = ((guint)subsong_idx == initial_subsong);
+
+		if (pool != NULL)
+			g_thread_pool_push(pool, task, NULL);
+		else
+			gst_dumb_dec_read_psm_subsong_func(task, NULL);
+	}
+
+	/* waits until all tasks are finished */
+	if (pool != NULL)
+		g_thread_pool_free(pool, FALSE, TRUE);
+
+	dumb_dec->subsongs = g_array_new(FALSE, FALSE, sizeof(gst_dumb_dec_subsong_info));
+	g_array_set_size(dumb_dec->subsongs, num_psm_subsongs);
+	subsong_info = (gst_dumb_dec_subsong_info *)(dumb_dec->subsongs->data);
+
+	for (subsong_idx = 0; subsong_idx < num_psm_subsongs; ++subsong_idx)
+	{
+		GST_DEBUG_OBJECT(dumb_dec, "subsong %d: length %ld", subsong_idx, tasks[subsong_idx].length);
+		subsong_info[subsong_idx].start_order = 0;
+		subsong_info[subsong_idx].length = tasks[subsong_idx].length;
+	}
+
+	initial_duh = tasks[initial_subsong].duh;
+	g_free(tasks);
+
+	return initial_duh;
+}
+
+
+typedef struct
+{
+	GstDumbDec *dumb_dec;
+	GstBuffer *module_data;
+	guint subsong;
+	int start_order;
+	gboolean subsongs_explicit;
+	gboolean tempos_converted;
+	guint generation;
+}
+gst_dumb_dec_checkpoint_build;
+
+
+static void gst_dumb_dec_start_checkpoint_build(GstDumbDec *dumb_dec)
+{
+	/* Must be called after the main sigrenderer was (re)started from the
+	 * main DUH, since the previous checkpoint DUH is unloaded here.
+	 *
+	 * The build never has to be waited for, so this can be called with the
+	 * decoder lock held. A build that is still running for another subsong
+	 * becomes outdated, and discards its result once it is done. The build
+	 * gets copies of everything it needs, and holds a reference to the
+	 * decoder, so the decoder can be reloaded or finalized meanwhile. */
+
+	gst_dumb_dec_checkpoint_build *build;
+	GThread *thread;
+	GError *error = NULL;
+
+	build = g_slice_new(gst_dumb_dec_checkpoint_build);
+	build->dumb_dec = gst_object_ref(dumb_dec);
+	build->module_data = gst_buffer_ref(dumb_dec->module_data);
+	build->subsong = dumb_dec->cur_subsong;
+	build->start_order = dumb_dec->cur_subsong_info->start_order;
+	build->subsongs_explicit = dumb_dec->subsongs_explicit;
+	build->tempos_converted = dumb_dec->tempos_converted;
+
+	g_mutex_lock(&(dumb_dec->checkpoint_mutex));
+	if (dumb_dec->checkpoint_duh != NULL)
+	{
+		unload_duh(dumb_dec->checkpoint_duh);
+		dumb_dec->checkpoint_duh = NULL;
+	}
+	build->generation = ++(dumb_dec->checkpoint_generation);
+	dumb_dec->checkpoint_subsong = build->subsong;
+	dumb_dec->checkpoint_build_running = TRUE;
+	g_mutex_unlock(&(dumb_dec->checkpoint_mutex));
+
+	thread = g_thread_try_new("dumbdec-checkpoints", gst_dumb_dec_checkpoint_thread, build, &error);
+	if (thread == NULL)
+	{
+		GST_WARNING_OBJECT(dumb_dec, "could not start checkpoint thread: %s - seeking will render from the subsong start", error->message);
+		g_error_free(error);
+
+		g_mutex_lock(&(dumb_dec->checkpoint_mutex));
+		if (build->generation == dumb_dec->checkpoint_generation)
+			dumb_dec->checkpoint_build_running = FALSE;
+		g_mutex_unlock(&(dumb_dec->checkpoint_mutex));
+
+		gst_buffer_unref(build->module_data);
+		gst_object_unref(build->dumb_dec);
+		g_slice_free(gst_dumb_dec_checkpoint_build, build);
+	}
+	else
+		g_thread_unref(thread);
+}
+
+
+static gpointer gst_dumb_dec_checkpoint_thread(gpointer user_data)
+{
+	/* The checkpoints are built on a second DUH, so the playback DUH is
+	 * never touched by this thread. Once they are ready, seeks start
+	 * sigrenderers from the second DUH. Its song data is identical to the
+	 * playback DUH's (after applying the same tempo conversion). */
+
+	gst_dumb_dec_checkpoint_build *build = user_data;
+	GstDumbDec *dumb_dec = build->dumb_dec;
+	GstMapInfo map;
+	DUMBFILE *dumbfile;
+	DUH *duh;
+	long length = 0;
+	gboolean outdated;
+
+	gst_buffer_map(build->module_data, &map, GST_MAP_READ);
+	dumbfile = dumbfile_open_memory((char const *)(map.data), map.size);
+	duh = dumb_read_any_quick(dumbfile, 0/*restrict_*/, build->subsongs_explicit ? (int)(build->subsong) : 0);
+	dumbfile_close(dumbfile);
+	gst_buffer_unmap(build->module_data, &map);
+
+	if (duh != NULL)
+	{
+		if (build->tempos_converted)
+			dumb_it_convert_tempos(duh_get_it_sigdata(duh), TRUE);
+
+		length = dumb_it_build_checkpoints(duh_get_it_sigdata(duh), build->start_order);
+	}
+	else
+		GST_WARNING_OBJECT(dumb_dec, "could not read module data for building checkpoints");
+
+	g_mutex_lock(&(dumb_dec->checkpoint_mutex));
+	outdated = (build->generation != dumb_dec->checkpoint_generation);
+	if (!outdated)
+	{
+		dumb_dec->checkpoint_duh = duh;
+		dumb_dec->checkpoint_build_running = FALSE;
+	}
+	g_mutex_unlock(&(dumb_dec->checkpoint_mutex));
+
+	if (outdated)
+	{
+		GST_DEBUG_OBJECT(dumb_dec, "discarding outdated checkpoints for subsong %u", build->subsong);
+		if (duh != NULL)
+			unload_duh(duh);
+	}
+	else if (duh != NULL)
+		GST_DEBUG_OBJECT(dumb_dec, "built checkpoints for subsong %u (start order %d, length %ld)", build->subsong, build->start_order, length);
+
+	gst_buffer_unref(build->module_data);
+	gst_object_unref(build->dumb_dec);
+	g_slice_free(gst_dumb_dec_checkpoint_build, build);
+
+	return NULL;
+}
+
+
+static DUH* gst_dumb_dec_get_checkpoint_duh(GstDumbDec *dumb_dec)
+{
+	DUH *duh;
+
+	g_mutex_lock(&(dumb_dec->checkpoint_mutex));
+	duh = dumb_dec->checkpoint_duh;
+	g_mutex_unlock(&(dumb_dec->checkpoint_mutex));
+
+	return duh;
+}
+
+
+static gboolean gst_dumb_dec_has_checkpoints_for(GstDumbDec *dumb_dec, guint subsong)
+{
+	/* TRUE if the checkpoints of the given subsong exist or are being built */
+
+	gboolean ret;
+
+	g_mutex_lock(&(dumb_dec->checkpoint_mutex));
+	ret = (dumb_dec->checkpoint_subsong == subsong) && (dumb_dec->checkpoint_build_running || (dumb_dec->checkpoint_duh != NULL));
+	g_mutex_unlock(&(dumb_dec->checkpoint_mutex));
+
+	return ret;
+}
+
+
+typedef struct
+{
+	GstDumbDec *dumb_dec;
+	guint subsong;
+	/* one reference is held by subsong_renders, another one by the
+	 * streaming thread while it waits for the render */
+	gint refcount;
+	/* rendered blocks, and whether rendering is finished; protected by
+	 * the decoder's render_mutex */
+	GQueue buffers;
+	gboolean done;
+	/* render settings, copied when the render is created */
+	gint num_loops, cur_loop_count;
+	gint resampling_quality, ramp_style;
+} gst_dumb_dec_subsong_render;
+
+
+static void gst_dumb_dec_unref_render(gst_dumb_dec_subsong_render *render)
+{
+	GstBuffer *buffer;
+
+	if (!g_atomic_int_dec_and_test(&(render->refcount)))
+		return;
+
+	while ((buffer = g_queue_pop_head(&(render->buffers))) != NULL)
+		gst_buffer_unref(buffer);
+	g_slice_free(gst_dumb_dec_subsong_render, render);
+}
+
+
+static void gst_dumb_dec_start_renders(GstDumbDec *dumb_dec)
+{
+	/* In the ALL subsong mode, the subsongs after the current one are
+	 * independent of each other, so they can be rendered ahead in parallel
+	 * while the current one plays. This is only done when every subsong is
+	 * played exactly once without actual looping, since then the output of
+	 * each subsong is known in advance. Every subsong gets its own
+	 * sigrenderer; non-PSM subsongs share the main DUH, which is not
+	 * modified by its sigrenderers. Every PSM subsong is a separate DUH,
+	 * which its render has to read on its own, so with PSM modules, each
+	 * render thread holds another copy of the module's samples.
+	 *
+	 * The renders are bounded: a render waits once it is
+	 * RENDER_AHEAD_MAX_SECONDS ahead, until the output catches up. Since
+	 * the pool starts the renders in subsong order, the render of the
+	 * subsong that is output next is always running, so this cannot stall. */
+
+	GError *error = NULL;
+	guint subsong;
+
+	if ((dumb_dec->subsong_mode != GST_NONSTREM_AUDIO_SUBSONG_MODE_ALL) || (dumb_dec->render_threads <= 1) || dumb_dec->do_actual_looping || (dumb_dec->num_loops != 0))
+		return;
+	if ((dumb_dec->render_pool != NULL) || ((dumb_dec->cur_subsong + 1) >= dumb_dec->num_subsongs))
+		return;
+
+	/* the streaming thread renders the current subsong, so it counts as one of the threads */
+	dumb_dec->render_pool = g_thread_pool_new(gst_dumb_dec_render_subsong_func, dumb_dec, dumb_dec->render_threads - 1, FALSE, &error);
+	if (dumb_dec->render_pool == NULL)
+	{
+		GST_WARNING_OBJECT(dumb_dec, "could not create render thread pool: %s - rendering subsongs sequentially", error->message);
+		g_error_free(error);
+		return;
+	}
+
+	g_atomic_int_set(&(dumb_dec->stop_renders), 0);
+	dumb_dec->render_max_buffers = MAX(1, RENDER_AHEAD_MAX_SECONDS * dumb_dec->sample_rate / RENDER_BLOCK_SIZE);
+	dumb_dec->subsong_renders = g_ptr_array_new();
+	g_ptr_array_set_size(dumb_dec->subsong_renders, dumb_dec->num_subsongs);
+
+	/* the pool processes the renders in the order they are pushed */
+	for (subsong = dumb_dec->cur_subsong + 1; subsong < dumb_dec->num_subsongs; ++subsong)
+	{
+		gst_dumb_dec_subsong_render *render = g_slice_new0(gst_dumb_dec_subsong_render);
+
+		render->dumb_dec = dumb_dec;
+		render->subsong = subsong;
+		render->refcount = 1;
+		g_queue_init(&(render->buffers));
+		render->num_loops = dumb_dec->num_loops;
+		render->resampling_quality = dumb_dec->resampling_quality;
+		render->ramp_style = dumb_dec->ramp_style;
+
+		g_ptr_array_index(dumb_dec->subsong_renders, subsong) = render;
+		g_thread_pool_push(dumb_dec->render_pool, render, NULL);
+	}
+
+	GST_DEBUG_OBJECT(dumb_dec, "rendering subsongs %u to %u with %u threads", dumb_dec->cur_subsong + 1, dumb_dec->num_subsongs - 1, dumb_dec->render_threads - 1);
+}
+
+
+static void gst_dumb_dec_stop_renders(GstDumbDec *dumb_dec)
+{
+	/* Renders that are not started yet are dropped; running ones notice the
+	 * stop flag after their current block, or right away if they wait for
+	 * the output to catch up. Must not be called while a parallel render is
+	 * still needed for output, since the rendered data is discarded. Must
+	 * be called with the decoder lock held (except in finalize), since the
+	 * streaming thread only checks for stopped renders with the lock held. */
+
+	guint i;
+
+	if (dumb_dec->render_pool == NULL)
+		return;
+
+	g_mutex_lock(&(dumb_dec->render_mutex));
+	g_atomic_int_set(&(dumb_dec->stop_renders), 1);
+	++(dumb_dec->render_generation);
+	g_cond_broadcast(&(dumb_dec->render_cond));
+	g_mutex_unlock(&(dumb_dec->render_mutex));
+
+	g_thread_pool_free(dumb_dec->render_pool, TRUE, TRUE);
+	dumb_dec->render_pool = NULL;
+
+	for (i = 0; i < dumb_dec->subsong_renders->len; ++i)
+	{
+		gst_dumb_dec_subsong_render *render = g_ptr_array_index(dumb_dec->subsong_renders, i);
+		if (render != NULL)
+			gst_dumb_dec_unref_render(render);
+	}
+
+	g_ptr_array_free(dumb_dec->subsong_renders, TRUE);
+	dumb_dec->subsong_renders = NULL;
+	dumb_dec->cur_render = NULL;
+	dumb_dec->render_pos = 0;
+}
+
+
+static void gst_dumb_dec_render_subsong_func(gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+	/* Runs in the render thread pool. The output format, the subsong list,
+	 * the song data and (for non-PSM modules) the main DUH do not change
+	 * while renders exist, so they are read without locking. */
+
+	gst_dumb_dec_subsong_render *render = (gst_dumb_dec_subsong_render *)data;
+	GstDumbDec *dumb_dec = render->dumb_dec;
+	gst_dumb_dec_subsong_info *subsong_info = &g_array_index(dumb_dec->subsongs, gst_dumb_dec_subsong_info, render->subsong);
+	gsize bytes_per_sample = dumb_dec->num_channels * gst_audio_format_get_info(dumb_dec->sample_format)->width / 8;
+	sample_t **sample_buffer = NULL;
+	long sample_buffer_length = 0;
+	DUH *duh, *own_duh = NULL;
+	DUH_SIGRENDERER *sr = NULL;
+
+	/* every PSM subsong is a separate DUH */
+	if (dumb_dec->subsongs_explicit)
+	{
+		GstMapInfo map;
+
+		gst_buffer_map(dumb_dec->module_data, &map, GST_MAP_READ);
+		own_duh = gst_dumb_dec_read_psm_duh(map.data, map.size, render->subsong);
+		gst_buffer_unmap(dumb_dec->module_data, &map);
+
+		duh = own_duh;
+	}
+	else
+		duh = dumb_dec->duh;
+
+	if (duh != NULL)
+		sr = dumb_it_start_at_order(duh, dumb_dec->num_channels, subsong_info->start_order);
+
+	if (sr != NULL)
+	{
+		DUMB_IT_SIGRENDERER *itsr = duh_get_it_sigrenderer(sr);
+
+		dumb_it_set_resampling_quality(itsr, render->resampling_quality);
+		dumb_it_set_ramp_style(itsr, render->ramp_style);
+		dumb_it_set_loop_callback(itsr, &gst_dumb_dec_render_loop_callback, render);
+		dumb_it_set_xm_speed_zero_callback(itsr, &gst_dumb_dec_render_loop_callback, render);
+		dumb_it_set_global_volume_zero_callback(itsr, &gst_dumb_dec_render_loop_callback, render);
+
+		while (TRUE)
+		{
+			GstBuffer *buffer;
+			GstMapInfo map;
+			long num_rendered;
+			gboolean stop;
+
+			/* wait until there is room for another block */
+			g_mutex_lock(&(dumb_dec->render_mutex));
+			while ((g_queue_get_length(&(render->buffers)) >= dumb_dec->render_max_buffers) && !g_atomic_int_get(&(dumb_dec->stop_renders)))
+				g_cond_wait(&(dumb_dec->render_cond), &(dumb_dec->render_mutex));
+			stop = g_atomic_int_get(&(dumb_dec->stop_renders));
+			g_mutex_unlock(&(dumb_dec->render_mutex));
+
+			if (stop)
+				break;
+
+			/* this is only an intermediate block; the streaming thread copies
+			 * it into a buffer from the negotiated allocator */
+			buffer = gst_buffer_new_allocate(NULL, RENDER_BLOCK_SIZE * bytes_per_sample, NULL);
+
+			gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+			num_rendered = gst_dumb_dec_render_samples(
+				sr,
+				dumb_dec->sample_format, dumb_dec->sample_rate, dumb_dec->num_channels,
+				&sample_buffer, &sample_buffer_length,
+				RENDER_BLOCK_SIZE, map.data
+			);
+			gst_buffer_unmap(buffer, &map);
+
+			if (num_rendered == 0)
+			{
+				gst_buffer_unref(buffer);
+				break;
+			}
+
+			if (num_rendered != RENDER_BLOCK_SIZE)
+				gst_buffer_set_size(buffer, num_rendered * bytes_per_sample);
+
+			g_mutex_lock(&(dumb_dec->render_mutex));
+			g_queue_push_tail(&(render->buffers), buffer);
+			g_cond_broadcast(&(dumb_dec->render_cond));
+			g_mutex_unlock(&(dumb_dec->render_mutex));
+		}
+
+		duh_end_sigrenderer(sr);
+	}
+	else
+		GST_WARNING_OBJECT(dumb_dec, "could not start render of subsong %u", render->subsong);
+
+	if (sample_buffer != NULL)
+		destroy_sample_buffer(sample_buffer);
+	if (own_duh != NULL)
+		unload_duh(own_duh);
+
+	GST_DEBUG_OBJECT(dumb_dec, "finished render of subsong %u", render->subsong);
+
+	g_mutex_lock(&(dumb_dec->render_mutex));
+	render->done = TRUE;
+	g_cond_broadcast(&(dumb_dec->render_cond));
+	g_mutex_unlock(&(dumb_dec->render_mutex));
+}
+
+
+static int gst_dumb_dec_render_loop_callback(void *ptr)
+{
+	/* same as gst_dumb_dec_loop_callback(), but with the render's own loop counter */
+
+	gst_dumb_dec_subsong_render *render = (gst_dumb_dec_subsong_render *)ptr;
+
+	if (render->num_loops < 0)
+		return 0;
+	else if (render->cur_loop_count >= render->num_loops)
+		return 1;
+
+	++render->cur_loop_count;
+	return 0;
+}
+
+
+static gboolean gst_dumb_dec_take_rendered_buffer(GstDumbDec *dumb_dec, GstBuffer **rendered)
+{
+	/* Waits for the next block of the current parallel render. Returns FALSE
+	 * once all of its blocks were taken. Must be called with the decoder lock
+	 * held. The lock is released while waiting, so property changes are not
+	 * blocked by the render. If these stop the renders meanwhile, TRUE is
+	 * returned, and *rendered is set to NULL. */
+
+	GstNonstreamAudioDecoder *dec = GST_NONSTREAM_AUDIO_DECODER(dumb_dec);
+	gst_dumb_dec_subsong_render *render = (gst_dumb_dec_subsong_render *)(dumb_dec->cur_render);
+	guint generation;
+	gboolean stopped, done;
+
+	/* the render is freed when the renders are stopped, unless it is referenced */
+	g_atomic_int_inc(&(render->refcount));
+
+	g_mutex_lock(&(dumb_dec->render_mutex));
+	generation = dumb_dec->render_generation;
+	g_mutex_unlock(&(dumb_dec->render_mutex));
+
+	GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+
+	g_mutex_lock(&(dumb_dec->render_mutex));
+	while (g_queue_is_empty(&(render->buffers)) && !(render->done) && (generation == dumb_dec->render_generation))
+		g_cond_wait(&(dumb_dec->render_cond), &(dumb_dec->render_mutex));
+	stopped = (generation != dumb_dec->render_generation);
+	*rendered = stopped ? NULL : g_queue_pop_head(&(render->buffers));
+	done = (*rendered == NULL) && !stopped;
+	/* the render may be waiting for room in its queue */
+	g_cond_broadcast(&(dumb_dec->render_cond));
+	g_mutex_unlock(&(dumb_dec->render_mutex));
+
+	GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+
+	/* the renders may also have been stopped after the block was taken */
+	if (!stopped && (generation != dumb_dec->render_generation))
+	{
+		stopped = TRUE;
+		if (*rendered != NULL)
+		{
+			gst_buffer_unref(*rendered);
+			*rendered = NULL;
+		}
+	}
+
+	gst_dumb_dec_unref_render(render);
+
+	if (stopped)
+		GST_DEBUG_OBJECT(dumb_dec, "renders were stopped while waiting for subsong %u", dumb_dec->cur_subsong);
+
+	return !done;
+}
+
+
 typedef struct
 {
 	GstDumbDec *dumb_dec;
 	GArray *subsongs;
+	/* only used by the vblank timing scan thread */
+	DUH *duh;
+	int result;
 } gst_dumb_subsong_scan_context;
 
 
@@ -896,12 +2188,43 @@ static int gst_dumb_scan_callback(void *context, int order, long length)
 }
 
 
+static gpointer gst_dumb_scan_vblank_thread(gpointer user_data)
+{
+	/* Scans a second DUH with converted tempos, since the conversion
+	 * modifies the patterns, and the main DUH is scanned at the same time */
+
+	gst_dumb_subsong_scan_context *ctx = (gst_dumb_subsong_scan_context *)user_data;
+	GstMapInfo map;
+	DUMBFILE *dumbfile;
+
+	gst_buffer_map(ctx->dumb_dec->module_data, &map, GST_MAP_READ);
+	dumbfile = dumbfile_open_memory((char const *)(map.data), map.size);
+	ctx->duh = dumb_read_any_quick(dumbfile, 0/*restrict_*/, 0);
+	dumbfile_close(dumbfile);
+	gst_buffer_unmap(ctx->dumb_dec->module_data, &map);
+
+	if (ctx->duh == NULL)
+	{
+		ctx->result = -1;
+		return NULL;
+	}
+
+	dumb_it_convert_tempos(duh_get_it_sigdata(ctx->duh), TRUE);
+	ctx->result = dumb_it_scan_for_playable_orders(duh_get_it_sigdata(ctx->duh), gst_dumb_scan_callback, ctx);
+
+	return NULL;
+}
+
+
 static void gst_dumb_scan_for_subsongs(GstDumbDec *dumb_dec)
 {
 	char const *format;
 	int start_order;
 	int is_mod;
-	gst_dumb_subsong_scan_context ctx;
+	gboolean scan_vblank;
+	gst_dumb_subsong_scan_context ctx, vblank_ctx;
+	GThread *vblank_thread = NULL;
+	DUMB_IT_SIGDATA *itsd;
 	GArray *subsongs;
 
 	subsongs = g_array_new(FALSE, FALSE, sizeof(gst_dumb_dec_subsong_info));
@@ -909,26 +2232,52 @@ static void gst_dumb_scan_for_subsongs(GstDumbDec *dumb_dec)
 	ctx.dumb_dec = dumb_dec;
 	ctx.subsongs = subsongs;
 
+	itsd = duh_get_it_sigdata(dumb_dec->duh);
 	format = duh_get_tag(dumb_dec->duh, "FORMAT");
-	start_order = dumb_it_scan_for_playable_orders(duh_get_it_sigdata(dumb_dec->duh), gst_dumb_scan_callback, &ctx);
-
 	is_mod = (strcmp(format, "MOD") == 0);
 
-	if (!start_order && is_mod)
+	/* MOD files without both speed and tempo commands can use either CIA or
+	 * vblank timing, so these are scanned with both interpretations. Both
+	 * scans traverse the entire song, so the vblank timing scan runs in a
+	 * separate thread at the same time as the regular one. */
+	scan_vblank = is_mod && !dumb_it_test_for_speed_and_tempo(itsd);
+	if (scan_vblank)
 	{
-		DUMB_IT_SIGDATA *itsd = duh_get_it_sigdata(dumb_dec->duh);
+		GError *error = NULL;
+
+		GST_DEBUG_OBJECT(dumb_dec, "song format is MOD -> need to scan with vblank timing as well because of tempo conversion");
 
-		GST_DEBUG_OBJECT(dumb_dec, "song format is MOD -> need to repeat scan because of tempo conversion");
+		vblank_ctx.dumb_dec = dumb_dec;
+		vblank_ctx.subsongs = g_array_new(FALSE, FALSE, sizeof(gst_dumb_dec_subsong_info));
+		vblank_ctx.duh = NULL;
+		vblank_ctx.result = -1;
 
-		if (!dumb_it_test_for_speed_and_tempo(itsd))
+		vblank_thread = g_thread_try_new("dumbdec-vblank-scan", gst_dumb_scan_vblank_thread, &vblank_ctx, &error);
+		if (vblank_thread == NULL)
 		{
-			GArray *mod_subsongs;
-			mod_subsongs = g_array_new(FALSE, FALSE, sizeof(gst_dumb_dec_subsong_info));
-			ctx.subsongs = mod_subsongs;
+			GST_WARNING_OBJECT(dumb_dec, "could not start vblank timing scan thread: %s - scanning sequentially", error->message);
+			g_error_free(error);
+		}
+	}
+
+	start_order = dumb_it_scan_for_playable_orders(itsd, gst_dumb_scan_callback, &ctx);
+
+	if (scan_vblank)
+	{
+		if (vblank_thread != NULL)
+			g_thread_join(vblank_thread);
+
+		if (!start_order)
+		{
+			GArray *mod_subsongs = vblank_ctx.subsongs;
 
 			dumb_it_convert_tempos(itsd, TRUE);
-			start_order = dumb_it_scan_for_playable_orders(duh_get_it_sigdata(dumb_dec->duh), gst_dumb_scan_callback, &ctx);
-			if (!start_order)
+			dumb_dec->tempos_converted = TRUE;
+
+			if (vblank_thread == NULL)
+				vblank_ctx.result = dumb_it_scan_for_playable_orders(itsd, gst_dumb_scan_callback, &vblank_ctx);
+
+			if (!(vblank_ctx.result))
 			{
 				guint i;
 				long total_length_original;
@@ -960,9 +2309,11 @@ static void gst_dumb_scan_for_subsongs(GstDumbDec *dumb_dec)
 						subsong_info[i].length = mod_subsong_info[i].length;
 				}
 			}
-
-			g_array_free(mod_subsongs, TRUE);
 		}
+
+		if (vblank_ctx.duh != NULL)
+			unload_duh(vblank_ctx.duh);
+		g_array_free(vblank_ctx.subsongs, TRUE);
 	}
 
 	dumb_dec->subsongs = subsongs;
@@ -20,6 +20,10 @@ typedef struct _GstDumbDecClass GstDumbDecClass;
 #define GST_IS_DUMB_DEC_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE((klass), GST_TYPE_DUMB_DEC))
 
 
+/* maximum number of stems; same as the number of channels DUMB can play */
+#define GST_DUMB_DEC_MAX_STEMS 64
+
+
 typedef struct
 {
 	long start_order, length;
@@ -31,8 +35,14 @@ struct _GstDumbDec
 {
 	GstNonstreamAudioDecoder parent;
 
+	GstAudioFormat sample_format;
 	gint sample_rate, num_channels;
 
+	/* DUMB's mixing buffer for F32 output; holds sample_buffer_length
+	 * interleaved samples per channel */
+	sample_t **sample_buffer;
+	long sample_buffer_length;
+
 	gint cur_loop_count, num_loops;
 	gboolean loop_end_reached;
 	gboolean do_actual_looping;
@@ -48,6 +58,62 @@ struct _GstDumbDec
 	gboolean subsongs_explicit;
 	long cur_subsong_start_pos;
 
+	/* song data; kept around for reading DUHs in the background and for
+	 * reading the DUH of another PSM subsong when the subsong is switched
+	 * (every PSM subsong is a separate DUH). This is done for every module,
+	 * so the compressed song data stays in memory as long as it is loaded. */
+	GstBuffer *module_data;
+	/* set if the subsong scan converted MOD tempos to vblank timing */
+	gboolean tempos_converted;
+
+	/* Second DUH of the current subsong, with checkpoints that start at the
+	 * subsong's start order. It is built by a detached thread, and set once
+	 * it is ready. Since it is a complete copy of the module, it doubles the
+	 * memory used for sample data while it exists. DUMB cannot interrupt
+	 * building checkpoints, so instead of waiting for an outdated build,
+	 * checkpoint_generation is incremented, and the build discards its
+	 * result once it sees the mismatch. checkpoint_build_running is set while
+	 * a build of the current generation is in progress. checkpoint_mutex
+	 * protects these fields. */
+	GMutex checkpoint_mutex;
+	DUH *checkpoint_duh;
+	guint checkpoint_subsong;
+	guint checkpoint_generation;
+	gboolean checkpoint_build_running;
+	/* the DUH the main sigrenderer was started from */
+	DUH *sigrenderer_duh;
+
+	GstNonstreamAudioSubsongMode subsong_mode;
+	/* in the ALL subsong mode, the length of the subsongs before the current one */
+	long subsongs_played_length;
+
+	/* Parallel rendering of the subsongs after the current one in the ALL
+	 * subsong mode. subsong_renders has one entry per subsong (NULL for
+	 * subsongs that are not rendered in parallel). If cur_render is set, the
+	 * current subsong is output from there instead of the main sigrenderer,
+	 * and render_pos is the number of samples output from it so far.
+	 * Each render holds at most render_max_buffers blocks. render_mutex
+	 * protects the contents of the entries, stop_renders, and
+	 * render_generation, which is incremented whenever the renders are
+	 * stopped. render_mutex is never held while taking the decoder lock. */
+	guint render_threads;
+	GThreadPool *render_pool;
+	GPtrArray *subsong_renders;
+	GMutex render_mutex;
+	GCond render_cond;
+	gint stop_renders;
+	guint render_generation;
+	guint render_max_buffers;
+	gpointer cur_render;
+	guint64 render_pos;
+
+	/* one sigrenderer per stem, with all other channels muted; created on demand */
+	DUH_SIGRENDERER *stem_sigrenderers[GST_DUMB_DEC_MAX_STEMS];
+	/* where the main sigrenderer was started; the start order is -1 if it was started at a position */
+	int sigrenderer_start_order;
+	long sigrenderer_start_pos;
+	/* position of the main sigrenderer before the most recent decode call */
+	long block_start_pos;
 };
 
 
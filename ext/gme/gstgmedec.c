@@ -5,6 +5,15 @@
 #include <gst/gst.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#if defined(_USE_SSE) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "gstgmedec.h"
 #include <gme/gme_custom_dprintf.h>
@@ -20,14 +29,54 @@ enum
 	PROP_ECHO,
 	PROP_STEREO_SEPARATION,
 	PROP_ENABLE_EFFECTS,
-	PROP_ENABLE_SURROUND
+	PROP_ENABLE_SURROUND,
+	PROP_OUTPUT_BUFFER_SIZE,
+	PROP_FADE_LENGTH,
+	PROP_MAX_SEEK_SNAPSHOTS,
+	PROP_EMULATION_PROFILE,
+	PROP_M3U_LOCATION,
+	PROP_VOICE_NAMES,
+	PROP_MUTED_VOICES
 };
 
 
+/* emulation profiles */
+#define GME_EMULATION_PROFILE_FAST 0
+#define GME_EMULATION_PROFILE_BALANCED 1
+#define GME_EMULATION_PROFILE_ACCURATE 2
+
+
 #define DEFAULT_ECHO               0.2
 #define DEFAULT_STEREO_SEPARATION  0.2
 #define DEFAULT_ENABLE_EFFECTS     FALSE
 #define DEFAULT_ENABLE_SURROUND    TRUE
+#define DEFAULT_OUTPUT_BUFFER_SIZE 1024
+#define DEFAULT_FADE_LENGTH        8000
+#define DEFAULT_MAX_SEEK_SNAPSHOTS 0
+#define DEFAULT_EMULATION_PROFILE  GME_EMULATION_PROFILE_BALANCED
+#define DEFAULT_M3U_LOCATION       NULL
+#define DEFAULT_MUTED_VOICES       0
+
+/* Distance between seek snapshots if the track duration is unknown.
+ * Otherwise, the snapshots are spread evenly across the track, but
+ * are never closer to each other than the minimum interval. */
+#define SEEK_SNAPSHOT_INTERVAL     (30 * GST_SECOND)
+#define MIN_SEEK_SNAPSHOT_INTERVAL (10 * GST_SECOND)
+/* Each snapshot emulator holds its own copy of the song data (gme copies
+ * it when loading), so the number of snapshots is reduced for songs whose
+ * copies would exceed this in total. Only the song data copies count
+ * against this budget; the emulator state itself (sound chips, RAM,
+ * resampler buffers) comes on top of it and depends on the emulator type,
+ * which gme does not report. */
+#define MAX_SEEK_SNAPSHOT_MEMORY   (64 * 1024 * 1024)
+
+/* caps negotiation defaults; the sample rate default is only used for
+ * emulators without a native output rate */
+#define DEFAULT_SAMPLE_FORMAT GST_AUDIO_FORMAT_S16
+#define DEFAULT_SAMPLE_RATE 48000
+
+/* gme always renders stereo */
+#define NUM_CHANNELS 2
 
 
 
@@ -50,21 +99,88 @@ static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE(
 	)
 );
 
+#define SRC_CAPS \
+	"audio/x-raw, " \
+	"format = (string) { " GST_AUDIO_NE(S16) ", " GST_AUDIO_NE(F32) " }, " \
+	"layout = (string) interleaved, " \
+	"rate = (int) [ 1, 48000 ], " \
+	"channels = (int) 2 "
+
 static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE(
 	"src",
 	GST_PAD_SRC,
 	GST_PAD_ALWAYS,
-	GST_STATIC_CAPS(
-		"audio/x-raw, "
-		"format = (string) " GST_AUDIO_NE(S16) ", "
-		"layout = (string) interleaved, "
-		"rate = (int) [ 1, 48000 ], "
-		"channels = (int) 2 "
-	)
+	GST_STATIC_CAPS(SRC_CAPS)
+);
+
+static GstStaticPadTemplate stem_src_template = GST_STATIC_PAD_TEMPLATE(
+	GST_NONSTREAM_AUDIO_DECODER_STEM_SRC_NAME,
+	GST_PAD_SRC,
+	GST_PAD_REQUEST,
+	GST_STATIC_CAPS(SRC_CAPS)
 );
 
 
 
+/* Emulators whose accurate mode is cheap, since they only emulate simple sound
+ * chips. The balanced profile enables accuracy for these only. The others
+ * (like VGM with its FM chips) are noticeably slower in accurate mode. */
+static gchar const * const cheap_accuracy_types[] =
+{
+	"AY", "GBS", "HES", "KSS", "NSF", "NSFE", "SAP", "SGC",
+	NULL
+};
+
+
+/* Emulators that produce their output at a fixed rate and resample it to the
+ * requested one. If downstream accepts that rate, it is used, and the
+ * resampler is skipped. The other emulators synthesize directly at the
+ * output rate with Blip_Buffer, so for them, any rate is equally cheap. */
+typedef struct
+{
+	gchar const *type_extension;
+	gint native_rate;
+}
+GstGmeNativeRate;
+
+static GstGmeNativeRate const native_rates[] =
+{
+	{ "SPC", 32000 },
+	{ NULL, 0 }
+};
+
+
+
+/* Reads the song data for gme_load_custom() directly from the memories of
+ * the input buffer, one memory at a time, so the buffer is never merged into
+ * one contiguous copy. Gzip compressed data (like VGZ files) is inflated
+ * while it is read, straight into gme's data buffer. The first bytes of the
+ * (inflated) data are read in advance for identifying the file type, and
+ * are passed to gme before the rest of the stream. */
+typedef struct
+{
+	GstGmeDec *gme_dec;
+	GstBuffer *buffer;
+	guint num_memories, cur_memory;
+	GstMemory *memory;
+	GstMapInfo map;
+	gsize map_offset;
+
+	gsize data_size;
+
+	guint8 header[4];
+	gsize header_size, header_offset;
+
+	gboolean compressed;
+#ifdef HAVE_ZLIB_H
+	z_stream zstream;
+	gboolean zstream_initialized;
+#endif
+}
+GstGmeDecReader;
+
+
+
 G_DEFINE_TYPE(GstGmeDec, gst_gme_dec, GST_TYPE_NONSTREAM_AUDIO_DECODER)
 
 
@@ -77,8 +193,12 @@ static void gst_gme_dec_get_property(GObject *object, guint prop_id, GValue *val
 static gboolean gst_gme_dec_seek(GstNonstreamAudioDecoder *dec, GstClockTime *new_position);
 static GstClockTime gst_gme_dec_tell(GstNonstreamAudioDecoder *dec);
 
-static GstTagList* gst_gme_dec_tags_from_track_info(GstGmeDec *gme_dec, guint track_nr);
+static gst_gme_dec_track_info const * gst_gme_dec_get_track_info(GstGmeDec *gme_dec, guint track_nr);
+static void gst_gme_dec_clear_track_infos(GstGmeDec *gme_dec);
+static GstTagList* gst_gme_dec_tags_from_track_info(gme_info_t const *info);
 static GstClockTime gst_gme_dec_duration_from_track_info(GstGmeDec *gme_dec, guint track_nr);
+static gint gst_gme_dec_get_fade_start(GstGmeDec *gme_dec, gst_gme_dec_track_info const *track_info);
+static void gst_gme_dec_update_fade(GstGmeDec *gme_dec);
 
 static gboolean gst_gme_dec_load_from_buffer(GstNonstreamAudioDecoder *dec, GstBuffer *source_data, guint initial_subsong, GstNonstreamAudioSubsongMode initial_subsong_mode, GstClockTime *initial_position, GstNonstreamAudioOutputMode *initial_output_mode, gint *initial_num_loops);
 
@@ -90,12 +210,47 @@ static guint gst_gme_dec_get_current_subsong(GstNonstreamAudioDecoder *dec);
 static guint gst_gme_dec_get_num_subsongs(GstNonstreamAudioDecoder *dec);
 static GstClockTime gst_gme_dec_get_subsong_duration(GstNonstreamAudioDecoder *dec, guint subsong);
 static GstTagList* gst_gme_dec_get_subsong_tags(GstNonstreamAudioDecoder *dec, guint subsong);
+static guint64 gst_gme_dec_get_duration_settings_hash(GstNonstreamAudioDecoder *dec);
 
 static gboolean gst_gme_dec_set_num_loops(GstNonstreamAudioDecoder *dec, gint num_loops);
 static gint gst_gme_dec_get_num_loops(GstNonstreamAudioDecoder *dec);
 
 static guint gst_gme_dec_get_supported_output_modes(GstNonstreamAudioDecoder *dec);
 static gboolean gst_gme_dec_decode(GstNonstreamAudioDecoder *dec, GstBuffer **buffer, guint *num_samples);
+static gboolean gst_gme_dec_play(GstGmeDec *gme_dec, gme_t *emu, guint num_samples, gpointer dest);
+
+static guint gst_gme_dec_get_num_stems(GstNonstreamAudioDecoder *dec);
+static gboolean gst_gme_dec_decode_stems(GstNonstreamAudioDecoder *dec, guint const *stem_indices, GstBuffer **buffers, guint num_stems, guint num_samples);
+static gme_t* gst_gme_dec_create_stem_emu(GstGmeDec *gme_dec, guint stem_index);
+static void gst_gme_dec_seek_stem_emus(GstGmeDec *gme_dec, GstClockTime position);
+static void gst_gme_dec_restart_stem_emus(GstGmeDec *gme_dec);
+static void gst_gme_dec_delete_stem_emus(GstGmeDec *gme_dec);
+static void gst_gme_dec_apply_effects(GstGmeDec *gme_dec, gme_t *emu);
+static void gst_gme_dec_convert_to_float(gfloat *dest, gint16 const *src, gsize num_values);
+
+static gint gst_gme_dec_get_native_rate(guint8 const *data, gsize size);
+static gboolean gst_gme_dec_use_accuracy(GstGmeDec *gme_dec);
+
+static GType gst_gme_dec_emulation_profile_get_type(void);
+#define GST_TYPE_GME_DEC_EMULATION_PROFILE (gst_gme_dec_emulation_profile_get_type())
+
+static gboolean gst_gme_dec_reader_init(GstGmeDecReader *reader, GstGmeDec *gme_dec, GstBuffer *buffer);
+static void gst_gme_dec_reader_cleanup(GstGmeDecReader *reader);
+static gboolean gst_gme_dec_reader_next_input(GstGmeDecReader *reader, guint8 const **data, gsize *size);
+static gsize gst_gme_dec_reader_read_stream(GstGmeDecReader *reader, guint8 *out, gsize count);
+static gme_err_t gst_gme_dec_reader_read(void *your_data, void *out, int count);
+static gme_err_t gst_gme_dec_load_emu(GstGmeDecReader *reader, gint sample_rate, gme_t **emu);
+static gchar* gst_gme_dec_find_m3u(GstGmeDec *gme_dec);
+
+static void gst_gme_dec_start_snapshot_build(GstGmeDec *gme_dec);
+static void gst_gme_dec_clear_snapshots(GstGmeDec *gme_dec);
+static gpointer gst_gme_dec_snapshot_thread(gpointer user_data);
+static gboolean gst_gme_dec_use_snapshot(GstGmeDec *gme_dec, GstClockTime position);
+static gint gst_gme_dec_compare_snapshots(gconstpointer a, gconstpointer b);
+
+#ifdef HAVE_ZLIB_H
+static void gst_gme_dec_vgz_type_find(GstTypeFind *tf, gpointer user_data);
+#endif
 
 #ifdef CUSTOM_DPRINTF_FUNCTION
 static void gst_gme_dec_custom_dprintf(const char * fmt, va_list vl);
@@ -117,6 +272,7 @@ void gst_gme_dec_class_init(GstGmeDecClass *klass)
 
 	gst_element_class_add_pad_template(element_class, gst_static_pad_template_get(&sink_template));
 	gst_element_class_add_pad_template(element_class, gst_static_pad_template_get(&src_template));
+	gst_element_class_add_pad_template(element_class, gst_static_pad_template_get(&stem_src_template));
 
 	object_class->finalize = GST_DEBUG_FUNCPTR(gst_gme_dec_finalize);
 	object_class->set_property = GST_DEBUG_FUNCPTR(gst_gme_dec_set_property);
@@ -129,11 +285,14 @@ void gst_gme_dec_class_init(GstGmeDecClass *klass)
 	dec_class->get_num_loops = GST_DEBUG_FUNCPTR(gst_gme_dec_get_num_loops);
 	dec_class->get_supported_output_modes = GST_DEBUG_FUNCPTR(gst_gme_dec_get_supported_output_modes);
 	dec_class->decode = GST_DEBUG_FUNCPTR(gst_gme_dec_decode);
+	dec_class->get_num_stems = GST_DEBUG_FUNCPTR(gst_gme_dec_get_num_stems);
+	dec_class->decode_stems = GST_DEBUG_FUNCPTR(gst_gme_dec_decode_stems);
 	dec_class->set_current_subsong = GST_DEBUG_FUNCPTR(gst_gme_dec_set_current_subsong);
 	dec_class->get_current_subsong = GST_DEBUG_FUNCPTR(gst_gme_dec_get_current_subsong);
 	dec_class->get_num_subsongs = GST_DEBUG_FUNCPTR(gst_gme_dec_get_num_subsongs);
 	dec_class->get_subsong_duration = GST_DEBUG_FUNCPTR(gst_gme_dec_get_subsong_duration);
 	dec_class->get_subsong_tags = GST_DEBUG_FUNCPTR(gst_gme_dec_get_subsong_tags);
+	dec_class->get_duration_settings_hash = GST_DEBUG_FUNCPTR(gst_gme_dec_get_duration_settings_hash);
 
 	g_object_class_install_property(
 		object_class,
@@ -181,6 +340,95 @@ void gst_gme_dec_class_init(GstGmeDecClass *klass)
 			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
 		)
 	);
+	g_object_class_install_property(
+		object_class,
+		PROP_OUTPUT_BUFFER_SIZE,
+		g_param_spec_uint(
+			"output-buffer-size",
+			"Output buffer size",
+			"Size of each output buffer, in samples (actual size can be smaller than this during flush or EOS)",
+			1, G_MAXUINT / (NUM_CHANNELS * 4), /* NUM_CHANNELS*4 => stereo output with F32 samples; this ensures that no overflow can happen */
+			DEFAULT_OUTPUT_BUFFER_SIZE,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		)
+	);
+	g_object_class_install_property(
+		object_class,
+		PROP_FADE_LENGTH,
+		g_param_spec_uint(
+			"fade-length",
+			"Fade length",
+			"Length of the fade-out at the end of a track, in milliseconds",
+			0, G_MAXINT,
+			DEFAULT_FADE_LENGTH,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		)
+	);
+	g_object_class_install_property(
+		object_class,
+		PROP_MAX_SEEK_SNAPSHOTS,
+		g_param_spec_uint(
+			"max-seek-snapshots",
+			"Maximum number of seek snapshots",
+			"Maximum number of emulator instances that are kept at different positions of the current track "
+			"to speed up seeking (0 = disabled); each one emulates the track from its start up to its position "
+			"in a background thread, so N snapshots cost about N/2 emulations of the track, and each one holds "
+			"a copy of the song data (the song data copies are limited to 64 MB in total; emulator state is not counted); takes effect when the next track is started",
+			0, 256,
+			DEFAULT_MAX_SEEK_SNAPSHOTS,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		)
+	);
+	g_object_class_install_property(
+		object_class,
+		PROP_EMULATION_PROFILE,
+		g_param_spec_enum(
+			"emulation-profile",
+			"Emulation profile",
+			"Trade-off between emulation accuracy and speed; takes effect when the next track is started",
+			GST_TYPE_GME_DEC_EMULATION_PROFILE,
+			DEFAULT_EMULATION_PROFILE,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		)
+	);
+	g_object_class_install_property(
+		object_class,
+		PROP_M3U_LOCATION,
+		g_param_spec_string(
+			"m3u-location",
+			"M3U playlist location",
+			"Full path to an M3U playlist that selects, orders and names the tracks of the song; "
+			"if NULL, a playlist with the same name as the song and the extension .m3u is used if "
+			"upstream is a local file; takes effect when the next song is loaded",
+			DEFAULT_M3U_LOCATION,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		)
+	);
+	g_object_class_install_property(
+		object_class,
+		PROP_VOICE_NAMES,
+		g_param_spec_boxed(
+			"voice-names",
+			"Voice names",
+			"Names of the voices of the loaded song's emulator; the index of a voice is its bit in "
+			"muted-voices, and the index of its stem pad (stem pads exist for the first 8 voices only; "
+			"each one runs a separate emulator, so every stem costs about as much CPU as the main output)",
+			G_TYPE_STRV,
+			G_PARAM_READABLE | G_PARAM_STATIC_STRINGS
+		)
+	);
+	g_object_class_install_property(
+		object_class,
+		PROP_MUTED_VOICES,
+		g_param_spec_uint(
+			"muted-voices",
+			"Muted voices",
+			"Bitmask of the voices that are muted in the main output (bit N = voice N); does not affect stems",
+			0, G_MAXUINT,
+			DEFAULT_MUTED_VOICES,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		)
+	);
 
 	gst_element_class_set_static_metadata(
 		element_class,
@@ -206,6 +454,57 @@ void gst_gme_dec_init(GstGmeDec *gme_dec)
 	gme_dec->stereo_separation = DEFAULT_STEREO_SEPARATION;
 	gme_dec->enable_effects = DEFAULT_ENABLE_EFFECTS;
 	gme_dec->enable_surround = DEFAULT_ENABLE_SURROUND;
+	gme_dec->output_buffer_size = DEFAULT_OUTPUT_BUFFER_SIZE;
+	gme_dec->emulation_profile = DEFAULT_EMULATION_PROFILE;
+	gme_dec->type_extension = NULL;
+	gme_dec->m3u_location = g_strdup(DEFAULT_M3U_LOCATION);
+	gme_dec->m3u_path = NULL;
+	gme_dec->muted_voices = DEFAULT_MUTED_VOICES;
+
+	memset(gme_dec->stem_emus, 0, sizeof(gme_dec->stem_emus));
+	gme_dec->block_start_samples = 0;
+	gme_dec->fade_length = DEFAULT_FADE_LENGTH;
+	gme_dec->num_loops = 0;
+
+	gme_dec->sample_format = DEFAULT_SAMPLE_FORMAT;
+	gme_dec->sample_rate = DEFAULT_SAMPLE_RATE;
+
+	gme_dec->s16_buffer = NULL;
+	gme_dec->s16_buffer_size = 0;
+
+	gme_dec->track_infos = NULL;
+
+	gme_dec->song_data = NULL;
+	gme_dec->song_data_size = 0;
+
+	gme_dec->max_seek_snapshots = DEFAULT_MAX_SEEK_SNAPSHOTS;
+	gme_dec->snapshots = g_array_new(FALSE, FALSE, sizeof(gst_gme_dec_snapshot));
+	g_mutex_init(&(gme_dec->snapshot_mutex));
+	gme_dec->snapshot_generation = 0;
+}
+
+
+static GType gst_gme_dec_emulation_profile_get_type(void)
+{
+	static GType gst_gme_dec_emulation_profile_type = 0;
+
+	if (!gst_gme_dec_emulation_profile_type)
+	{
+		static GEnumValue emulation_profile_values[] =
+		{
+			{ GME_EMULATION_PROFILE_FAST,     "Fast (accurate emulation disabled)",                      "fast"     },
+			{ GME_EMULATION_PROFILE_BALANCED, "Balanced (accurate emulation for simple sound chips only)", "balanced" },
+			{ GME_EMULATION_PROFILE_ACCURATE, "Accurate (accurate emulation for all sound chips)",        "accurate" },
+			{ 0, NULL, NULL },
+		};
+
+		gst_gme_dec_emulation_profile_type = g_enum_register_static(
+			"GmeDecEmulationProfile",
+			emulation_profile_values
+		);
+	}
+
+	return gst_gme_dec_emulation_profile_type;
 }
 
 
@@ -216,8 +515,27 @@ static void gst_gme_dec_finalize(GObject *object)
 	g_return_if_fail(GST_IS_GME_DEC(object));
 	gme_dec = GST_GME_DEC(object);
 
+	/* a running snapshot build holds a reference, so it is done by now */
+	gst_gme_dec_clear_snapshots(gme_dec);
+	g_array_free(gme_dec->snapshots, TRUE);
+	g_mutex_clear(&(gme_dec->snapshot_mutex));
+
+	gst_gme_dec_clear_track_infos(gme_dec);
+
+	gst_gme_dec_delete_stem_emus(gme_dec);
+
 	if (gme_dec->emu != NULL)
 		gme_delete(gme_dec->emu);
+
+	if (gme_dec->song_data != NULL)
+		gst_buffer_unref(gme_dec->song_data);
+
+	g_free(gme_dec->m3u_location);
+	g_free(gme_dec->m3u_path);
+
+	g_free(gme_dec->s16_buffer);
+
+	G_OBJECT_CLASS(gst_gme_dec_parent_class)->finalize(object);
 }
 
 
@@ -235,6 +553,8 @@ static void gst_gme_dec_set_property(GObject *object, guint prop_id, const GValu
 		case PROP_STEREO_SEPARATION:
 		case PROP_ENABLE_EFFECTS:
 		case PROP_ENABLE_SURROUND:
+		case PROP_EMULATION_PROFILE:
+		case PROP_MUTED_VOICES:
 		{
 			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
 
@@ -252,6 +572,12 @@ static void gst_gme_dec_set_property(GObject *object, guint prop_id, const GValu
 				case PROP_ENABLE_SURROUND:
 					gme_dec->enable_surround = g_value_get_boolean(value);
 					break;
+				case PROP_EMULATION_PROFILE:
+					gme_dec->emulation_profile = g_value_get_enum(value);
+					break;
+				case PROP_MUTED_VOICES:
+					gme_dec->muted_voices = g_value_get_uint(value);
+					break;
 				default:
 					break;
 			}
@@ -262,6 +588,41 @@ static void gst_gme_dec_set_property(GObject *object, guint prop_id, const GValu
 
 			break;
 		}
+		case PROP_OUTPUT_BUFFER_SIZE:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			gme_dec->output_buffer_size = g_value_get_uint(value);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+			break;
+		}
+		case PROP_FADE_LENGTH:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			gme_dec->fade_length = g_value_get_uint(value);
+			if (gme_dec->emu != NULL)
+			{
+				/* the fade is part of the durations */
+				gst_gme_dec_update_fade(gme_dec);
+				gst_nonstream_audio_decoder_subsong_durations_changed(dec);
+			}
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+			break;
+		}
+		case PROP_MAX_SEEK_SNAPSHOTS:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			gme_dec->max_seek_snapshots = g_value_get_uint(value);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+			break;
+		}
+		case PROP_M3U_LOCATION:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			g_free(gme_dec->m3u_location);
+			gme_dec->m3u_location = g_value_dup_string(value);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+			break;
+		}
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
 			break;
@@ -279,6 +640,8 @@ static void gst_gme_dec_get_property(GObject *object, guint prop_id, GValue *val
 		case PROP_STEREO_SEPARATION:
 		case PROP_ENABLE_EFFECTS:
 		case PROP_ENABLE_SURROUND:
+		case PROP_EMULATION_PROFILE:
+		case PROP_MUTED_VOICES:
 		{
 			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(object);
 
@@ -296,6 +659,12 @@ static void gst_gme_dec_get_property(GObject *object, guint prop_id, GValue *val
 				case PROP_ENABLE_SURROUND:
 					g_value_set_boolean(value, gme_dec->enable_surround);
 					break;
+				case PROP_EMULATION_PROFILE:
+					g_value_set_enum(value, gme_dec->emulation_profile);
+					break;
+				case PROP_MUTED_VOICES:
+					g_value_set_uint(value, gme_dec->muted_voices);
+					break;
 				default:
 					break;
 			}
@@ -304,6 +673,52 @@ static void gst_gme_dec_get_property(GObject *object, guint prop_id, GValue *val
 
 			break;
 		}
+		case PROP_OUTPUT_BUFFER_SIZE:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(object);
+			g_value_set_uint(value, gme_dec->output_buffer_size);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(object);
+			break;
+		}
+		case PROP_FADE_LENGTH:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(object);
+			g_value_set_uint(value, gme_dec->fade_length);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(object);
+			break;
+		}
+		case PROP_MAX_SEEK_SNAPSHOTS:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(object);
+			g_value_set_uint(value, gme_dec->max_seek_snapshots);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(object);
+			break;
+		}
+		case PROP_M3U_LOCATION:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(object);
+			g_value_set_string(value, gme_dec->m3u_location);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(object);
+			break;
+		}
+		case PROP_VOICE_NAMES:
+		{
+			gchar **voice_names = NULL;
+
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(object);
+			if (gme_dec->emu != NULL)
+			{
+				gint i, num_voices = gme_voice_count(gme_dec->emu);
+
+				voice_names = g_new0(gchar *, num_voices + 1);
+				for (i = 0; i < num_voices; ++i)
+					voice_names[i] = g_strdup(gme_voice_name(gme_dec->emu, i));
+			}
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(object);
+
+			g_value_take_boxed(value, voice_names);
+			break;
+		}
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
 			break;
@@ -317,6 +732,11 @@ static gboolean gst_gme_dec_seek(GstNonstreamAudioDecoder *dec, GstClockTime *ne
 	GstGmeDec *gme_dec = GST_GME_DEC(dec);
 	g_return_val_if_fail(gme_dec->emu != NULL, FALSE);
 
+	/* gme_seek() emulates from the current position if the new position lies
+	 * ahead, and from the start of the track otherwise. Switching to a
+	 * snapshot that is closer to the new position shortens that. */
+	gst_gme_dec_use_snapshot(gme_dec, *new_position);
+
 	err = gme_seek(gme_dec->emu, *new_position / GST_MSECOND);
 	if (G_UNLIKELY(err != NULL))
 	{
@@ -325,6 +745,8 @@ static gboolean gst_gme_dec_seek(GstNonstreamAudioDecoder *dec, GstClockTime *ne
 	}
 	else
 	{
+		gst_gme_dec_seek_stem_emus(gme_dec, *new_position);
+
 		*new_position = gst_gme_dec_tell(dec);
 		GST_DEBUG_OBJECT(dec, "position after seeking: %" GST_TIME_FORMAT, GST_TIME_ARGS(*new_position));
 		return TRUE;
@@ -341,29 +763,87 @@ static GstClockTime gst_gme_dec_tell(GstNonstreamAudioDecoder *dec)
 }
 
 
-static GstTagList* gst_gme_dec_tags_from_track_info(GstGmeDec *gme_dec, guint track_nr)
+static gst_gme_dec_track_info const * gst_gme_dec_get_track_info(GstGmeDec *gme_dec, guint track_nr)
 {
-	GstTagList *tags;
-	gme_err_t err;
-	gme_info_t *track_info;
+	/* The base class queries the durations and tags of all tracks for every
+	 * TOC update, and gme_track_info() allocates and parses the information
+	 * each time. So, the information of all tracks is read once, when it is
+	 * first needed, and kept until another song is loaded. The tags are
+	 * kept as tag lists, which are handed out as new references. */
 
-	g_return_val_if_fail(gme_dec->emu != NULL, FALSE);
+	g_return_val_if_fail(gme_dec->emu != NULL, NULL);
+	g_return_val_if_fail(track_nr < gme_dec->num_tracks, NULL);
+
+	if (gme_dec->track_infos == NULL)
+	{
+		guint i;
 
-	tags = NULL;
+		gme_dec->track_infos = g_new0(gst_gme_dec_track_info, gme_dec->num_tracks);
 
-	err = gme_track_info(gme_dec->emu, &track_info, track_nr);
-	if (G_UNLIKELY(err != NULL))
+		for (i = 0; i < gme_dec->num_tracks; ++i)
+		{
+			gme_err_t err;
+			gme_info_t *info;
+			gst_gme_dec_track_info *track_info = &(gme_dec->track_infos[i]);
+
+			err = gme_track_info(gme_dec->emu, &info, i);
+			if (G_UNLIKELY(err != NULL))
+			{
+				GST_ERROR_OBJECT(gme_dec, "error while trying to get information of track %u: %s", i, err);
+				track_info->valid = FALSE;
+				continue;
+			}
+
+			GST_DEBUG_OBJECT(
+				gme_dec,
+				"track %u length stats:  length: %d  intro length: %d  loop length: %d  play length: %d",
+				i,
+				info->length,
+				info->intro_length,
+				info->loop_length,
+				info->play_length
+			);
+
+			track_info->valid = TRUE;
+			track_info->length = info->length;
+			track_info->intro_length = info->intro_length;
+			track_info->loop_length = info->loop_length;
+			track_info->play_length = info->play_length;
+			track_info->tags = gst_gme_dec_tags_from_track_info(info);
+
+			gme_free_info(info);
+		}
+	}
+
+	return gme_dec->track_infos[track_nr].valid ? &(gme_dec->track_infos[track_nr]) : NULL;
+}
+
+
+static void gst_gme_dec_clear_track_infos(GstGmeDec *gme_dec)
+{
+	guint i;
+
+	if (gme_dec->track_infos == NULL)
+		return;
+
+	for (i = 0; i < gme_dec->num_tracks; ++i)
 	{
-		gme_free_info(track_info);
-		GST_ERROR_OBJECT(gme_dec, "error while trying to get track information: %s", err);
-		return NULL;
+		if (gme_dec->track_infos[i].tags != NULL)
+			gst_tag_list_unref(gme_dec->track_infos[i].tags);
 	}
 
-	tags = gst_tag_list_new_empty();
+	g_free(gme_dec->track_infos);
+	gme_dec->track_infos = NULL;
+}
+
+
+static GstTagList* gst_gme_dec_tags_from_track_info(gme_info_t const *info)
+{
+	GstTagList *tags = gst_tag_list_new_empty();
 
 #define GME_ADD_TO_TAGS(INFO_FIELD, TAG_TYPE) \
-	if (track_info->INFO_FIELD && *(track_info->INFO_FIELD)) \
-		gst_tag_list_add(tags, GST_TAG_MERGE_REPLACE, (TAG_TYPE), track_info->INFO_FIELD, NULL);
+	if (info->INFO_FIELD && *(info->INFO_FIELD)) \
+		gst_tag_list_add(tags, GST_TAG_MERGE_REPLACE, (TAG_TYPE), info->INFO_FIELD, NULL);
 
 	GME_ADD_TO_TAGS(system, GST_TAG_ENCODER);
 	GME_ADD_TO_TAGS(game, GST_TAG_ALBUM);
@@ -375,67 +855,162 @@ static GstTagList* gst_gme_dec_tags_from_track_info(GstGmeDec *gme_dec, guint tr
 
 #undef GME_ADD_TO_TAGS
 
-	gme_free_info(track_info);
-
 	return tags;
 }
 
 
 static GstClockTime gst_gme_dec_duration_from_track_info(GstGmeDec *gme_dec, guint track_nr)
 {
-	gme_err_t err;
-	gme_info_t *track_info;
-	GstClockTime duration;
+	gst_gme_dec_track_info const *track_info;
+	gint fade_start;
 
-	err = gme_track_info(gme_dec->emu, &track_info, track_nr);
-	if (G_UNLIKELY(err != NULL))
-	{
-		GST_ERROR_OBJECT(gme_dec, "error while trying to get track information: %s", err);
-		duration = GST_CLOCK_TIME_NONE;
-	}
+	track_info = gst_gme_dec_get_track_info(gme_dec, track_nr);
+	if (G_UNLIKELY(track_info == NULL))
+		return GST_CLOCK_TIME_NONE;
+
+	/* the track ends once the fade-out is over */
+	fade_start = gst_gme_dec_get_fade_start(gme_dec, track_info);
+	if (fade_start < 0)
+		return GST_CLOCK_TIME_NONE;
 	else
+		return (GstClockTime)(fade_start + gme_dec->fade_length) * GST_MSECOND;
+}
+
+
+static gint gst_gme_dec_get_fade_start(GstGmeDec *gme_dec, gst_gme_dec_track_info const *track_info)
+{
+	/* Returns the position where the fade-out starts, in milliseconds, or -1
+	 * if the track plays forever. If the track has loop information, the
+	 * intro is played once, followed by the loop, which is repeated
+	 * num_loops times. Without loop information, the track cannot be looped,
+	 * and gme's play length is used (the track length if it is known, or a
+	 * default length otherwise). */
+
+	if (track_info->loop_length > 0)
 	{
-		GST_DEBUG_OBJECT(
-			gme_dec,
-			"track info length stats:  length: %d  intro length: %d  loop length: %d  play length: %d",
-			track_info->length,
-			track_info->intro_length,
-			track_info->loop_length,
-			track_info->play_length
-		);
-		duration = (GstClockTime)(track_info->play_length) * GST_MSECOND;
+		if (gme_dec->num_loops < 0)
+			return -1;
+		else
+			return MAX(track_info->intro_length, 0) + track_info->loop_length * (gme_dec->num_loops + 1);
 	}
+	else
+		return track_info->play_length;
+}
+
+
+static void gst_gme_dec_update_fade(GstGmeDec *gme_dec)
+{
+	/* Must be called after every gme_start_track() call, since
+	 * starting a track resets the fade */
+
+	gst_gme_dec_track_info const *track_info;
+	gint fade_start;
+	guint i;
+
+	track_info = gst_gme_dec_get_track_info(gme_dec, gme_dec->cur_track);
+	if (G_UNLIKELY(track_info == NULL))
+		return;
+
+	fade_start = gst_gme_dec_get_fade_start(gme_dec, track_info);
+
+	GST_DEBUG_OBJECT(gme_dec, "track %u: fade start: %d ms  fade length: %u ms", gme_dec->cur_track, fade_start, gme_dec->fade_length);
+
+	if (fade_start < 0)
+		gme_set_fade(gme_dec->emu, -1, 0);
+	else
+		gme_set_fade(gme_dec->emu, fade_start, gme_dec->fade_length);
 
-	gme_free_info(track_info);
+	/* the stems fade out along with the main output */
+	for (i = 0; i < GST_GME_DEC_MAX_STEMS; ++i)
+	{
+		if (gme_dec->stem_emus[i] == NULL)
+			continue;
 
-	return duration;
+		if (fade_start < 0)
+			gme_set_fade(gme_dec->stem_emus[i], -1, 0);
+		else
+			gme_set_fade(gme_dec->stem_emus[i], fade_start, gme_dec->fade_length);
+	}
 }
 
 
 static gboolean gst_gme_dec_load_from_buffer(GstNonstreamAudioDecoder *dec, GstBuffer *source_data, guint initial_subsong, G_GNUC_UNUSED GstNonstreamAudioSubsongMode initial_subsong_mode, GstClockTime *initial_position, GstNonstreamAudioOutputMode *initial_output_mode, gint *initial_num_loops)
 {
-	GstMapInfo map;
+	GstGmeDecReader reader;
 	gme_err_t err;
 	GstGmeDec *gme_dec;
-	gint sample_rate;
-	
+	gint native_rate;
+
 	gme_dec = GST_GME_DEC(dec);
 
-	sample_rate = 48000;
-	gst_nonstream_audio_decoder_get_downstream_info(dec, NULL, &sample_rate, NULL);
+	/* The base class allows loading again after the element was shut
+	 * down, so get rid of what is left of a previously loaded song.
+	 * The track information cache is sized for the old track count,
+	 * so it is cleared before num_tracks is overwritten. */
+	gst_gme_dec_clear_track_infos(gme_dec);
+	gme_dec->num_tracks = 0;
+	gst_gme_dec_delete_stem_emus(gme_dec);
+	gst_gme_dec_clear_snapshots(gme_dec);
+	if (gme_dec->emu != NULL)
+	{
+		gme_delete(gme_dec->emu);
+		gme_dec->emu = NULL;
+	}
+	if (gme_dec->song_data != NULL)
+	{
+		gst_buffer_unref(gme_dec->song_data);
+		gme_dec->song_data = NULL;
+	}
+	gme_dec->song_data_size = 0;
+	g_free(gme_dec->m3u_path);
+	gme_dec->m3u_path = NULL;
+
+	if (!gst_gme_dec_reader_init(&reader, gme_dec, source_data))
+		return FALSE;
+
+	if (gme_identify_extension(gme_identify_header(reader.header)) == NULL)
+	{
+		GST_ERROR_OBJECT(dec, "unknown file type");
+		gst_gme_dec_reader_cleanup(&reader);
+		return FALSE;
+	}
+
+	/* the returned string is static */
+	gme_dec->type_extension = gme_identify_header(reader.header);
+
+	/* Prefer the emulator's native rate if it has one; downstream
+	 * caps fixation picks the allowed rate that is closest to it */
+	native_rate = gst_gme_dec_get_native_rate(reader.header, reader.header_size);
+
+	gme_dec->sample_format = DEFAULT_SAMPLE_FORMAT;
+	gme_dec->sample_rate = (native_rate > 0) ? native_rate : DEFAULT_SAMPLE_RATE;
+	gst_nonstream_audio_decoder_get_downstream_info(dec, &(gme_dec->sample_format), &(gme_dec->sample_rate), NULL);
+	if ((gme_dec->sample_format != GST_AUDIO_FORMAT_S16) && (gme_dec->sample_format != GST_AUDIO_FORMAT_F32))
+		gme_dec->sample_format = DEFAULT_SAMPLE_FORMAT;
+
+	GST_DEBUG_OBJECT(
+		dec,
+		"native rate: %d  output rate: %d  output format: %s",
+		native_rate,
+		gme_dec->sample_rate,
+		gst_audio_format_to_string(gme_dec->sample_format)
+	);
 
 	/* Set output format */
 	if (!gst_nonstream_audio_decoder_set_output_format_simple(
 		dec,
-		sample_rate,
-		GST_AUDIO_FORMAT_S16,
-		2
+		gme_dec->sample_rate,
+		gme_dec->sample_format,
+		NUM_CHANNELS
 	))
+	{
+		gst_gme_dec_reader_cleanup(&reader);
 		return FALSE;
+	}
 
-	gst_buffer_map(source_data, &map, GST_MAP_READ);
-	err = gme_open_data(map.data, map.size, &(gme_dec->emu), sample_rate);
-	gst_buffer_unmap(source_data, &map);
+	err = gst_gme_dec_load_emu(&reader, gme_dec->sample_rate, &(gme_dec->emu));
+	gme_dec->song_data_size = reader.data_size;
+	gst_gme_dec_reader_cleanup(&reader);
 
 	if (G_UNLIKELY(err != NULL))
 	{
@@ -443,6 +1018,28 @@ static gboolean gst_gme_dec_load_from_buffer(GstNonstreamAudioDecoder *dec, GstB
 		return FALSE;
 	}
 
+	/* the snapshot builds load the song into more emulator instances */
+	gme_dec->song_data = gst_buffer_ref(source_data);
+
+	/* The playlist replaces the track list of the song. Since this happens
+	 * before the track information is read, only the tracks listed in the
+	 * playlist are ever probed. */
+	gme_dec->m3u_path = (gme_dec->m3u_location != NULL) ? g_strdup(gme_dec->m3u_location) : gst_gme_dec_find_m3u(gme_dec);
+	if (gme_dec->m3u_path != NULL)
+	{
+		err = gme_load_m3u(gme_dec->emu, gme_dec->m3u_path);
+		if (err == NULL)
+		{
+			GST_INFO_OBJECT(dec, "using M3U playlist \"%s\"", gme_dec->m3u_path);
+		}
+		else
+		{
+			GST_WARNING_OBJECT(dec, "could not load M3U playlist \"%s\": %s - using the tracks of the song", gme_dec->m3u_path, err);
+			g_free(gme_dec->m3u_path);
+			gme_dec->m3u_path = NULL;
+		}
+	}
+
 	gme_dec->num_tracks = gme_track_count(gme_dec->emu);
 	if (G_UNLIKELY(initial_subsong >= gme_dec->num_tracks))
 	{
@@ -452,6 +1049,8 @@ static gboolean gst_gme_dec_load_from_buffer(GstNonstreamAudioDecoder *dec, GstB
 
 	GST_INFO_OBJECT(gme_dec, "%d track(s) (= subsong(s)) available", gme_dec->num_tracks);
 
+	/* gme applies the accuracy setting when a track is started */
+	gme_enable_accuracy(gme_dec->emu, gst_gme_dec_use_accuracy(gme_dec));
 	err = gme_start_track(gme_dec->emu, initial_subsong);
 	if (G_UNLIKELY(err != NULL))
 	{
@@ -459,28 +1058,50 @@ static gboolean gst_gme_dec_load_from_buffer(GstNonstreamAudioDecoder *dec, GstB
 		return FALSE;
 	}
 
+	gme_dec->cur_track = initial_subsong;
+	gme_dec->num_loops = *initial_num_loops;
+	gst_gme_dec_update_fade(gme_dec);
+
 	*initial_position = 0;
 	*initial_output_mode = GST_NONSTREM_AUDIO_OUTPUT_MODE_STEADY;
 
 	gst_gme_dec_update_effects(gme_dec);
 
+	gst_gme_dec_start_snapshot_build(gme_dec);
+
 	return TRUE;
 }
 
 
 static void gst_gme_dec_update_effects(GstGmeDec *gme_dec)
 {
-	gme_effects_t effects;
+	guint i;
 
 	if (gme_dec->emu == NULL)
 		return;
 
-	gme_effects(gme_dec->emu, &effects);
+	gst_gme_dec_apply_effects(gme_dec, gme_dec->emu);
+	gme_mute_voices(gme_dec->emu, gme_dec->muted_voices);
+
+	/* the stem emulators keep their own mute masks */
+	for (i = 0; i < GST_GME_DEC_MAX_STEMS; ++i)
+	{
+		if (gme_dec->stem_emus[i] != NULL)
+			gst_gme_dec_apply_effects(gme_dec, gme_dec->stem_emus[i]);
+	}
+}
+
+
+static void gst_gme_dec_apply_effects(GstGmeDec *gme_dec, gme_t *emu)
+{
+	gme_effects_t effects;
+
+	gme_effects(emu, &effects);
 	effects.echo = gme_dec->echo;
 	effects.stereo = gme_dec->stereo_separation;
 	effects.enabled = gme_dec->enable_effects;
 	effects.surround = gme_dec->enable_surround;
-	gme_set_effects(gme_dec->emu, &effects);
+	gme_set_effects(emu, &effects);
 }
 
 
@@ -490,6 +1111,8 @@ static gboolean gst_gme_dec_set_current_subsong(GstNonstreamAudioDecoder *dec, g
 	GstGmeDec *gme_dec = GST_GME_DEC(dec);
 	g_return_val_if_fail(gme_dec->emu != NULL, FALSE);
 
+	/* picks up emulation profile changes */
+	gme_enable_accuracy(gme_dec->emu, gst_gme_dec_use_accuracy(gme_dec));
 	err = gme_start_track(gme_dec->emu, subsong);
 	if (G_UNLIKELY(err != NULL))
 	{
@@ -498,8 +1121,13 @@ static gboolean gst_gme_dec_set_current_subsong(GstNonstreamAudioDecoder *dec, g
 	}
 
 	gme_dec->cur_track = subsong;
+	gst_gme_dec_restart_stem_emus(gme_dec);
+	gst_gme_dec_update_fade(gme_dec);
 	*initial_position = 0;
 
+	/* the snapshots of the previous track are useless now */
+	gst_gme_dec_start_snapshot_build(gme_dec);
+
 	return TRUE;
 }
 
@@ -526,7 +1154,13 @@ static GstClockTime gst_gme_dec_get_subsong_duration(GstNonstreamAudioDecoder *d
 
 static GstTagList* gst_gme_dec_get_subsong_tags(GstNonstreamAudioDecoder *dec, guint subsong)
 {
-	return gst_gme_dec_tags_from_track_info(GST_GME_DEC(dec), subsong);
+	gst_gme_dec_track_info const *track_info = gst_gme_dec_get_track_info(GST_GME_DEC(dec), subsong);
+
+	/* the base class makes the tag list writable before modifying it */
+	if ((track_info == NULL) || (track_info->tags == NULL))
+		return NULL;
+	else
+		return gst_tag_list_ref(track_info->tags);
 }
 
 
@@ -536,42 +1170,83 @@ static guint gst_gme_dec_get_supported_output_modes(G_GNUC_UNUSED GstNonstreamAu
 }
 
 
-/* TODO: looping control */
-static gboolean gst_gme_dec_set_num_loops(GstNonstreamAudioDecoder *dec, gint num_loops)
+static guint64 gst_gme_dec_get_duration_settings_hash(GstNonstreamAudioDecoder *dec)
 {
-	return 0;
+	/* the fade length is part of the durations, and an M3U playlist
+	 * can define the track lengths */
+	GstGmeDec *gme_dec = GST_GME_DEC(dec);
+	guint64 hash = gme_dec->fade_length;
+
+	if (gme_dec->m3u_path != NULL)
+		hash |= ((guint64)g_str_hash(gme_dec->m3u_path)) << 32;
+
+	return hash;
 }
 
 
-static gint gst_gme_dec_get_num_loops(GstNonstreamAudioDecoder *dec)
+static gboolean gst_gme_dec_set_num_loops(GstNonstreamAudioDecoder *dec, gint num_loops)
 {
-	return 0;
+	/* gme emulates the loops as part of the track; the number of loops
+	 * only determines where the fade-out starts, and therefore the
+	 * durations of all tracks */
+
+	GstGmeDec *gme_dec = GST_GME_DEC(dec);
+
+	gme_dec->num_loops = num_loops;
+
+	if (gme_dec->emu != NULL)
+	{
+		gst_gme_dec_update_fade(gme_dec);
+		gst_nonstream_audio_decoder_subsong_durations_changed(dec);
+	}
+
+	return TRUE;
+}
+
+
+static gint gst_gme_dec_get_num_loops(GstNonstreamAudioDecoder *dec)
+{
+	GstGmeDec *gme_dec = GST_GME_DEC(dec);
+	return gme_dec->num_loops;
 }
 
 
 static gboolean gst_gme_dec_decode(GstNonstreamAudioDecoder *dec, GstBuffer **buffer, guint *num_samples)
 {
-	gme_err_t err;
 	GstGmeDec *gme_dec;
 	GstBuffer *outbuf;
 	GstMapInfo map;
-
-	gint const num_samples_per_outbuf = 1024;
-	gint const num_bytes_per_outbuf = num_samples_per_outbuf * 2 * 2; // 2 bytes per sample, 2 channels
+	guint num_samples_per_outbuf;
+	gsize num_bytes_per_outbuf;
+	gboolean ret;
 
 	gme_dec = GST_GME_DEC(dec);
 
+	/* the track ends once the fade-out is over */
+	if (gme_track_ended(gme_dec->emu))
+	{
+		GST_INFO_OBJECT(dec, "gme reached end of track");
+		return FALSE;
+	}
+
+	num_samples_per_outbuf = gme_dec->output_buffer_size;
+	num_bytes_per_outbuf = num_samples_per_outbuf * NUM_CHANNELS * gst_audio_format_get_info(gme_dec->sample_format)->width / 8;
+
 	outbuf = gst_nonstream_audio_decoder_allocate_output_buffer(dec, num_bytes_per_outbuf);
 	if (G_UNLIKELY(outbuf == NULL))
 		return FALSE;
 
 	gst_buffer_map(outbuf, &map, GST_MAP_WRITE);
-	err = gme_play(gme_dec->emu, num_samples_per_outbuf * 2 /* 2 channels */ , (short *) (map.data));
+
+	/* the stems of this block are rendered starting at the same position */
+	gme_dec->block_start_samples = gme_tell_samples(gme_dec->emu);
+
+	ret = gst_gme_dec_play(gme_dec, gme_dec->emu, num_samples_per_outbuf, map.data);
+
 	gst_buffer_unmap(outbuf, &map);
 
-	if (G_UNLIKELY(err != NULL))
+	if (G_UNLIKELY(!ret))
 	{
-		GST_ERROR_OBJECT(dec, "error while decoding: %s", err);
 		gst_buffer_unref(outbuf);
 		return FALSE;
 	}
@@ -583,6 +1258,864 @@ static gboolean gst_gme_dec_decode(GstNonstreamAudioDecoder *dec, GstBuffer **bu
 }
 
 
+static gboolean gst_gme_dec_play(GstGmeDec *gme_dec, gme_t *emu, guint num_samples, gpointer dest)
+{
+	gme_err_t err;
+	gsize num_values = num_samples * NUM_CHANNELS;
+
+	if (gme_dec->sample_format == GST_AUDIO_FORMAT_S16)
+	{
+		err = gme_play(emu, num_values, (short *)dest);
+	}
+	else
+	{
+		/* gme only renders S16 samples; these are rendered into a
+		 * scratch buffer and converted to the output buffer */
+		if (gme_dec->s16_buffer_size < num_values)
+		{
+			g_free(gme_dec->s16_buffer);
+			gme_dec->s16_buffer = g_new(gint16, num_values);
+			gme_dec->s16_buffer_size = num_values;
+		}
+
+		err = gme_play(emu, num_values, (short *)(gme_dec->s16_buffer));
+		if (G_LIKELY(err == NULL))
+			gst_gme_dec_convert_to_float((gfloat *)dest, gme_dec->s16_buffer, num_values);
+	}
+
+	if (G_UNLIKELY(err != NULL))
+	{
+		GST_ERROR_OBJECT(gme_dec, "error while decoding: %s", err);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+static guint gst_gme_dec_get_num_stems(GstNonstreamAudioDecoder *dec)
+{
+	/* one stem per emulator voice */
+	GstGmeDec *gme_dec = GST_GME_DEC(dec);
+
+	if (gme_dec->emu == NULL)
+		return 0;
+
+	return MIN((guint)gme_voice_count(gme_dec->emu), GST_GME_DEC_MAX_STEMS);
+}
+
+
+static gboolean gst_gme_dec_decode_stems(GstNonstreamAudioDecoder *dec, guint const *stem_indices, GstBuffer **buffers, guint num_stems, guint num_samples)
+{
+	/* gme mixes all voices into one output, and cannot provide the
+	 * individual voice signals. Instead, each stem has its own emulator
+	 * which plays the same track with all other voices muted. The sound
+	 * chips are still emulated in full, so N stems cost about N times
+	 * the CPU of the main output, which is why their number is capped
+	 * at GST_GME_DEC_MAX_STEMS. gme cannot copy the state of an
+	 * emulator, so a stem that is requested in the middle of a track
+	 * has to emulate everything up to the current position once. After
+	 * that, the stem emulators only have to catch up after seeks. */
+
+	GstGmeDec *gme_dec = GST_GME_DEC(dec);
+	guint num_voice_stems = gst_gme_dec_get_num_stems(dec);
+	gsize num_bytes = num_samples * NUM_CHANNELS * gst_audio_format_get_info(gme_dec->sample_format)->width / 8;
+	guint i, j;
+
+	/* emulators of stems that are no longer requested would fall behind */
+	for (j = 0; j < GST_GME_DEC_MAX_STEMS; ++j)
+	{
+		gboolean requested = FALSE;
+
+		if (gme_dec->stem_emus[j] == NULL)
+			continue;
+
+		for (i = 0; (i < num_stems) && !requested; ++i)
+			requested = (stem_indices[i] == j);
+
+		if (!requested)
+		{
+			GST_DEBUG_OBJECT(gme_dec, "deleting emulator of stem %u, which is no longer requested", j);
+			gme_delete(gme_dec->stem_emus[j]);
+			gme_dec->stem_emus[j] = NULL;
+		}
+	}
+
+	for (i = 0; i < num_stems; ++i)
+	{
+		guint stem_index = stem_indices[i];
+		gme_t *emu;
+		GstMapInfo map;
+		gboolean ret;
+
+		/* unknown stems are left to the base class, which fills them with silence */
+		if (stem_index >= num_voice_stems)
+			continue;
+
+		emu = gme_dec->stem_emus[stem_index];
+		if (emu == NULL)
+		{
+			emu = gst_gme_dec_create_stem_emu(gme_dec, stem_index);
+			if (emu == NULL)
+			{
+				GST_WARNING_OBJECT(gme_dec, "could not create emulator for stem %u", stem_index);
+				continue;
+			}
+		}
+
+		buffers[i] = gst_nonstream_audio_decoder_allocate_output_buffer(dec, num_bytes);
+		if (G_UNLIKELY(buffers[i] == NULL))
+			return FALSE;
+
+		gst_buffer_map(buffers[i], &map, GST_MAP_WRITE);
+		/* the main emulator decides when playback ends */
+		if (gme_track_ended(emu))
+		{
+			memset(map.data, 0, num_bytes);
+			ret = TRUE;
+		}
+		else
+			ret = gst_gme_dec_play(gme_dec, emu, num_samples, map.data);
+		gst_buffer_unmap(buffers[i], &map);
+
+		if (G_UNLIKELY(!ret))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+static gme_t* gst_gme_dec_create_stem_emu(GstGmeDec *gme_dec, guint stem_index)
+{
+	GstGmeDecReader reader;
+	gme_t *emu;
+	gme_err_t err;
+
+	if (!gst_gme_dec_reader_init(&reader, gme_dec, gme_dec->song_data))
+		return NULL;
+	err = gst_gme_dec_load_emu(&reader, gme_dec->sample_rate, &emu);
+	gst_gme_dec_reader_cleanup(&reader);
+	if (err != NULL)
+		return NULL;
+
+	/* track numbers refer to the playlist if there is one */
+	if (gme_dec->m3u_path != NULL)
+		err = gme_load_m3u(emu, gme_dec->m3u_path);
+
+	/* Start the stem where the current block started. Since the emulator
+	 * starts at the beginning of the track, this emulates everything up
+	 * to that position first. */
+	if (err == NULL)
+	{
+		gme_enable_accuracy(emu, gst_gme_dec_use_accuracy(gme_dec));
+		err = gme_start_track(emu, gme_dec->cur_track);
+	}
+	if (err == NULL)
+		err = gme_seek_samples(emu, gme_dec->block_start_samples);
+
+	if (err != NULL)
+	{
+		GST_DEBUG_OBJECT(gme_dec, "could not start stem %u: %s", stem_index, err);
+		gme_delete(emu);
+		return NULL;
+	}
+
+	/* a single voice can be silent for a long time; this must not end the track */
+	gme_ignore_silence(emu, 1);
+	gme_mute_voices(emu, ~(1u << stem_index));
+
+	gme_dec->stem_emus[stem_index] = emu;
+	gst_gme_dec_apply_effects(gme_dec, emu);
+	gst_gme_dec_update_fade(gme_dec);
+
+	GST_DEBUG_OBJECT(gme_dec, "created emulator for stem %u (\"%s\") at sample %d", stem_index, gme_voice_name(emu, stem_index), gme_dec->block_start_samples);
+
+	return emu;
+}
+
+
+static void gst_gme_dec_seek_stem_emus(GstGmeDec *gme_dec, GstClockTime position)
+{
+	/* Like the main emulator, the stem emulators only emulate the distance
+	 * to the new position when seeking forwards. Stems which cannot follow
+	 * are recreated by the next decode_stems call. */
+
+	guint i;
+
+	for (i = 0; i < GST_GME_DEC_MAX_STEMS; ++i)
+	{
+		gme_err_t err;
+
+		if (gme_dec->stem_emus[i] == NULL)
+			continue;
+
+		err = gme_seek(gme_dec->stem_emus[i], position / GST_MSECOND);
+		if (err != NULL)
+		{
+			GST_DEBUG_OBJECT(gme_dec, "could not seek stem %u: %s", i, err);
+			gme_delete(gme_dec->stem_emus[i]);
+			gme_dec->stem_emus[i] = NULL;
+		}
+	}
+}
+
+
+static void gst_gme_dec_restart_stem_emus(GstGmeDec *gme_dec)
+{
+	/* Starting the new track in the existing stem emulators avoids
+	 * loading the song into new ones; the voice mute masks are kept */
+
+	guint i;
+
+	for (i = 0; i < GST_GME_DEC_MAX_STEMS; ++i)
+	{
+		gme_err_t err;
+
+		if (gme_dec->stem_emus[i] == NULL)
+			continue;
+
+		gme_enable_accuracy(gme_dec->stem_emus[i], gst_gme_dec_use_accuracy(gme_dec));
+		err = gme_start_track(gme_dec->stem_emus[i], gme_dec->cur_track);
+		if (err != NULL)
+		{
+			GST_DEBUG_OBJECT(gme_dec, "could not restart stem %u: %s", i, err);
+			gme_delete(gme_dec->stem_emus[i]);
+			gme_dec->stem_emus[i] = NULL;
+		}
+	}
+}
+
+
+static void gst_gme_dec_delete_stem_emus(GstGmeDec *gme_dec)
+{
+	guint i;
+
+	for (i = 0; i < GST_GME_DEC_MAX_STEMS; ++i)
+	{
+		if (gme_dec->stem_emus[i] != NULL)
+		{
+			gme_delete(gme_dec->stem_emus[i]);
+			gme_dec->stem_emus[i] = NULL;
+		}
+	}
+}
+
+
+static void gst_gme_dec_convert_to_float(gfloat *dest, gint16 const *src, gsize num_values)
+{
+	gsize i = 0;
+
+#if defined(_USE_SSE) && defined(__SSE2__)
+	__m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+
+	for (; (i + 8) <= num_values; i += 8)
+	{
+		__m128i values = _mm_loadu_si128((__m128i const *)(src + i));
+		/* sign-extend to 32 bit by moving each value to the upper half and shifting it back */
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(values, values), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(values, values), 16);
+		_mm_storeu_ps(dest + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+		_mm_storeu_ps(dest + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+	}
+#endif
+
+	for (; i < num_values; ++i)
+		dest[i] = src[i] * (1.0f / 32768.0f);
+}
+
+
+static gint gst_gme_dec_get_native_rate(guint8 const *data, gsize size)
+{
+	gchar const *type_extension;
+	guint i;
+
+	/* gme_identify_header() reads the first 4 bytes */
+	if (size < 4)
+		return 0;
+
+	type_extension = gme_identify_header(data);
+	if ((type_extension == NULL) || (*type_extension == 0))
+		return 0;
+
+	for (i = 0; native_rates[i].type_extension != NULL; ++i)
+	{
+		if (g_strcmp0(native_rates[i].type_extension, type_extension) == 0)
+			return native_rates[i].native_rate;
+	}
+
+	return 0;
+}
+
+
+static gboolean gst_gme_dec_use_accuracy(GstGmeDec *gme_dec)
+{
+	guint i;
+
+	switch (gme_dec->emulation_profile)
+	{
+		case GME_EMULATION_PROFILE_FAST:
+			return FALSE;
+		case GME_EMULATION_PROFILE_ACCURATE:
+			return TRUE;
+		default:
+			break;
+	}
+
+	if (gme_dec->type_extension == NULL)
+		return FALSE;
+
+	for (i = 0; cheap_accuracy_types[i] != NULL; ++i)
+	{
+		if (g_strcmp0(cheap_accuracy_types[i], gme_dec->type_extension) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+
+static gboolean gst_gme_dec_reader_init(GstGmeDecReader *reader, GstGmeDec *gme_dec, GstBuffer *buffer)
+{
+	guint8 magic[2];
+	gsize total_size = gst_buffer_get_size(buffer);
+
+	memset(reader, 0, sizeof(GstGmeDecReader));
+	reader->gme_dec = gme_dec;
+	reader->buffer = buffer;
+	reader->num_memories = gst_buffer_n_memory(buffer);
+	reader->data_size = total_size;
+
+	/* gzip streams start with 0x1F 0x8B */
+	reader->compressed = (gst_buffer_extract(buffer, 0, magic, 2) == 2) && (magic[0] == 0x1F) && (magic[1] == 0x8B);
+
+	if (reader->compressed)
+	{
+#ifdef HAVE_ZLIB_H
+		guint8 isize[4];
+
+		/* the last 4 bytes contain the uncompressed size (modulo 2^32), little endian */
+		if ((total_size < 18) || (gst_buffer_extract(buffer, total_size - 4, isize, 4) != 4))
+		{
+			GST_ERROR_OBJECT(reader->gme_dec, "gzip compressed data is too short");
+			return FALSE;
+		}
+		reader->data_size = GST_READ_UINT32_LE(isize);
+
+		/* 16 + MAX_WBITS => expect a gzip header */
+		if (inflateInit2(&(reader->zstream), 16 + MAX_WBITS) != Z_OK)
+		{
+			GST_ERROR_OBJECT(reader->gme_dec, "could not initialize zlib inflate: %s", GST_STR_NULL(reader->zstream.msg));
+			return FALSE;
+		}
+		reader->zstream_initialized = TRUE;
+
+		GST_DEBUG_OBJECT(reader->gme_dec, "data is gzip compressed; uncompressed size: %" G_GSIZE_FORMAT, reader->data_size);
+#else
+		GST_ERROR_OBJECT(reader->gme_dec, "data is gzip compressed, but gmedec was built without zlib support");
+		return FALSE;
+#endif
+	}
+
+	reader->header_size = gst_gme_dec_reader_read_stream(reader, reader->header, sizeof(reader->header));
+	if (reader->header_size < sizeof(reader->header))
+	{
+		GST_ERROR_OBJECT(reader->gme_dec, "song data is too short");
+		gst_gme_dec_reader_cleanup(reader);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+static void gst_gme_dec_reader_cleanup(GstGmeDecReader *reader)
+{
+	if (reader->memory != NULL)
+	{
+		gst_memory_unmap(reader->memory, &(reader->map));
+		reader->memory = NULL;
+	}
+
+#ifdef HAVE_ZLIB_H
+	if (reader->zstream_initialized)
+	{
+		inflateEnd(&(reader->zstream));
+		reader->zstream_initialized = FALSE;
+	}
+#endif
+}
+
+
+static gboolean gst_gme_dec_reader_next_input(GstGmeDecReader *reader, guint8 const **data, gsize *size)
+{
+	/* Returns the unread part of the current memory, moving on to the next
+	 * memory once the current one is used up */
+
+	while ((reader->memory == NULL) || (reader->map_offset >= reader->map.size))
+	{
+		if (reader->memory != NULL)
+		{
+			gst_memory_unmap(reader->memory, &(reader->map));
+			reader->memory = NULL;
+		}
+
+		if (reader->cur_memory >= reader->num_memories)
+			return FALSE;
+
+		reader->memory = gst_buffer_peek_memory(reader->buffer, reader->cur_memory);
+		++reader->cur_memory;
+		reader->map_offset = 0;
+
+		if (!gst_memory_map(reader->memory, &(reader->map), GST_MAP_READ))
+		{
+			GST_ERROR_OBJECT(reader->gme_dec, "could not map memory #%u of the song data", reader->cur_memory - 1);
+			reader->memory = NULL;
+			return FALSE;
+		}
+	}
+
+	*data = reader->map.data + reader->map_offset;
+	*size = reader->map.size - reader->map_offset;
+
+	return TRUE;
+}
+
+
+static gsize gst_gme_dec_reader_read_stream(GstGmeDecReader *reader, guint8 *out, gsize count)
+{
+	/* Reads up to count bytes of (inflated) song data, and returns the number of bytes read */
+
+	guint8 const *data;
+	gsize size, num_read = 0;
+
+	if (!(reader->compressed))
+	{
+		while ((num_read < count) && gst_gme_dec_reader_next_input(reader, &data, &size))
+		{
+			size = MIN(size, count - num_read);
+			memcpy(out + num_read, data, size);
+			reader->map_offset += size;
+			num_read += size;
+		}
+
+		return num_read;
+	}
+
+#ifdef HAVE_ZLIB_H
+	reader->zstream.next_out = out;
+	reader->zstream.avail_out = count;
+
+	while (reader->zstream.avail_out > 0)
+	{
+		int ret;
+
+		if ((reader->zstream.avail_in == 0) && gst_gme_dec_reader_next_input(reader, &data, &size))
+		{
+			reader->zstream.next_in = (Bytef *)data;
+			reader->zstream.avail_in = size;
+		}
+
+		ret = inflate(&(reader->zstream), Z_NO_FLUSH);
+		/* inflate() reads from the mapped memory directly; catch up with its progress */
+		if (reader->memory != NULL)
+			reader->map_offset = reader->map.size - reader->zstream.avail_in;
+
+		if (ret == Z_STREAM_END)
+			break;
+		else if (ret != Z_OK)
+		{
+			/* Z_BUF_ERROR means that no progress was possible, because the input is used up */
+			if (ret != Z_BUF_ERROR)
+				GST_ERROR_OBJECT(reader->gme_dec, "error while inflating song data: %s", GST_STR_NULL(reader->zstream.msg));
+			break;
+		}
+	}
+
+	num_read = count - reader->zstream.avail_out;
+#endif
+
+	return num_read;
+}
+
+
+static gme_err_t gst_gme_dec_reader_read(void *your_data, void *out, int count)
+{
+	GstGmeDecReader *reader = (GstGmeDecReader *)your_data;
+	guint8 *out_bytes = (guint8 *)out;
+	gsize num_from_header;
+
+	/* the header bytes were already read for identifying the file type */
+	num_from_header = MIN((gsize)count, reader->header_size - reader->header_offset);
+	memcpy(out_bytes, reader->header + reader->header_offset, num_from_header);
+	reader->header_offset += num_from_header;
+
+	if (gst_gme_dec_reader_read_stream(reader, out_bytes + num_from_header, count - num_from_header) != (count - num_from_header))
+		return "Unexpected end of song data";
+
+	return NULL;
+}
+
+
+static gme_err_t gst_gme_dec_load_emu(GstGmeDecReader *reader, gint sample_rate, gme_t **emu)
+{
+	/* Creates an emulator and loads the song data into it. The reader
+	 * must be initialized; it is not cleaned up here. */
+
+	gme_type_t file_type;
+	gme_err_t err;
+
+	file_type = gme_identify_extension(gme_identify_header(reader->header));
+	if (file_type == NULL)
+		return "Unknown file type";
+
+	*emu = gme_new_emu(file_type, sample_rate);
+	if (*emu == NULL)
+		return "Could not create emulator";
+
+	err = gme_load_custom(*emu, gst_gme_dec_reader_read, reader->data_size, reader);
+	if (err != NULL)
+	{
+		gme_delete(*emu);
+		*emu = NULL;
+	}
+
+	return err;
+}
+
+
+static gchar* gst_gme_dec_find_m3u(GstGmeDec *gme_dec)
+{
+	/* Looks for a playlist next to the song, like foo.nsf -> foo.m3u.
+	 * This only works if upstream can tell the URI of a local file. */
+
+	GstQuery *query;
+	gchar *uri = NULL, *filename, *basename, *extension, *m3u_path = NULL;
+	gchar const *m3u_extensions[] = { ".m3u", ".M3U", NULL };
+	guint i;
+
+	query = gst_query_new_uri();
+	if (gst_pad_peer_query(GST_NONSTREAM_AUDIO_DECODER(gme_dec)->sinkpad, query))
+		gst_query_parse_uri(query, &uri);
+	gst_query_unref(query);
+
+	if (uri == NULL)
+		return NULL;
+
+	filename = g_filename_from_uri(uri, NULL, NULL);
+	g_free(uri);
+	if (filename == NULL)
+		return NULL;
+
+	/* strip the extension, but not a dot in a directory name */
+	basename = strrchr(filename, G_DIR_SEPARATOR);
+	extension = strrchr((basename != NULL) ? basename : filename, '.');
+	if (extension != NULL)
+		*extension = 0;
+
+	for (i = 0; m3u_extensions[i] != NULL; ++i)
+	{
+		m3u_path = g_strconcat(filename, m3u_extensions[i], NULL);
+		if (g_file_test(m3u_path, G_FILE_TEST_IS_REGULAR))
+			break;
+		g_free(m3u_path);
+		m3u_path = NULL;
+	}
+
+	g_free(filename);
+
+	return m3u_path;
+}
+
+
+typedef struct
+{
+	GstGmeDec *gme_dec;
+	GstBuffer *song_data;
+	gchar *m3u_path;
+	gint sample_rate;
+	gboolean accuracy;
+	guint track, max_count;
+	GstClockTime duration;
+	guint generation;
+}
+gst_gme_dec_snapshot_build;
+
+
+static void gst_gme_dec_start_snapshot_build(GstGmeDec *gme_dec)
+{
+	/* (Re)starts building seek snapshots for the current track. gme has
+	 * no way to save and restore the emulator state, so each snapshot
+	 * is an emulator instance of its own, which the build thread starts
+	 * and seeks to the snapshot position.
+	 *
+	 * gme_seek() cannot be interrupted, so the build is never waited for,
+	 * and this can be called with the decoder lock held. Clearing the
+	 * snapshots makes a running build outdated; it stops after the
+	 * snapshot it is currently working on, and discards that one. The
+	 * build gets copies of everything it needs, and holds a reference to
+	 * the decoder. */
+
+	gst_gme_dec_snapshot_build *build;
+	GThread *thread;
+	GError *error = NULL;
+	guint max_count;
+
+	gst_gme_dec_clear_snapshots(gme_dec);
+
+	max_count = gme_dec->max_seek_snapshots;
+	if ((max_count > 0) && (gme_dec->song_data_size > 0))
+		max_count = MIN(max_count, MAX_SEEK_SNAPSHOT_MEMORY / gme_dec->song_data_size);
+
+	if ((max_count == 0) || (gme_dec->song_data == NULL))
+		return;
+
+	/* the thread must not touch the playback emulator, so the
+	 * track information is retrieved here */
+	build = g_slice_new(gst_gme_dec_snapshot_build);
+	build->gme_dec = gst_object_ref(gme_dec);
+	build->song_data = gst_buffer_ref(gme_dec->song_data);
+	build->m3u_path = g_strdup(gme_dec->m3u_path);
+	build->sample_rate = gme_dec->sample_rate;
+	build->accuracy = gst_gme_dec_use_accuracy(gme_dec);
+	build->track = gme_dec->cur_track;
+	build->max_count = max_count;
+	build->duration = gst_gme_dec_duration_from_track_info(gme_dec, gme_dec->cur_track);
+
+	g_mutex_lock(&(gme_dec->snapshot_mutex));
+	build->generation = gme_dec->snapshot_generation;
+	g_mutex_unlock(&(gme_dec->snapshot_mutex));
+
+	thread = g_thread_try_new("gmedec-snapshots", gst_gme_dec_snapshot_thread, build, &error);
+	if (thread == NULL)
+	{
+		GST_WARNING_OBJECT(gme_dec, "could not start snapshot thread: %s - seeking will not use snapshots", error->message);
+		g_error_free(error);
+
+		g_free(build->m3u_path);
+		gst_buffer_unref(build->song_data);
+		gst_object_unref(build->gme_dec);
+		g_slice_free(gst_gme_dec_snapshot_build, build);
+	}
+	else
+		g_thread_unref(thread);
+}
+
+
+static void gst_gme_dec_clear_snapshots(GstGmeDec *gme_dec)
+{
+	/* also makes any running snapshot build outdated */
+
+	guint i;
+
+	g_mutex_lock(&(gme_dec->snapshot_mutex));
+	for (i = 0; i < gme_dec->snapshots->len; ++i)
+		gme_delete(g_array_index(gme_dec->snapshots, gst_gme_dec_snapshot, i).emu);
+	g_array_set_size(gme_dec->snapshots, 0);
+	++(gme_dec->snapshot_generation);
+	g_mutex_unlock(&(gme_dec->snapshot_mutex));
+}
+
+
+static gpointer gst_gme_dec_snapshot_thread(gpointer user_data)
+{
+	gst_gme_dec_snapshot_build *build = user_data;
+	GstGmeDec *gme_dec = build->gme_dec;
+	GstClockTime interval = SEEK_SNAPSHOT_INTERVAL;
+	gboolean outdated = FALSE;
+	guint i;
+
+	if (GST_CLOCK_TIME_IS_VALID(build->duration))
+		interval = MAX(build->duration / (build->max_count + 1), MIN_SEEK_SNAPSHOT_INTERVAL);
+
+	for (i = 1; (i <= build->max_count) && !outdated; ++i)
+	{
+		GstGmeDecReader reader;
+		gst_gme_dec_snapshot snapshot;
+		gme_err_t err;
+
+		snapshot.position = interval * i;
+		if (GST_CLOCK_TIME_IS_VALID(build->duration) && (snapshot.position >= build->duration))
+			break;
+
+		if (!gst_gme_dec_reader_init(&reader, gme_dec, build->song_data))
+			break;
+		err = gst_gme_dec_load_emu(&reader, build->sample_rate, &(snapshot.emu));
+		gst_gme_dec_reader_cleanup(&reader);
+
+		/* track numbers refer to the playlist if there is one */
+		if ((err == NULL) && (build->m3u_path != NULL))
+		{
+			err = gme_load_m3u(snapshot.emu, build->m3u_path);
+			if (err != NULL)
+				gme_delete(snapshot.emu);
+		}
+
+		if (err == NULL)
+		{
+			gme_enable_accuracy(snapshot.emu, build->accuracy);
+			err = gme_start_track(snapshot.emu, build->track);
+			if (err == NULL)
+				err = gme_seek(snapshot.emu, snapshot.position / GST_MSECOND);
+			if (err != NULL)
+				gme_delete(snapshot.emu);
+		}
+
+		if (err != NULL)
+		{
+			GST_WARNING_OBJECT(gme_dec, "could not create snapshot at %" GST_TIME_FORMAT ": %s", GST_TIME_ARGS(snapshot.position), err);
+			break;
+		}
+
+		/* the track is shorter than its information says */
+		if (gme_track_ended(snapshot.emu))
+		{
+			gme_delete(snapshot.emu);
+			break;
+		}
+
+		g_mutex_lock(&(gme_dec->snapshot_mutex));
+		outdated = (build->generation != gme_dec->snapshot_generation);
+		if (!outdated)
+		{
+			g_array_append_val(gme_dec->snapshots, snapshot);
+			g_array_sort(gme_dec->snapshots, gst_gme_dec_compare_snapshots);
+		}
+		g_mutex_unlock(&(gme_dec->snapshot_mutex));
+
+		if (outdated)
+		{
+			GST_DEBUG_OBJECT(gme_dec, "discarding outdated snapshot of track %u", build->track);
+			gme_delete(snapshot.emu);
+		}
+		else
+			GST_DEBUG_OBJECT(gme_dec, "created snapshot of track %u at %" GST_TIME_FORMAT, build->track, GST_TIME_ARGS(snapshot.position));
+	}
+
+	g_free(build->m3u_path);
+	gst_buffer_unref(build->song_data);
+	gst_object_unref(build->gme_dec);
+	g_slice_free(gst_gme_dec_snapshot_build, build);
+
+	return NULL;
+}
+
+
+static gboolean gst_gme_dec_use_snapshot(GstGmeDec *gme_dec, GstClockTime position)
+{
+	/* Makes the closest snapshot before the position the playback emulator,
+	 * unless the playback emulator itself is closer. The previous playback
+	 * emulator takes the place of the snapshot, at its current position. */
+
+	GstClockTime cur_position = gst_gme_dec_tell(GST_NONSTREAM_AUDIO_DECODER(gme_dec));
+	gst_gme_dec_snapshot *snapshot = NULL;
+	gme_t *emu;
+	guint i;
+
+	g_mutex_lock(&(gme_dec->snapshot_mutex));
+
+	/* the snapshots are sorted by position */
+	for (i = 0; i < gme_dec->snapshots->len; ++i)
+	{
+		gst_gme_dec_snapshot *candidate = &g_array_index(gme_dec->snapshots, gst_gme_dec_snapshot, i);
+		if (candidate->position > position)
+			break;
+		snapshot = candidate;
+	}
+
+	if ((snapshot == NULL) || ((cur_position <= position) && (cur_position >= snapshot->position)))
+	{
+		g_mutex_unlock(&(gme_dec->snapshot_mutex));
+		return FALSE;
+	}
+
+	GST_DEBUG_OBJECT(gme_dec, "using snapshot at %" GST_TIME_FORMAT " for seeking", GST_TIME_ARGS(snapshot->position));
+
+	emu = gme_dec->emu;
+	gme_dec->emu = snapshot->emu;
+	snapshot->emu = emu;
+	snapshot->position = cur_position;
+
+	g_array_sort(gme_dec->snapshots, gst_gme_dec_compare_snapshots);
+
+	g_mutex_unlock(&(gme_dec->snapshot_mutex));
+
+	/* effects and fade are emulator settings */
+	gst_gme_dec_update_effects(gme_dec);
+	gst_gme_dec_update_fade(gme_dec);
+
+	return TRUE;
+}
+
+
+static gint gst_gme_dec_compare_snapshots(gconstpointer a, gconstpointer b)
+{
+	GstClockTime position_a = ((gst_gme_dec_snapshot const *)a)->position;
+	GstClockTime position_b = ((gst_gme_dec_snapshot const *)b)->position;
+
+	return (position_a < position_b) ? -1 : ((position_a > position_b) ? 1 : 0);
+}
+
+
+#ifdef HAVE_ZLIB_H
+
+static void gst_gme_dec_vgz_type_find(GstTypeFind *tf, G_GNUC_UNUSED gpointer user_data)
+{
+	/* VGZ files are gzip compressed VGM files. Inflate the start of
+	 * the data to check for the VGM signature. Since gmedec inflates
+	 * the data itself, no separate gzip decompressor is needed.
+	 * The data is peeked in small chunks and fed to zlib until the
+	 * 4 signature bytes come out, so only the gzip header and the
+	 * first bytes of the deflate stream have to be available. */
+
+	guint8 const *data;
+	guint64 offset = 0;
+	guint chunk_size;
+	guint8 signature[4];
+	z_stream zstream;
+	int ret = Z_OK;
+
+	/* gzip magic, followed by the deflate compression method */
+	data = gst_type_find_peek(tf, 0, 3);
+	if ((data == NULL) || (data[0] != 0x1F) || (data[1] != 0x8B) || (data[2] != 8))
+		return;
+
+	memset(&zstream, 0, sizeof(zstream));
+	if (inflateInit2(&zstream, 16 + MAX_WBITS) != Z_OK)
+		return;
+
+	zstream.next_out = signature;
+	zstream.avail_out = sizeof(signature);
+
+	/* the limit guards against endless header fields in non-gzip data */
+	while ((zstream.avail_out > 0) && (ret == Z_OK) && (offset < 4096))
+	{
+		/* near the end of the data, fewer bytes than a full chunk may be left */
+		chunk_size = 16;
+		data = gst_type_find_peek(tf, offset, chunk_size);
+		if (data == NULL)
+		{
+			chunk_size = 1;
+			data = gst_type_find_peek(tf, offset, chunk_size);
+			if (data == NULL)
+				break;
+		}
+
+		zstream.next_in = (Bytef *)data;
+		zstream.avail_in = chunk_size;
+		ret = inflate(&zstream, Z_SYNC_FLUSH);
+		offset += chunk_size - zstream.avail_in;
+	}
+
+	inflateEnd(&zstream);
+
+	if ((zstream.avail_out == 0) && (memcmp(signature, "Vgm ", 4) == 0))
+		gst_type_find_suggest_simple(tf, GST_TYPE_FIND_MAXIMUM, "audio/x-vgm", NULL);
+}
+
+#endif
+
+
 #ifdef CUSTOM_DPRINTF_FUNCTION
 
 static void gst_gme_dec_custom_dprintf( const char * fmt, va_list vl )
@@ -597,6 +2130,9 @@ static void gst_gme_dec_custom_dprintf( const char * fmt, va_list vl )
 static gboolean plugin_init(GstPlugin *plugin)
 {
 	if (!gst_element_register(plugin, "gmedec", GST_RANK_PRIMARY + 1, gst_gme_dec_get_type())) return FALSE;
+#ifdef HAVE_ZLIB_H
+	if (!gst_type_find_register(plugin, "audio/x-vgz", GST_RANK_PRIMARY, gst_gme_dec_vgz_type_find, "vgz", NULL, NULL, NULL)) return FALSE;
+#endif
 	return TRUE;
 }
 
@@ -21,15 +21,89 @@ typedef struct _GstGmeDecClass GstGmeDecClass;
 #define GST_IS_GME_DEC_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE((klass), GST_TYPE_GME_DEC))
 
 
+/* maximum number of stems; each stem runs an emulator of its own, so
+ * every stem adds about as much CPU load as the main output */
+#define GST_GME_DEC_MAX_STEMS 8
+
+
+/* cached information about one track; lengths are in milliseconds, as in gme_info_t */
+typedef struct
+{
+	gboolean valid;
+	gint length, intro_length, loop_length, play_length;
+	GstTagList *tags;
+}
+gst_gme_dec_track_info;
+
+
+/* emulator instance at a position of the current track, for faster seeking */
+typedef struct
+{
+	GstClockTime position;
+	gme_t *emu;
+}
+gst_gme_dec_snapshot;
+
+
 struct _GstGmeDec
 {
 	GstNonstreamAudioDecoder parent;
 
 	gme_t *emu;
 	guint num_tracks, cur_track;
+	/* num_tracks entries; read when first needed */
+	gst_gme_dec_track_info *track_infos;
+
+	/* song data; kept for loading the snapshot emulators. song_data_size
+	 * is the (inflated) size that each emulator keeps a copy of; the
+	 * snapshot memory budget is computed from it alone. */
+	GstBuffer *song_data;
+	gsize song_data_size;
+
+	/* seek snapshots of the current track, sorted by position; built in a
+	 * background thread, and protected by snapshot_mutex. Builds are never
+	 * waited for; clearing the snapshots increments snapshot_generation,
+	 * which tells a running build that its results are outdated. */
+	guint max_seek_snapshots;
+	GArray *snapshots;
+	GMutex snapshot_mutex;
+	guint snapshot_generation;
 
 	gdouble echo, stereo_separation;
 	gboolean enable_effects, enable_surround;
+	guint output_buffer_size;
+
+	/* one of the GME_EMULATION_PROFILE values; type_extension is the
+	 * file type as returned by gme_identify_header() */
+	gint emulation_profile;
+	gchar const *type_extension;
+
+	/* m3u_location is the property value; m3u_path is the playlist that was
+	 * actually loaded, or NULL if the tracks of the song itself are used */
+	gchar *m3u_location, *m3u_path;
+
+	/* bitmask of the voices that are muted in the main output */
+	guint muted_voices;
+
+	/* one emulator per stem, with all other voices muted; created on
+	 * demand, starting at block_start_samples (as returned by
+	 * gme_tell_samples()), which is where the current block started.
+	 * They are kept across seeks and track changes, and deleted once
+	 * their stem is no longer requested. */
+	gme_t *stem_emus[GST_GME_DEC_MAX_STEMS];
+	gint block_start_samples;
+
+	/* number of loops, and the fade-out length in milliseconds */
+	gint num_loops;
+	guint fade_length;
+
+	GstAudioFormat sample_format;
+	gint sample_rate;
+
+	/* scratch buffer for gme's S16 output when F32 is produced;
+	 * holds s16_buffer_size values */
+	gint16 *s16_buffer;
+	gsize s16_buffer_size;
 };
 
 
@@ -38,6 +38,8 @@
  #include <config.h>
 #endif
 
+#include <string.h>
+
 #include <gst/gst.h>
 
 #include "gstopenmptdec.h"
@@ -54,6 +56,8 @@ enum
 	PROP_STEREO_SEPARATION,
 	PROP_FILTER_LENGTH,
 	PROP_VOLUME_RAMPING,
+	PROP_TEMPO_FACTOR,
+	PROP_PITCH_FACTOR,
 	PROP_OUTPUT_BUFFER_SIZE
 };
 
@@ -62,13 +66,28 @@ enum
 #define DEFAULT_STEREO_SEPARATION 100
 #define DEFAULT_FILTER_LENGTH 0
 #define DEFAULT_VOLUME_RAMPING -1
+#define DEFAULT_TEMPO_FACTOR 1.0
+#define DEFAULT_PITCH_FACTOR 1.0
 #define DEFAULT_OUTPUT_BUFFER_SIZE 1024
 
+/* filter length libopenmpt uses if the filter-length property is 0 */
+#define INTERNAL_DEFAULT_FILTER_LENGTH 8
+
 #define DEFAULT_SAMPLE_FORMAT GST_AUDIO_FORMAT_F32
 #define DEFAULT_SAMPLE_RATE 48000
 #define DEFAULT_NUM_CHANNELS 2
 
 
+/* Reader for the stream callbacks; reads straight out of the
+ * memories of the input buffer, without merging them */
+typedef struct
+{
+	GstBuffer *buffer;
+	gsize size, position;
+}
+GstOpenMptDecStream;
+
+
 
 static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE(
 	"sink",
@@ -80,6 +99,21 @@ static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE(
 	)
 );
 
+/* Non-interleaved output requires GstAudioMeta, which was introduced in 1.16.
+ * 5.1 output is only available with that layout, since the front and rear
+ * channels can then be rendered directly into their planes. */
+#if GST_CHECK_VERSION(1, 16, 0)
+#define PLANAR_SRC_CAPS \
+	"; " \
+	"audio/x-raw, " \
+	"format = (string) " GST_AUDIO_NE(F32) ", " \
+	"layout = (string) non-interleaved, " \
+	"rate = (int) [ 1, 192000 ], " \
+	"channels = (int) { 1, 2, 4, 6 } "
+#else
+#define PLANAR_SRC_CAPS ""
+#endif
+
 static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE(
 	"src",
 	GST_PAD_SRC,
@@ -90,6 +124,7 @@ static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE(
 		"layout = (string) interleaved, "
 		"rate = (int) [ 1, 192000 ], "
 		"channels = (int) { 1, 2, 4 } "
+		PLANAR_SRC_CAPS
 	)
 );
 
@@ -101,6 +136,8 @@ G_DEFINE_TYPE(GstOpenMptDec, gst_openmpt_dec, GST_TYPE_NONSTREAM_AUDIO_DECODER)
 
 static void gst_openmpt_dec_finalize(GObject *object);
 
+static GstStateChangeReturn gst_openmpt_dec_change_state(GstElement *element, GstStateChange transition);
+
 static void gst_openmpt_dec_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec);
 static void gst_openmpt_dec_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec);
 
@@ -108,6 +145,9 @@ static gboolean gst_openmpt_dec_seek(GstNonstreamAudioDecoder *dec, GstClockTime
 static GstClockTime gst_openmpt_dec_tell(GstNonstreamAudioDecoder *dec);
 
 static void gst_openmpt_dec_log_func(char const *message, void *user);
+static size_t gst_openmpt_dec_stream_read(void *stream, void *dst, size_t bytes);
+static int gst_openmpt_dec_stream_seek(void *stream, int64_t offset, int whence);
+static int64_t gst_openmpt_dec_stream_tell(void *stream);
 static void gst_openmpt_dec_add_metadata_to_tag_list(GstOpenMptDec *openmpt_dec, GstTagList *tags, char const *key, gchar const *tag);
 static gboolean gst_openmpt_dec_load_from_buffer(GstNonstreamAudioDecoder *dec, GstBuffer *source_data, guint initial_subsong, GstNonstreamAudioSubsongMode initial_subsong_mode, GstClockTime *initial_position, GstNonstreamAudioOutputMode *initial_output_mode, gint *initial_num_loops);
 
@@ -127,7 +167,19 @@ static gint gst_openmpt_dec_get_num_loops(GstNonstreamAudioDecoder *dec);
 static guint gst_openmpt_dec_get_supported_output_modes(GstNonstreamAudioDecoder *dec);
 static gboolean gst_openmpt_dec_decode(GstNonstreamAudioDecoder *dec, GstBuffer **buffer, guint *num_samples);
 
+static gboolean gst_openmpt_dec_set_quality_degradation(GstNonstreamAudioDecoder *dec, guint degradation);
+static gboolean gst_openmpt_dec_get_module_position(GstNonstreamAudioDecoder *dec, gint *order, gint *pattern, gint *row);
+static gboolean gst_openmpt_dec_get_module_state(GstNonstreamAudioDecoder *dec, GstStructure *state);
+static gboolean gst_openmpt_dec_set_playback_rate(GstNonstreamAudioDecoder *dec, gdouble rate);
+
 static gboolean gst_openmpt_dec_select_subsong(GstOpenMptDec *openmpt_dec, GstNonstreamAudioSubsongMode subsong_mode, gint openmpt_subsong);
+static openmpt_module* gst_openmpt_dec_create_module(GstOpenMptDec *openmpt_dec, GstBuffer *source_data);
+static gpointer gst_openmpt_dec_duration_scan_thread(gpointer user_data);
+static void gst_openmpt_dec_stop_duration_scan(GstOpenMptDec *openmpt_dec);
+static gboolean gst_openmpt_dec_apply_render_settings(GstOpenMptDec *openmpt_dec, guint degradation);
+static gboolean gst_openmpt_dec_set_ctl_double(GstOpenMptDec *openmpt_dec, char const *ctl, gdouble value);
+static void gst_openmpt_dec_fill_audio_info(GstOpenMptDec *openmpt_dec, GstAudioInfo *info);
+static void gst_openmpt_dec_choose_output_format(GstOpenMptDec *openmpt_dec);
 
 
 
@@ -150,6 +202,8 @@ void gst_openmpt_dec_class_init(GstOpenMptDecClass *klass)
 	object_class->set_property = GST_DEBUG_FUNCPTR(gst_openmpt_dec_set_property);
 	object_class->get_property = GST_DEBUG_FUNCPTR(gst_openmpt_dec_get_property);
 
+	element_class->change_state = GST_DEBUG_FUNCPTR(gst_openmpt_dec_change_state);
+
 	dec_class->seek = GST_DEBUG_FUNCPTR(gst_openmpt_dec_seek);
 	dec_class->tell = GST_DEBUG_FUNCPTR(gst_openmpt_dec_tell);
 	dec_class->load_from_buffer = GST_DEBUG_FUNCPTR(gst_openmpt_dec_load_from_buffer);
@@ -164,6 +218,10 @@ void gst_openmpt_dec_class_init(GstOpenMptDecClass *klass)
 	dec_class->get_subsong_duration = GST_DEBUG_FUNCPTR(gst_openmpt_dec_get_subsong_duration);
 	dec_class->get_subsong_tags = GST_DEBUG_FUNCPTR(gst_openmpt_dec_get_subsong_tags);
 	dec_class->set_subsong_mode = GST_DEBUG_FUNCPTR(gst_openmpt_dec_set_subsong_mode);
+	dec_class->set_quality_degradation = GST_DEBUG_FUNCPTR(gst_openmpt_dec_set_quality_degradation);
+	dec_class->get_module_position = GST_DEBUG_FUNCPTR(gst_openmpt_dec_get_module_position);
+	dec_class->get_module_state = GST_DEBUG_FUNCPTR(gst_openmpt_dec_get_module_state);
+	dec_class->set_playback_rate = GST_DEBUG_FUNCPTR(gst_openmpt_dec_set_playback_rate);
 
 	gst_element_class_set_static_metadata(
 		element_class,
@@ -221,6 +279,30 @@ void gst_openmpt_dec_class_init(GstOpenMptDecClass *klass)
 			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
 		)
 	);
+	g_object_class_install_property(
+		object_class,
+		PROP_TEMPO_FACTOR,
+		g_param_spec_double(
+			"tempo-factor",
+			"Tempo factor",
+			"Factor to scale the song tempo with, without changing the pitch (combined with the rate of seek events)",
+			0.01, 4.0,
+			DEFAULT_TEMPO_FACTOR,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		)
+	);
+	g_object_class_install_property(
+		object_class,
+		PROP_PITCH_FACTOR,
+		g_param_spec_double(
+			"pitch-factor",
+			"Pitch factor",
+			"Factor to scale the pitch with, without changing the tempo",
+			0.01, 4.0,
+			DEFAULT_PITCH_FACTOR,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		)
+	);
 	g_object_class_install_property(
 		object_class,
 		PROP_OUTPUT_BUFFER_SIZE,
@@ -228,7 +310,7 @@ void gst_openmpt_dec_class_init(GstOpenMptDecClass *klass)
 			"output-buffer-size",
 			"Output buffer size",
 			"Size of each output buffer, in samples (actual size can be smaller than this during flush or EOS)",
-			1, G_MAXUINT / (4 * 4), /* 4*4 => quad output with F32 samples; this ensures that no overflow can happen */
+			1, G_MAXUINT / (6 * 4), /* 6*4 => 5.1 output with F32 samples; this ensures that no overflow can happen */
 			DEFAULT_OUTPUT_BUFFER_SIZE,
 			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
 		)
@@ -244,12 +326,18 @@ void gst_openmpt_dec_init(GstOpenMptDec *openmpt_dec)
 	openmpt_dec->num_subsongs = 0;
 	openmpt_dec->subsong_durations = NULL;
 
+	openmpt_dec->duration_scan_thread = NULL;
+	openmpt_dec->probe_data = NULL;
+	openmpt_dec->stop_duration_scan = 0;
+
 	openmpt_dec->num_loops = 0;
 
 	openmpt_dec->master_gain = DEFAULT_MASTER_GAIN;
 	openmpt_dec->stereo_separation = DEFAULT_STEREO_SEPARATION;
 	openmpt_dec->filter_length = DEFAULT_FILTER_LENGTH;
 	openmpt_dec->volume_ramping = DEFAULT_VOLUME_RAMPING;
+	openmpt_dec->tempo_factor = DEFAULT_TEMPO_FACTOR;
+	openmpt_dec->pitch_factor = DEFAULT_PITCH_FACTOR;
 
 	openmpt_dec->output_buffer_size = DEFAULT_OUTPUT_BUFFER_SIZE;
 
@@ -258,6 +346,7 @@ void gst_openmpt_dec_init(GstOpenMptDec *openmpt_dec)
 	openmpt_dec->sample_format = DEFAULT_SAMPLE_FORMAT;
 	openmpt_dec->sample_rate = DEFAULT_SAMPLE_RATE;
 	openmpt_dec->num_channels = DEFAULT_NUM_CHANNELS;
+	openmpt_dec->planar = FALSE;
 }
 
 
@@ -268,6 +357,8 @@ static void gst_openmpt_dec_finalize(GObject *object)
 	g_return_if_fail(GST_IS_OPENMPT_DEC(object));
 	openmpt_dec = GST_OPENMPT_DEC(object);
 
+	gst_openmpt_dec_stop_duration_scan(openmpt_dec);
+
 	if (openmpt_dec->main_tags != NULL)
 		gst_tag_list_unref(openmpt_dec->main_tags);
 
@@ -280,6 +371,30 @@ static void gst_openmpt_dec_finalize(GObject *object)
 }
 
 
+static GstStateChangeReturn gst_openmpt_dec_change_state(GstElement *element, GstStateChange transition)
+{
+	GstStateChangeReturn ret;
+
+	ret = GST_ELEMENT_CLASS(gst_openmpt_dec_parent_class)->change_state(element, transition);
+	if (ret == GST_STATE_CHANGE_FAILURE)
+		return ret;
+
+	switch (transition)
+	{
+		case GST_STATE_CHANGE_PAUSED_TO_READY:
+			/* the module is reloaded in the next READY->PAUSED change,
+			 * so durations of the current one are of no use anymore */
+			gst_openmpt_dec_stop_duration_scan(GST_OPENMPT_DEC(element));
+			break;
+
+		default:
+			break;
+	}
+
+	return ret;
+}
+
+
 static void gst_openmpt_dec_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
 {
 	GstNonstreamAudioDecoder *dec;
@@ -314,8 +429,7 @@ static void gst_openmpt_dec_set_property(GObject *object, guint prop_id, const G
 		{
 			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
 			openmpt_dec->filter_length = g_value_get_int(value);
-			if (openmpt_dec->mod != NULL)
-				openmpt_module_set_render_param(openmpt_dec->mod, OPENMPT_MODULE_RENDER_INTERPOLATIONFILTER_LENGTH, openmpt_dec->filter_length);
+			gst_openmpt_dec_apply_render_settings(openmpt_dec, dec->quality_degradation);
 			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
 			break;
 		}
@@ -324,8 +438,28 @@ static void gst_openmpt_dec_set_property(GObject *object, guint prop_id, const G
 		{
 			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
 			openmpt_dec->volume_ramping = g_value_get_int(value);
+			gst_openmpt_dec_apply_render_settings(openmpt_dec, dec->quality_degradation);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+			break;
+		}
+
+		case PROP_TEMPO_FACTOR:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			openmpt_dec->tempo_factor = g_value_get_double(value);
+			if (openmpt_dec->mod != NULL)
+				gst_openmpt_dec_set_ctl_double(openmpt_dec, "play.tempo_factor", openmpt_dec->tempo_factor * dec->playback_rate);
+			gst_nonstream_audio_decoder_set_speed_factor(dec, openmpt_dec->tempo_factor);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+			break;
+		}
+
+		case PROP_PITCH_FACTOR:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			openmpt_dec->pitch_factor = g_value_get_double(value);
 			if (openmpt_dec->mod != NULL)
-				openmpt_module_set_render_param(openmpt_dec->mod, OPENMPT_MODULE_RENDER_VOLUMERAMPING_STRENGTH, openmpt_dec->volume_ramping);
+				gst_openmpt_dec_set_ctl_double(openmpt_dec, "play.pitch_factor", openmpt_dec->pitch_factor);
 			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
 			break;
 		}
@@ -383,6 +517,22 @@ static void gst_openmpt_dec_get_property(GObject *object, guint prop_id, GValue
 			break;
 		}
 
+		case PROP_TEMPO_FACTOR:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(object);
+			g_value_set_double(value, openmpt_dec->tempo_factor);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(object);
+			break;
+		}
+
+		case PROP_PITCH_FACTOR:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(object);
+			g_value_set_double(value, openmpt_dec->pitch_factor);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(object);
+			break;
+		}
+
 		case PROP_OUTPUT_BUFFER_SIZE:
 		{
 			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(object);
@@ -425,6 +575,48 @@ static void gst_openmpt_dec_log_func(char const *message, void *user)
 }
 
 
+static size_t gst_openmpt_dec_stream_read(void *stream, void *dst, size_t bytes)
+{
+	GstOpenMptDecStream *openmpt_stream = stream;
+	gsize num_bytes_left = openmpt_stream->size - openmpt_stream->position;
+
+	/* gst_buffer_extract() copies across memory boundaries */
+	bytes = gst_buffer_extract(openmpt_stream->buffer, openmpt_stream->position, dst, MIN(bytes, num_bytes_left));
+	openmpt_stream->position += bytes;
+
+	return bytes;
+}
+
+
+static int gst_openmpt_dec_stream_seek(void *stream, int64_t offset, int whence)
+{
+	GstOpenMptDecStream *openmpt_stream = stream;
+	int64_t new_position;
+
+	switch (whence)
+	{
+		case OPENMPT_STREAM_SEEK_SET: new_position = offset; break;
+		case OPENMPT_STREAM_SEEK_CUR: new_position = (int64_t)(openmpt_stream->position) + offset; break;
+		case OPENMPT_STREAM_SEEK_END: new_position = (int64_t)(openmpt_stream->size) + offset; break;
+		default: return -1;
+	}
+
+	if ((new_position < 0) || (new_position > (int64_t)(openmpt_stream->size)))
+		return -1;
+
+	openmpt_stream->position = new_position;
+
+	return 0;
+}
+
+
+static int64_t gst_openmpt_dec_stream_tell(void *stream)
+{
+	GstOpenMptDecStream *openmpt_stream = stream;
+	return openmpt_stream->position;
+}
+
+
 static void gst_openmpt_dec_add_metadata_to_tag_list(GstOpenMptDec *openmpt_dec, GstTagList *tags, char const *key, gchar const *tag)
 {
 	char const *metadata = openmpt_module_get_metadata(openmpt_dec->mod, key);
@@ -466,30 +658,49 @@ static void gst_openmpt_dec_add_metadata_to_tag_list(GstOpenMptDec *openmpt_dec,
 
 static gboolean gst_openmpt_dec_load_from_buffer(GstNonstreamAudioDecoder *dec, GstBuffer *source_data, guint initial_subsong, GstNonstreamAudioSubsongMode initial_subsong_mode, GstClockTime *initial_position, GstNonstreamAudioOutputMode *initial_output_mode, gint *initial_num_loops)
 {
-	GstMapInfo map;
 	GstOpenMptDec *openmpt_dec;
 	
 	openmpt_dec = GST_OPENMPT_DEC(dec);
 
-	/* First, determine the sample rate, channel count, and sample format to use */
-	openmpt_dec->sample_format = DEFAULT_SAMPLE_FORMAT;
-	openmpt_dec->sample_rate = DEFAULT_SAMPLE_RATE;
-	openmpt_dec->num_channels = DEFAULT_NUM_CHANNELS;
-	gst_nonstream_audio_decoder_get_downstream_info(dec, &(openmpt_dec->sample_format), &(openmpt_dec->sample_rate), &(openmpt_dec->num_channels));
+	/* First, determine the sample rate, channel count, sample format,
+	 * and layout to use */
+	gst_openmpt_dec_choose_output_format(openmpt_dec);
 
 	/* Set output format */
-	if (!gst_nonstream_audio_decoder_set_output_format_simple(
-		dec,
-		openmpt_dec->sample_rate,
-		openmpt_dec->sample_format,
-		openmpt_dec->num_channels
-	))
-		return FALSE;
+	{
+		GstAudioInfo audio_info;
+		gst_openmpt_dec_fill_audio_info(openmpt_dec, &audio_info);
+		if (!gst_nonstream_audio_decoder_set_output_format(dec, &audio_info))
+			return FALSE;
+	}
+
+	/* A scan for the durations of a previously loaded module may still be
+	 * running. It reads the duration array, which is replaced below, so it
+	 * has to finish first. The scan thread takes the decoder lock, so it
+	 * cannot be joined while the lock is held. */
+	if (openmpt_dec->duration_scan_thread != NULL)
+	{
+		GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+		gst_openmpt_dec_stop_duration_scan(openmpt_dec);
+		GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+	}
+
+	/* Unload any previously loaded module */
+	if (openmpt_dec->mod != NULL)
+	{
+		openmpt_module_destroy(openmpt_dec->mod);
+		openmpt_dec->mod = NULL;
+	}
+	g_free(openmpt_dec->subsong_durations);
+	openmpt_dec->subsong_durations = NULL;
+	if (openmpt_dec->main_tags != NULL)
+	{
+		gst_tag_list_unref(openmpt_dec->main_tags);
+		openmpt_dec->main_tags = NULL;
+	}
 
 	/* Pass the module data to OpenMPT for loading */
-	gst_buffer_map(source_data, &map, GST_MAP_READ);
-	openmpt_dec->mod = openmpt_module_create_from_memory(map.data, map.size, gst_openmpt_dec_log_func, dec, NULL);
-	gst_buffer_unmap(source_data, &map);
+	openmpt_dec->mod = gst_openmpt_dec_create_module(openmpt_dec, source_data);
 
 	if (openmpt_dec->mod == NULL)
 	{
@@ -549,10 +760,15 @@ static gboolean gst_openmpt_dec_load_from_buffer(GstNonstreamAudioDecoder *dec,
 	/* LOOPING output mode is not supported */
 	*initial_output_mode = GST_NONSTREM_AUDIO_OUTPUT_MODE_STEADY;
 
-	/* Query the durations of each subsong (if any exist) */
+	/* Query the durations of each subsong (if any exist). Computing a duration
+	 * requires going through the entire subsong, which takes a while with
+	 * modules that contain many subsongs. Therefore, only the duration of the
+	 * initial subsong is computed here; the others are computed in the
+	 * background, using a separate module instance. */
 	if (openmpt_dec->num_subsongs > 0)
 	{
 		guint i;
+		gboolean durations_missing = FALSE;
 
 		openmpt_dec->subsong_durations = g_try_malloc(openmpt_dec->num_subsongs * sizeof(double));
 		if (openmpt_dec->subsong_durations == NULL)
@@ -565,11 +781,49 @@ static gboolean gst_openmpt_dec_load_from_buffer(GstNonstreamAudioDecoder *dec,
 
 		for (i = 0; i < openmpt_dec->num_subsongs; ++i)
 		{
-			openmpt_module_select_subsong(openmpt_dec->mod, i);
-			openmpt_dec->subsong_durations[i] = openmpt_module_get_duration_seconds(openmpt_dec->mod);
+			GstClockTime stored_duration;
+
+			/* prefer a previously stored value */
+			if (gst_nonstream_audio_decoder_get_stored_duration(dec, i, &stored_duration))
+				openmpt_dec->subsong_durations[i] = (double)stored_duration / GST_SECOND;
+			else if (i == initial_subsong)
+			{
+				openmpt_module_select_subsong(openmpt_dec->mod, i);
+				openmpt_dec->subsong_durations[i] = openmpt_module_get_duration_seconds(openmpt_dec->mod);
+				gst_nonstream_audio_decoder_store_duration(dec, i, (GstClockTime)(openmpt_dec->subsong_durations[i] * GST_SECOND));
+			}
+			else
+			{
+				openmpt_dec->subsong_durations[i] = -1.0;
+				durations_missing = TRUE;
+			}
+		}
+
+		if (durations_missing)
+		{
+			GError *error = NULL;
+
+			/* the probe module is created in the thread, so it needs the data */
+			openmpt_dec->probe_data = gst_buffer_ref(source_data);
+			g_atomic_int_set(&(openmpt_dec->stop_duration_scan), 0);
+
+			openmpt_dec->duration_scan_thread = g_thread_try_new("openmptdec-durations", gst_openmpt_dec_duration_scan_thread, openmpt_dec, &error);
+			if (openmpt_dec->duration_scan_thread == NULL)
+			{
+				GST_WARNING_OBJECT(openmpt_dec, "could not start duration scan thread: %s - durations of other subsongs are unknown", error->message);
+				g_error_free(error);
+				gst_buffer_unref(openmpt_dec->probe_data);
+				openmpt_dec->probe_data = NULL;
+			}
 		}
 	}
 
+	/* Unless the duration scan thread still needs it, the module data is
+	 * no longer needed, since the module does not refer to it. Drop it
+	 * now instead of after this function returns. */
+	if (gst_buffer_is_writable(source_data))
+		gst_buffer_remove_all_memory(source_data);
+
 	/* Select the initial subsong */
 	gst_openmpt_dec_select_subsong(openmpt_dec, initial_subsong_mode, initial_subsong);
 
@@ -590,8 +844,15 @@ static gboolean gst_openmpt_dec_load_from_buffer(GstNonstreamAudioDecoder *dec,
 	/* Set render parameters (adjustable via properties) */
 	openmpt_module_set_render_param(openmpt_dec->mod, OPENMPT_MODULE_RENDER_MASTERGAIN_MILLIBEL, openmpt_dec->master_gain);
 	openmpt_module_set_render_param(openmpt_dec->mod, OPENMPT_MODULE_RENDER_STEREOSEPARATION_PERCENT, openmpt_dec->stereo_separation);
-	openmpt_module_set_render_param(openmpt_dec->mod, OPENMPT_MODULE_RENDER_INTERPOLATIONFILTER_LENGTH, openmpt_dec->filter_length);
-	openmpt_module_set_render_param(openmpt_dec->mod, OPENMPT_MODULE_RENDER_VOLUMERAMPING_STRENGTH, openmpt_dec->volume_ramping);
+	gst_openmpt_dec_apply_render_settings(openmpt_dec, dec->quality_degradation);
+
+	/* Set tempo and pitch (adjustable via properties); the tempo also
+	 * includes the rate of a seek that may have happened earlier */
+	if ((openmpt_dec->tempo_factor * dec->playback_rate) != 1.0)
+		gst_openmpt_dec_set_ctl_double(openmpt_dec, "play.tempo_factor", openmpt_dec->tempo_factor * dec->playback_rate);
+	if (openmpt_dec->pitch_factor != 1.0)
+		gst_openmpt_dec_set_ctl_double(openmpt_dec, "play.pitch_factor", openmpt_dec->pitch_factor);
+	gst_nonstream_audio_decoder_set_speed_factor(dec, openmpt_dec->tempo_factor);
 
 	/* Log the available metadata keys, and produce a
 	 * tag list if any keys are available */
@@ -680,6 +941,11 @@ static guint gst_openmpt_dec_get_num_subsongs(GstNonstreamAudioDecoder *dec)
 static GstClockTime gst_openmpt_dec_get_subsong_duration(GstNonstreamAudioDecoder *dec, guint subsong)
 {
 	GstOpenMptDec *openmpt_dec = GST_OPENMPT_DEC(dec);
+
+	/* durations of subsongs that have not been scanned yet are unknown */
+	if (openmpt_dec->subsong_durations[subsong] < 0.0)
+		return GST_CLOCK_TIME_NONE;
+
 	return (GstClockTime)(openmpt_dec->subsong_durations[subsong] * GST_SECOND);
 }
 
@@ -780,6 +1046,70 @@ static gboolean gst_openmpt_dec_decode(GstNonstreamAudioDecoder *dec, GstBuffer
 
 	fmt_info = gst_audio_format_get_info(openmpt_dec->sample_format);
 
+#if GST_CHECK_VERSION(1, 16, 0)
+	if (openmpt_dec->planar)
+	{
+		/* Render straight into the planes of the output buffer; OpenMPT's
+		 * non-interleaved read functions write one array per channel */
+
+		float *planes[6];
+		gsize offsets[6];
+		gsize plane_size = openmpt_dec->output_buffer_size * sizeof(float);
+		gint i;
+
+		outbuf = gst_nonstream_audio_decoder_allocate_output_buffer(dec, plane_size * openmpt_dec->num_channels);
+		if (G_UNLIKELY(outbuf == NULL))
+			return FALSE;
+
+		gst_buffer_map(outbuf, &map, GST_MAP_WRITE);
+
+		for (i = 0; i < openmpt_dec->num_channels; ++i)
+		{
+			offsets[i] = i * plane_size;
+			planes[i] = (float *)(map.data + offsets[i]);
+		}
+
+		switch (openmpt_dec->num_channels)
+		{
+			case 1:
+				num_read_samples = openmpt_module_read_float_mono(openmpt_dec->mod, openmpt_dec->sample_rate, openmpt_dec->output_buffer_size, planes[0]);
+				break;
+			case 2:
+				num_read_samples = openmpt_module_read_float_stereo(openmpt_dec->mod, openmpt_dec->sample_rate, openmpt_dec->output_buffer_size, planes[0], planes[1]);
+				break;
+			case 4:
+				num_read_samples = openmpt_module_read_float_quad(openmpt_dec->mod, openmpt_dec->sample_rate, openmpt_dec->output_buffer_size, planes[0], planes[1], planes[2], planes[3]);
+				break;
+			case 6:
+				/* 5.1: the quad channels go into the front and rear planes
+				 * (FL FR FC LFE RL RR); the module has no center or LFE
+				 * content, so these are silent */
+				num_read_samples = openmpt_module_read_float_quad(openmpt_dec->mod, openmpt_dec->sample_rate, openmpt_dec->output_buffer_size, planes[0], planes[1], planes[4], planes[5]);
+				memset(planes[2], 0, num_read_samples * sizeof(float));
+				memset(planes[3], 0, num_read_samples * sizeof(float));
+				break;
+			default:
+				g_assert_not_reached();
+		}
+
+		gst_buffer_unmap(outbuf, &map);
+
+		if (num_read_samples == 0)
+		{
+			gst_buffer_unref(outbuf);
+			return FALSE;
+		}
+
+		/* the planes stay where they are even if fewer samples were read */
+		gst_buffer_add_audio_meta(outbuf, &(dec->output_audio_info), num_read_samples, offsets);
+
+		*buffer = outbuf;
+		*num_samples = num_read_samples;
+
+		return TRUE;
+	}
+#endif
+
 	/* Allocate output buffer */
 	outbuf_size = openmpt_dec->output_buffer_size * (fmt_info->width / 8) * openmpt_dec->num_channels;
 	outbuf = gst_nonstream_audio_decoder_allocate_output_buffer(dec, outbuf_size);
@@ -840,7 +1170,10 @@ static gboolean gst_openmpt_dec_decode(GstNonstreamAudioDecoder *dec, GstBuffer
 	gst_buffer_unmap(outbuf, &map);
 
 	if (num_read_samples == 0)
+	{
+		gst_buffer_unref(outbuf);
 		return FALSE;
+	}
 
 	*buffer = outbuf;
 	*num_samples = num_read_samples;
@@ -849,6 +1182,177 @@ static gboolean gst_openmpt_dec_decode(GstNonstreamAudioDecoder *dec, GstBuffer
 }
 
 
+static gboolean gst_openmpt_dec_set_quality_degradation(GstNonstreamAudioDecoder *dec, guint degradation)
+{
+	return gst_openmpt_dec_apply_render_settings(GST_OPENMPT_DEC(dec), degradation);
+}
+
+
+static gboolean gst_openmpt_dec_get_module_position(GstNonstreamAudioDecoder *dec, gint *order, gint *pattern, gint *row)
+{
+	GstOpenMptDec *openmpt_dec = GST_OPENMPT_DEC(dec);
+
+	if (openmpt_dec->mod == NULL)
+		return FALSE;
+
+	*order = openmpt_module_get_current_order(openmpt_dec->mod);
+	*pattern = openmpt_module_get_current_pattern(openmpt_dec->mod);
+	*row = openmpt_module_get_current_row(openmpt_dec->mod);
+
+	return TRUE;
+}
+
+
+static gboolean gst_openmpt_dec_get_module_state(GstNonstreamAudioDecoder *dec, GstStructure *state)
+{
+	/* Adds the speed (ticks per row), the tempo, and one VU meter value
+	 * per module channel (0.0 = silent, 1.0 = full scale; values are
+	 * mono and can exceed 1.0). OpenMPT updates all of these while
+	 * rendering, so reading them is cheap. */
+
+	GstOpenMptDec *openmpt_dec = GST_OPENMPT_DEC(dec);
+	GValue vu_array = G_VALUE_INIT;
+	GValue vu_value = G_VALUE_INIT;
+	int32_t num_module_channels, i;
+
+	if (openmpt_dec->mod == NULL)
+		return FALSE;
+
+	gst_structure_set(
+		state,
+		"speed", G_TYPE_INT, (gint)openmpt_module_get_current_speed(openmpt_dec->mod),
+		"tempo", G_TYPE_INT, (gint)openmpt_module_get_current_tempo(openmpt_dec->mod),
+		"num-playing-channels", G_TYPE_INT, (gint)openmpt_module_get_current_playing_channels(openmpt_dec->mod),
+		NULL
+	);
+
+	num_module_channels = openmpt_module_get_num_channels(openmpt_dec->mod);
+
+	g_value_init(&vu_array, GST_TYPE_ARRAY);
+	g_value_init(&vu_value, G_TYPE_FLOAT);
+	for (i = 0; i < num_module_channels; ++i)
+	{
+		g_value_set_float(&vu_value, openmpt_module_get_current_channel_vu_mono(openmpt_dec->mod, i));
+		gst_value_array_append_value(&vu_array, &vu_value);
+	}
+	gst_structure_take_value(state, "channel-vu", &vu_array);
+	g_value_unset(&vu_value);
+
+	return TRUE;
+}
+
+
+static void gst_openmpt_dec_fill_audio_info(GstOpenMptDec *openmpt_dec, GstAudioInfo *info)
+{
+	/* OpenMPT's quad output order is left, right, rear left, rear right */
+	static GstAudioChannelPosition const quad_positions[4] =
+	{
+		GST_AUDIO_CHANNEL_POSITION_FRONT_LEFT, GST_AUDIO_CHANNEL_POSITION_FRONT_RIGHT,
+		GST_AUDIO_CHANNEL_POSITION_REAR_LEFT, GST_AUDIO_CHANNEL_POSITION_REAR_RIGHT
+	};
+	static GstAudioChannelPosition const surround_positions[6] =
+	{
+		GST_AUDIO_CHANNEL_POSITION_FRONT_LEFT, GST_AUDIO_CHANNEL_POSITION_FRONT_RIGHT,
+		GST_AUDIO_CHANNEL_POSITION_FRONT_CENTER, GST_AUDIO_CHANNEL_POSITION_LFE1,
+		GST_AUDIO_CHANNEL_POSITION_REAR_LEFT, GST_AUDIO_CHANNEL_POSITION_REAR_RIGHT
+	};
+	GstAudioChannelPosition const *positions;
+
+	switch (openmpt_dec->num_channels)
+	{
+		case 4: positions = quad_positions; break;
+		case 6: positions = surround_positions; break;
+		default: positions = NULL;
+	}
+
+	gst_audio_info_init(info);
+	gst_audio_info_set_format(info, openmpt_dec->sample_format, openmpt_dec->sample_rate, openmpt_dec->num_channels, positions);
+#if GST_CHECK_VERSION(1, 16, 0)
+	if (openmpt_dec->planar)
+		GST_AUDIO_INFO_LAYOUT(info) = GST_AUDIO_LAYOUT_NON_INTERLEAVED;
+#endif
+}
+
+
+static void gst_openmpt_dec_choose_output_format(GstOpenMptDec *openmpt_dec)
+{
+	/* Interleaved output is preferred, since more elements support it.
+	 * Non-interleaved output is used if downstream accepts only that,
+	 * or if it wants 5.1 output, which is only possible with planes. */
+
+	GstNonstreamAudioDecoder *dec = GST_NONSTREAM_AUDIO_DECODER(openmpt_dec);
+	GstCaps *allowed_srccaps;
+	GstAudioInfo audio_info;
+	GstCaps *caps;
+
+	openmpt_dec->sample_format = DEFAULT_SAMPLE_FORMAT;
+	openmpt_dec->sample_rate = DEFAULT_SAMPLE_RATE;
+	openmpt_dec->num_channels = DEFAULT_NUM_CHANNELS;
+	openmpt_dec->planar = FALSE;
+	gst_nonstream_audio_decoder_get_downstream_info(dec, &(openmpt_dec->sample_format), &(openmpt_dec->sample_rate), &(openmpt_dec->num_channels));
+
+	allowed_srccaps = gst_pad_get_allowed_caps(GST_NONSTREAM_AUDIO_DECODER_SRC_PAD(dec));
+	if (allowed_srccaps == NULL)
+		return;
+
+	if (openmpt_dec->num_channels != 6)
+	{
+		gboolean interleaved_ok;
+
+		gst_openmpt_dec_fill_audio_info(openmpt_dec, &audio_info);
+		caps = gst_audio_info_to_caps(&audio_info);
+		interleaved_ok = gst_caps_can_intersect(caps, allowed_srccaps);
+		gst_caps_unref(caps);
+
+		if (interleaved_ok)
+		{
+			gst_caps_unref(allowed_srccaps);
+			return;
+		}
+	}
+
+#if GST_CHECK_VERSION(1, 16, 0)
+	openmpt_dec->sample_format = GST_AUDIO_FORMAT_F32;
+	openmpt_dec->planar = TRUE;
+
+	gst_openmpt_dec_fill_audio_info(openmpt_dec, &audio_info);
+	caps = gst_audio_info_to_caps(&audio_info);
+	if (gst_caps_can_intersect(caps, allowed_srccaps))
+	{
+		GST_DEBUG_OBJECT(openmpt_dec, "using non-interleaved output with %d channel(s)", openmpt_dec->num_channels);
+		gst_caps_unref(caps);
+		gst_caps_unref(allowed_srccaps);
+		return;
+	}
+	gst_caps_unref(caps);
+
+	openmpt_dec->planar = FALSE;
+#endif
+
+	/* downstream accepts neither; fall back to interleaved output, and
+	 * let negotiation report the problem if this is unsupported as well */
+	GST_DEBUG_OBJECT(openmpt_dec, "downstream caps do not match a supported layout; using interleaved output");
+	if (openmpt_dec->num_channels == 6)
+		openmpt_dec->num_channels = 4;
+
+	gst_caps_unref(allowed_srccaps);
+}
+
+
+static gboolean gst_openmpt_dec_set_playback_rate(GstNonstreamAudioDecoder *dec, gdouble rate)
+{
+	/* Playback rates are mapped to the tracker tempo, which is much cheaper
+	 * than time-stretching the output downstream. The pitch is unaffected. */
+
+	GstOpenMptDec *openmpt_dec = GST_OPENMPT_DEC(dec);
+
+	if (openmpt_dec->mod == NULL)
+		return FALSE;
+
+	return gst_openmpt_dec_set_ctl_double(openmpt_dec, "play.tempo_factor", openmpt_dec->tempo_factor * rate);
+}
+
+
 static gboolean gst_openmpt_dec_select_subsong(GstOpenMptDec *openmpt_dec, GstNonstreamAudioSubsongMode subsong_mode, gint openmpt_subsong)
 {
 	switch (subsong_mode)
@@ -876,3 +1380,159 @@ static gboolean gst_openmpt_dec_select_subsong(GstOpenMptDec *openmpt_dec, GstNo
 			return TRUE;
 	}
 }
+
+
+static openmpt_module* gst_openmpt_dec_create_module(GstOpenMptDec *openmpt_dec, GstBuffer *source_data)
+{
+	/* Use the stream callbacks instead of openmpt_module_create_from_memory(),
+	 * since the latter needs the data in one block, which means merging the
+	 * memories of the input buffer into a full copy. OpenMPT only reads what
+	 * it needs (sample data is directly read into the module's sample memory). */
+
+	GstOpenMptDecStream stream;
+	openmpt_stream_callbacks callbacks;
+	openmpt_module *mod;
+
+	callbacks.read = gst_openmpt_dec_stream_read;
+	callbacks.seek = gst_openmpt_dec_stream_seek;
+	callbacks.tell = gst_openmpt_dec_stream_tell;
+
+	stream.buffer = source_data;
+	stream.size = gst_buffer_get_size(source_data);
+	stream.position = 0;
+	mod = openmpt_module_create(callbacks, &stream, gst_openmpt_dec_log_func, openmpt_dec, NULL);
+
+	return mod;
+}
+
+
+static gpointer gst_openmpt_dec_duration_scan_thread(gpointer user_data)
+{
+	GstOpenMptDec *openmpt_dec = GST_OPENMPT_DEC(user_data);
+	GstNonstreamAudioDecoder *dec = GST_NONSTREAM_AUDIO_DECODER(openmpt_dec);
+	openmpt_module *probe_mod;
+	guint i;
+
+	/* The probe module is used only for computing durations, so the
+	 * playback module is not disturbed, and does not have to be locked
+	 * while scanning. Only the results are written with the lock held. */
+	probe_mod = gst_openmpt_dec_create_module(openmpt_dec, openmpt_dec->probe_data);
+	gst_buffer_unref(openmpt_dec->probe_data);
+	openmpt_dec->probe_data = NULL;
+
+	if (probe_mod == NULL)
+	{
+		GST_WARNING_OBJECT(openmpt_dec, "could not create probe module - durations of other subsongs are unknown");
+		return NULL;
+	}
+
+	GST_DEBUG_OBJECT(openmpt_dec, "starting duration scan");
+
+	for (i = 0; i < openmpt_dec->num_subsongs; ++i)
+	{
+		double duration;
+		gboolean known;
+
+		if (g_atomic_int_get(&(openmpt_dec->stop_duration_scan)))
+		{
+			GST_DEBUG_OBJECT(openmpt_dec, "duration scan stopped");
+			break;
+		}
+
+		GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+		known = (openmpt_dec->subsong_durations[i] >= 0.0);
+		GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+
+		if (known)
+			continue;
+
+		openmpt_module_select_subsong(probe_mod, i);
+		duration = openmpt_module_get_duration_seconds(probe_mod);
+
+		GST_DEBUG_OBJECT(openmpt_dec, "subsong %u: duration %f seconds", i, duration);
+
+		GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+		openmpt_dec->subsong_durations[i] = duration;
+		gst_nonstream_audio_decoder_store_duration(dec, i, (GstClockTime)(duration * GST_SECOND));
+		gst_nonstream_audio_decoder_subsong_durations_changed(dec);
+		GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+	}
+
+	openmpt_module_destroy(probe_mod);
+
+	return NULL;
+}
+
+
+static void gst_openmpt_dec_stop_duration_scan(GstOpenMptDec *openmpt_dec)
+{
+	/* must be called without the decoder lock, since the thread takes it;
+	 * the scan stops after the subsong it is currently measuring */
+
+	if (openmpt_dec->duration_scan_thread == NULL)
+		return;
+
+	GST_DEBUG_OBJECT(openmpt_dec, "stopping duration scan");
+
+	g_atomic_int_set(&(openmpt_dec->stop_duration_scan), 1);
+	g_thread_join(openmpt_dec->duration_scan_thread);
+	openmpt_dec->duration_scan_thread = NULL;
+}
+
+
+static gboolean gst_openmpt_dec_set_ctl_double(GstOpenMptDec *openmpt_dec, char const *ctl, gdouble value)
+{
+	gchar value_str[G_ASCII_DTOSTR_BUF_SIZE];
+
+	/* ctl values are strings; use the C locale for the decimal point */
+	g_ascii_dtostr(value_str, sizeof(value_str), value);
+
+	if (openmpt_module_ctl_set(openmpt_dec->mod, ctl, value_str))
+	{
+		GST_DEBUG_OBJECT(openmpt_dec, "set ctl \"%s\" to %s", ctl, value_str);
+		return TRUE;
+	}
+	else
+	{
+		GST_WARNING_OBJECT(openmpt_dec, "could not set ctl \"%s\" to %s", ctl, value_str);
+		return FALSE;
+	}
+}
+
+
+static gboolean gst_openmpt_dec_apply_render_settings(GstOpenMptDec *openmpt_dec, guint degradation)
+{
+	/* The QoS degradation is applied on top of the configured filter length
+	 * and volume ramping strength. Each degradation level halves the
+	 * interpolation filter length (8 taps = windowed sinc, 4 = cubic,
+	 * 2 = linear, 1 = no interpolation). Once the filter length is 1, the
+	 * next level turns off volume ramping. If the degradation goes beyond
+	 * that, the cheapest settings are applied, and FALSE is returned. */
+
+	gint filter_length = (openmpt_dec->filter_length == 0) ? INTERNAL_DEFAULT_FILTER_LENGTH : openmpt_dec->filter_length;
+	gint volume_ramping = openmpt_dec->volume_ramping;
+	guint num_filter_steps = g_bit_storage(filter_length) - 1;
+	guint max_degradation = num_filter_steps + ((volume_ramping != 0) ? 1 : 0);
+
+	if (degradation == 0)
+	{
+		/* pass on the property values unmodified, to let the internal defaults apply */
+		filter_length = openmpt_dec->filter_length;
+	}
+	else
+	{
+		filter_length = MAX(filter_length >> MIN(degradation, num_filter_steps), 1);
+		if (degradation > num_filter_steps)
+			volume_ramping = 0;
+	}
+
+	if (openmpt_dec->mod != NULL)
+	{
+		openmpt_module_set_render_param(openmpt_dec->mod, OPENMPT_MODULE_RENDER_INTERPOLATIONFILTER_LENGTH, filter_length);
+		openmpt_module_set_render_param(openmpt_dec->mod, OPENMPT_MODULE_RENDER_VOLUMERAMPING_STRENGTH, volume_ramping);
+	}
+
+	GST_DEBUG_OBJECT(openmpt_dec, "degradation %u: using filter length %d volume ramping %d", degradation, filter_length, volume_ramping);
+
+	return (degradation <= max_degradation);
+}
@@ -47,7 +47,14 @@ struct _GstOpenMptDec
 	openmpt_module *mod;
 
 	guint cur_subsong, num_subsongs;
+	/* durations in seconds; negative if not known yet; protected by the decoder lock */
 	double *subsong_durations;
+
+	/* the durations of the other subsongs are determined in a background
+	 * thread, using a separate module instance created from probe_data */
+	GThread *duration_scan_thread;
+	GstBuffer *probe_data;
+	gint stop_duration_scan;
 	/* NOTE: this is of type int, not guint, because the value
 	 * is defined by OpenMPT, and can be -1 (= "all subsongs") */
 	int default_openmpt_subsong;
@@ -56,9 +63,12 @@ struct _GstOpenMptDec
 	gint num_loops;
 
 	gint master_gain, stereo_separation, filter_length, volume_ramping;
+	gdouble tempo_factor, pitch_factor;
 
 	GstAudioFormat sample_format;
 	gint sample_rate, num_channels;
+	/* TRUE if the output is non-interleaved (always F32 then) */
+	gboolean planar;
 
 	guint output_buffer_size;
 
@@ -131,7 +131,9 @@ static GstClockTime gst_wildmidi_dec_get_subsong_duration(GstNonstreamAudioDecod
 static guint gst_wildmidi_dec_get_supported_output_modes(GstNonstreamAudioDecoder *dec);
 static gboolean gst_wildmidi_dec_decode(GstNonstreamAudioDecoder *dec, GstBuffer **buffer, guint *num_samples);
 
-static void gst_wildmidi_dec_update_options(GstWildmidiDec *wildmidi_dec);
+static gboolean gst_wildmidi_dec_set_quality_degradation(GstNonstreamAudioDecoder *dec, guint degradation);
+
+static gboolean gst_wildmidi_dec_update_options(GstWildmidiDec *wildmidi_dec, guint degradation);
 
 
 
@@ -314,6 +316,7 @@ void gst_wildmidi_dec_class_init(GstWildmidiDecClass *klass)
 	dec_class->get_subsong_duration       = GST_DEBUG_FUNCPTR(gst_wildmidi_dec_get_subsong_duration);
 	dec_class->get_supported_output_modes = GST_DEBUG_FUNCPTR(gst_wildmidi_dec_get_supported_output_modes);
 	dec_class->decode                     = GST_DEBUG_FUNCPTR(gst_wildmidi_dec_decode);
+	dec_class->set_quality_degradation    = GST_DEBUG_FUNCPTR(gst_wildmidi_dec_set_quality_degradation);
 
 	gst_element_class_set_static_metadata(
 		element_class,
@@ -408,21 +411,21 @@ static void gst_wildmidi_dec_set_property(GObject *object, guint prop_id, const
 		case PROP_LOG_VOLUME_SCALE:
 			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(object);
 			wildmidi_dec->log_volume_scale = g_value_get_boolean(value);
-			gst_wildmidi_dec_update_options(wildmidi_dec);
+			gst_wildmidi_dec_update_options(wildmidi_dec, GST_NONSTREAM_AUDIO_DECODER(object)->quality_degradation);
 			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(object);
 			break;
 
 		case PROP_ENHANCED_RESAMPLING:
 			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(object);
 			wildmidi_dec->enhanced_resampling = g_value_get_boolean(value);
-			gst_wildmidi_dec_update_options(wildmidi_dec);
+			gst_wildmidi_dec_update_options(wildmidi_dec, GST_NONSTREAM_AUDIO_DECODER(object)->quality_degradation);
 			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(object);
 			break;
 
 		case PROP_REVERB:
 			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(object);
 			wildmidi_dec->reverb = g_value_get_boolean(value);
-			gst_wildmidi_dec_update_options(wildmidi_dec);
+			gst_wildmidi_dec_update_options(wildmidi_dec, GST_NONSTREAM_AUDIO_DECODER(object)->quality_degradation);
 			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(object);
 			break;
 
@@ -538,7 +541,7 @@ static gboolean gst_wildmidi_dec_load_from_buffer(GstNonstreamAudioDecoder *dec,
 		return FALSE;
 	}
 
-	gst_wildmidi_dec_update_options(wildmidi_dec);
+	gst_wildmidi_dec_update_options(wildmidi_dec, dec->quality_degradation);
 
 
 	/* Seek to initial position */
@@ -625,19 +628,45 @@ static gboolean gst_wildmidi_dec_decode(GstNonstreamAudioDecoder *dec, GstBuffer
 }
 
 
-static void gst_wildmidi_dec_update_options(GstWildmidiDec *wildmidi_dec)
+static gboolean gst_wildmidi_dec_set_quality_degradation(GstNonstreamAudioDecoder *dec, guint degradation)
+{
+	return gst_wildmidi_dec_update_options(GST_WILDMIDI_DEC(dec), degradation);
+}
+
+
+static gboolean gst_wildmidi_dec_update_options(GstWildmidiDec *wildmidi_dec, guint degradation)
 {
+	/* The QoS degradation is applied on top of the options set by the
+	 * properties. The first degradation level turns off reverb, the next
+	 * one enhanced resampling (levels for options that are already
+	 * turned off are skipped). FALSE is returned if the degradation goes
+	 * beyond what can be turned off. */
+
 	unsigned short int options = 0;
+	gboolean enhanced_resampling = wildmidi_dec->enhanced_resampling;
+	gboolean reverb = wildmidi_dec->reverb;
+	guint max_degradation = (reverb ? 1 : 0) + (enhanced_resampling ? 1 : 0);
+	guint remaining_degradation = degradation;
+
+	if ((remaining_degradation >= 1) && reverb)
+	{
+		reverb = FALSE;
+		remaining_degradation--;
+	}
+	if ((remaining_degradation >= 1) && enhanced_resampling)
+		enhanced_resampling = FALSE;
 
 	if (wildmidi_dec->song == NULL)
-		return;
+		return (degradation <= max_degradation);
 
 	if (wildmidi_dec->log_volume_scale)
 		options |= WM_MO_LOG_VOLUME;
-	if (wildmidi_dec->enhanced_resampling)
+	if (enhanced_resampling)
 		options |= WM_MO_ENHANCED_RESAMPLING;
-	if (wildmidi_dec->reverb)
+	if (reverb)
 		options |= WM_MO_REVERB;
 
 	WildMidi_SetOption(wildmidi_dec->song, WM_MO_LOG_VOLUME | WM_MO_ENHANCED_RESAMPLING | WM_MO_REVERB, options);
+
+	return (degradation <= max_degradation);
 }
@@ -178,6 +178,75 @@
  *   subsong duration regardless of the output mode.
  * </para></listitem>
  * </itemizedlist>
+ *
+ * If the qos property is enabled, the base class monitors QoS events sent upstream
+ * by the sink of the main source pad (note that audio sinks only send these if their
+ * own qos property is enabled; QoS events from stem pads are ignored, since stems
+ * are rendered in the same task). If these indicate that the decoder output is
+ * consistently arriving late, the subclass' @set_quality_degradation function is
+ * called with a higher degradation value, which makes the subclass use cheaper
+ * rendering settings. Once QoS events
+ * indicate that the decoder is keeping up comfortably again for a while, the
+ * degradation is lowered again step by step. Degradation steps are rate limited, and
+ * recovering takes considerably longer than degrading, to prevent the quality from
+ * flapping back and forth.
+ *
+ * If the analysis-meta property is enabled, a #GstNonstreamAudioAnalysisMeta is
+ * attached to each output buffer. It contains per-channel peak and RMS levels
+ * (computed right after @decode, for interleaved and planar output), the position within the current (sub)song (as reported by @tell), and, if the
+ * subclass implements @get_module_position, the current order, pattern, and row.
+ *
+ * If the loudness-analysis property is enabled, the output is analyzed according
+ * to EBU R128 (integrated loudness, loudness range, true peak) while it is being
+ * produced. Once the end of a (sub)song is reached (at EOS, or when the subclass
+ * moves on to the next subsong in the ALL subsong mode), the results are sent
+ * downstream as ReplayGain tags (GST_TAG_TRACK_GAIN, GST_TAG_TRACK_PEAK, and
+ * GST_TAG_REFERENCE_LEVEL), and posted in a "nonstream-audio-loudness" element
+ * message. The analysis restarts whenever the position is changed (by seeking or
+ * switching subsongs); results are only produced if the analysis covers the
+ * (sub)song from its beginning. If the subsong is switched before its end, the
+ * results collected so far are only posted in the element message, with its
+ * "complete" field set to FALSE, since they do not describe the whole subsong. Since the
+ * decoder renders as fast as downstream consumes the samples, using a sink that
+ * does not synchronize against the clock allows for faster-than-realtime analysis.
+ *
+ * If the duration-db-path property is set, subsong durations are kept in a
+ * disk-persistent database, keyed by the MD5 digest of the song data, the element
+ * type, the subclass settings which affect durations (see
+ * @get_duration_settings_hash), and the subsong index. (This is only possible if
+ * the song is loaded from the sinkpad.) A duration is stored whenever a subsong
+ * whose duration the subclass cannot report is played from its beginning to its
+ * end without loops, and whenever the subclass calls
+ * gst_nonstream_audio_decoder_store_duration() after measuring one. If
+ * @get_subsong_duration cannot report a duration, and the num-loops property is
+ * 0, the base class looks it up in the database. Subclasses which compute durations in an expensive way (for
+ * example, by emulating playback) should call
+ * gst_nonstream_audio_decoder_get_stored_duration() first, since repeated
+ * loads of the same song then get accurate durations instantly.
+ *
+ * Subclasses that implement @decode_stems can output stems: individual engine
+ * channels or voice groups, each on its own request source pad (see
+ * GST_NONSTREAM_AUDIO_DECODER_STEM_SRC_NAME). The stems are rendered along with
+ * the regular output in the same decoding pass, so for example a remix can be
+ * prepared without running the pipeline once per channel. Note that this does
+ * not make stems cheap: engines which cannot tap their individual channels
+ * (such as DUMB and gme) render each stem with a separate player instance,
+ * so N stem pads cost about N additional full renders. Stem buffers have the
+ * same format, timestamps, and durations as the regular output buffers, and
+ * stem pads receive the same events (with their own stream IDs). A requested
+ * stem pad gets the main source pad's sticky events copied by the output task
+ * before its first buffer. Seeks and TOC selections can be sent to any of the
+ * source pads.
+ *
+ * Applications that display the playback state (for example, a tracker-style
+ * pattern view) can send a custom query with a structure named
+ * GST_NONSTREAM_AUDIO_DECODER_MODULE_STATE_QUERY to the source pad. The base
+ * class fills in "position" (#GstClockTime, as reported by @tell), and, if the
+ * subclass implements @get_module_position, "order", "pattern", and "row"
+ * (all #gint). Subclasses implementing @get_module_state add further fields.
+ * The state is read directly from the engine, which only changes it while
+ * rendering, so answering the query is cheap, and the values always refer to
+ * the most recently rendered buffer.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -185,10 +254,23 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
 #include <gst/gst.h>
 #include <gst/audio/audio.h>
 
 #include "gstnonstreamaudiodecoder.h"
+#include "gstnonstreamaudiometa.h"
+
+
+typedef struct
+{
+	GstPad *pad;
+	guint index;
+	/* TRUE until the output task has copied the main source pad's
+	 * sticky events to the stem pad; nothing is pushed to it before */
+	gboolean pending;
+}
+GstNonstreamAudioDecoderStem;
 
 
 GST_DEBUG_CATEGORY (nonstream_audiodecoder_debug);
@@ -201,7 +283,11 @@ enum
 	PROP_CURRENT_SUBSONG,
 	PROP_SUBSONG_MODE,
 	PROP_NUM_LOOPS,
-	PROP_OUTPUT_MODE
+	PROP_OUTPUT_MODE,
+	PROP_QOS,
+	PROP_ANALYSIS_META,
+	PROP_LOUDNESS_ANALYSIS,
+	PROP_DURATION_DB_PATH
 };
 
 #define DEFAULT_CURRENT_SUBSONG 0
@@ -209,6 +295,28 @@ enum
 #define DEFAULT_NUM_SUBSONGS 0
 #define DEFAULT_NUM_LOOPS 0
 #define DEFAULT_OUTPUT_MODE GST_NONSTREM_AUDIO_OUTPUT_MODE_STEADY
+#define DEFAULT_QOS TRUE
+#define DEFAULT_ANALYSIS_META FALSE
+#define DEFAULT_LOUDNESS_ANALYSIS FALSE
+#define DEFAULT_DURATION_DB_PATH NULL
+
+/* ReplayGain 2.0 reference level in dB SPL, corresponding to -18 LUFS */
+#define REPLAYGAIN_REFERENCE_LEVEL 89.0
+
+
+/* QoS hysteresis parameters. Quality is degraded after a number of consecutive
+ * late QoS events, and restored (one step at a time) after a number of
+ * consecutive healthy ones. Each change is followed by a holdoff period during
+ * which no further changes are made, giving the new settings time to show an
+ * effect in the QoS feedback. The recovery holdoff is much longer than the
+ * degradation one, since raising the quality too early would just cause the
+ * decoder to fall behind again. */
+#define QOS_NUM_LATE_EVENTS_FOR_DEGRADATION 3
+#define QOS_NUM_HEALTHY_EVENTS_FOR_RECOVERY 10
+#define QOS_DEGRADATION_HOLDOFF (G_USEC_PER_SEC * 1)
+#define QOS_RECOVERY_HOLDOFF (G_USEC_PER_SEC * 5)
+/* proportion values below this, combined with negative jitter, are considered healthy */
+#define QOS_HEALTHY_PROPORTION 0.8
 
 
 
@@ -223,6 +331,8 @@ static void gst_nonstream_audio_decoder_set_property(GObject *object, guint prop
 static void gst_nonstream_audio_decoder_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec);
 
 static GstStateChangeReturn gst_nonstream_audio_decoder_change_state(GstElement *element, GstStateChange transition);
+static GstPad* gst_nonstream_audio_decoder_request_new_pad(GstElement *element, GstPadTemplate *templ, gchar const *name, GstCaps const *caps);
+static void gst_nonstream_audio_decoder_release_pad(GstElement *element, GstPad *pad);
 
 static gboolean gst_nonstream_audio_decoder_sink_event(GstPad *pad, GstObject *parent, GstEvent *event);
 static gboolean gst_nonstream_audio_decoder_sink_query(GstPad *pad, GstObject *parent, GstQuery *query);
@@ -231,6 +341,12 @@ static GstFlowReturn gst_nonstream_audio_decoder_chain(GstPad *pad, GstObject *p
 static gboolean gst_nonstream_audio_decoder_src_event(GstPad *pad, GstObject *parent, GstEvent *event);
 static gboolean gst_nonstream_audio_decoder_src_query(GstPad *pad, GstObject *parent, GstQuery *query);
 
+static void gst_nonstream_audio_decoder_activate_pending_stems(GstNonstreamAudioDecoder *dec);
+static GstNonstreamAudioDecoderStem* gst_nonstream_audio_decoder_get_stems(GstNonstreamAudioDecoder *dec, guint *num_stems);
+static void gst_nonstream_audio_decoder_free_stems(GstNonstreamAudioDecoderStem *stems, guint num_stems);
+static GstEvent* gst_nonstream_audio_decoder_create_stem_stream_start(GstNonstreamAudioDecoder *dec, GstNonstreamAudioDecoderStem const *stem, GstEvent *stream_start);
+static gboolean gst_nonstream_audio_decoder_push_event(GstNonstreamAudioDecoder *dec, GstEvent *event);
+
 static void gst_nonstream_audio_decoder_set_initial_state(GstNonstreamAudioDecoder *dec);
 static void gst_nonstream_audio_decoder_cleanup_state(GstNonstreamAudioDecoder *dec);
 
@@ -251,10 +367,22 @@ static gboolean gst_nonstream_audio_decoder_stop_task(GstNonstreamAudioDecoder *
 static gboolean gst_nonstream_audio_decoder_switch_to_subsong(GstNonstreamAudioDecoder *dec, guint new_subsong, guint32 const *seqnum);
 
 static void gst_nonstream_audio_decoder_update_toc(GstNonstreamAudioDecoder *dec, GstNonstreamAudioDecoderClass *klass);
+static GstClockTime gst_nonstream_audio_decoder_query_subsong_duration(GstNonstreamAudioDecoder *dec, guint subsong);
+static GstClockTime gst_nonstream_audio_decoder_query_current_duration(GstNonstreamAudioDecoder *dec);
 static void gst_nonstream_audio_decoder_update_subsong_duration(GstNonstreamAudioDecoder *dec, GstClockTime duration);
+static void gst_nonstream_audio_decoder_compute_content_digest(GstNonstreamAudioDecoder *dec, GstBuffer *buffer);
+static void gst_nonstream_audio_decoder_get_duration_db_key(GstNonstreamAudioDecoder *dec, guint8 *key);
+static gboolean gst_nonstream_audio_decoder_open_duration_db(GstNonstreamAudioDecoder *dec);
+static void gst_nonstream_audio_decoder_store_played_duration(GstNonstreamAudioDecoder *dec);
 static void gst_nonstream_audio_decoder_output_new_segment(GstNonstreamAudioDecoder *dec, GstClockTime start_position);
 static gboolean gst_nonstream_audio_decoder_do_seek(GstNonstreamAudioDecoder *dec, GstEvent *event);
 
+static void gst_nonstream_audio_decoder_handle_qos(GstNonstreamAudioDecoder *dec, gdouble proportion, GstClockTimeDiff jitter);
+static void gst_nonstream_audio_decoder_set_quality_degradation(GstNonstreamAudioDecoder *dec, guint degradation);
+
+static void gst_nonstream_audio_decoder_restart_loudness_analysis(GstNonstreamAudioDecoder *dec, GstClockTime start_position);
+static void gst_nonstream_audio_decoder_publish_loudness_results(GstNonstreamAudioDecoder *dec, gboolean complete);
+
 static GstTagList * gst_nonstream_audio_decoder_add_main_tags(GstNonstreamAudioDecoder *dec, GstTagList *tags);
 
 static void gst_nonstream_audio_decoder_output_task(GstNonstreamAudioDecoder *dec);
@@ -376,6 +504,8 @@ static void gst_nonstream_audio_decoder_class_init(GstNonstreamAudioDecoderClass
 	object_class->set_property = GST_DEBUG_FUNCPTR(gst_nonstream_audio_decoder_set_property);
 	object_class->get_property = GST_DEBUG_FUNCPTR(gst_nonstream_audio_decoder_get_property);
 	element_class->change_state = GST_DEBUG_FUNCPTR(gst_nonstream_audio_decoder_change_state);
+	element_class->request_new_pad = GST_DEBUG_FUNCPTR(gst_nonstream_audio_decoder_request_new_pad);
+	element_class->release_pad = GST_DEBUG_FUNCPTR(gst_nonstream_audio_decoder_release_pad);
 
 	klass->seek = NULL;
 	klass->tell = NULL;
@@ -403,6 +533,16 @@ static void gst_nonstream_audio_decoder_class_init(GstNonstreamAudioDecoderClass
 	klass->decide_allocation = GST_DEBUG_FUNCPTR(gst_nonstream_audio_decoder_decide_allocation_default);
 	klass->propose_allocation = GST_DEBUG_FUNCPTR(gst_nonstream_audio_decoder_propose_allocation_default);
 
+	klass->set_quality_degradation = NULL;
+	klass->get_module_position = NULL;
+
+	klass->get_module_state = NULL;
+	klass->set_playback_rate = NULL;
+
+	klass->get_num_stems = NULL;
+	klass->decode_stems = NULL;
+	klass->get_duration_settings_hash = NULL;
+
 	klass->loads_from_sinkpad = TRUE;
 
 	g_object_class_install_property(
@@ -456,6 +596,54 @@ static void gst_nonstream_audio_decoder_class_init(GstNonstreamAudioDecoderClass
 			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
 		)
 	);
+
+	g_object_class_install_property(
+		object_class,
+		PROP_QOS,
+		g_param_spec_boolean(
+			"qos",
+			"Qos",
+			"Handle Quality-of-Service events from downstream by lowering render quality when the decoder cannot keep up",
+			DEFAULT_QOS,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		)
+	);
+
+	g_object_class_install_property(
+		object_class,
+		PROP_ANALYSIS_META,
+		g_param_spec_boolean(
+			"analysis-meta",
+			"Analysis meta",
+			"Attach metadata with per-channel peak and RMS levels and the current playback position to output buffers",
+			DEFAULT_ANALYSIS_META,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		)
+	);
+
+	g_object_class_install_property(
+		object_class,
+		PROP_LOUDNESS_ANALYSIS,
+		g_param_spec_boolean(
+			"loudness-analysis",
+			"Loudness analysis",
+			"Measure EBU R128 loudness and true peak of the output, and send ReplayGain tags downstream at the end of playback",
+			DEFAULT_LOUDNESS_ANALYSIS,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		)
+	);
+
+	g_object_class_install_property(
+		object_class,
+		PROP_DURATION_DB_PATH,
+		g_param_spec_string(
+			"duration-db-path",
+			"Duration database path",
+			"Path to a file for storing subsong durations across loads; the file is created if necessary (NULL = no duration database)",
+			DEFAULT_DURATION_DB_PATH,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		)
+	);
 }
 
 
@@ -470,6 +658,14 @@ static void gst_nonstream_audio_decoder_init(GstNonstreamAudioDecoder *dec, GstN
 	dec->subsong_mode = DEFAULT_SUBSONG_MODE;
 	dec->output_mode = DEFAULT_OUTPUT_MODE;
 	dec->num_loops = DEFAULT_NUM_LOOPS;
+	dec->qos_enabled = DEFAULT_QOS;
+	dec->analysis_meta_enabled = DEFAULT_ANALYSIS_META;
+	dec->loudness_analysis_enabled = DEFAULT_LOUDNESS_ANALYSIS;
+	dec->loudness = NULL;
+	dec->duration_db_path = g_strdup(DEFAULT_DURATION_DB_PATH);
+	dec->duration_db = NULL;
+	dec->duration_db_open_failed = FALSE;
+	dec->stems = g_array_new(FALSE, FALSE, sizeof(GstNonstreamAudioDecoderStem));
 
 	/* Calling this here, not in the NULL->READY state change,
 	 * to make sure get_property calls return valid values */
@@ -515,6 +711,12 @@ static void gst_nonstream_audio_decoder_finalize(GObject *object)
 	g_mutex_clear(&(dec->mutex));
 	g_object_unref(G_OBJECT(dec->input_data_adapter));
 
+	gst_nonstream_audio_duration_db_close(dec->duration_db);
+	g_free(dec->duration_db_path);
+
+	/* the stem pads themselves are removed by the GstElement dispose function */
+	g_array_free(dec->stems, TRUE);
+
 	G_OBJECT_CLASS(gst_nonstream_audio_decoder_parent_class)->finalize(object);
 }
 
@@ -618,6 +820,10 @@ static void gst_nonstream_audio_decoder_set_property(GObject *object, guint prop
 						if (GST_CLOCK_TIME_IS_VALID(cur_position))
 							gst_nonstream_audio_decoder_output_new_segment(dec, cur_position);
 						dec->subsong_mode = new_subsong_mode;
+
+						/* the duration and the TOC entry times depend on the subsong mode */
+						gst_nonstream_audio_decoder_update_subsong_duration(dec, gst_nonstream_audio_decoder_query_current_duration(dec));
+						gst_nonstream_audio_decoder_update_toc(dec, klass);
 					}
 				}
 
@@ -658,6 +864,50 @@ static void gst_nonstream_audio_decoder_set_property(GObject *object, guint prop
 			break;
 		}
 
+		case PROP_QOS:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			dec->qos_enabled = g_value_get_boolean(value);
+			/* restore full quality if QoS handling got disabled while degraded */
+			if (!(dec->qos_enabled) && dec->loaded_mode && (dec->quality_degradation > 0))
+				gst_nonstream_audio_decoder_set_quality_degradation(dec, 0);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+			break;
+		}
+
+		case PROP_ANALYSIS_META:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			dec->analysis_meta_enabled = g_value_get_boolean(value);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+			break;
+		}
+
+		case PROP_LOUDNESS_ANALYSIS:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			dec->loudness_analysis_enabled = g_value_get_boolean(value);
+			/* enabling the analysis in the middle of playback means
+			 * it does not cover the beginning of the (sub)song */
+			if (dec->loudness_analysis_enabled && dec->loaded_mode)
+				dec->loudness_from_start = FALSE;
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+			break;
+		}
+
+		case PROP_DURATION_DB_PATH:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			g_free(dec->duration_db_path);
+			dec->duration_db_path = g_value_dup_string(value);
+			/* the database is opened on demand, the next time it is needed */
+			gst_nonstream_audio_duration_db_close(dec->duration_db);
+			dec->duration_db = NULL;
+			dec->duration_db_open_failed = FALSE;
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+			break;
+		}
+
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
 			break;
@@ -703,6 +953,38 @@ static void gst_nonstream_audio_decoder_get_property(GObject *object, guint prop
 			break;
 		}
 
+		case PROP_QOS:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			g_value_set_boolean(value, dec->qos_enabled);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+			break;
+		}
+
+		case PROP_ANALYSIS_META:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			g_value_set_boolean(value, dec->analysis_meta_enabled);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+			break;
+		}
+
+		case PROP_LOUDNESS_ANALYSIS:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			g_value_set_boolean(value, dec->loudness_analysis_enabled);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+			break;
+		}
+
+		case PROP_DURATION_DB_PATH:
+		{
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			g_value_set_string(value, dec->duration_db_path);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+			break;
+		}
+
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
 			break;
@@ -785,6 +1067,175 @@ static GstStateChangeReturn gst_nonstream_audio_decoder_change_state(GstElement
 }
 
 
+typedef struct
+{
+	GstNonstreamAudioDecoder *dec;
+	GstNonstreamAudioDecoderStem *stem;
+}
+GstNonstreamAudioDecoderStickyEventCopyContext;
+
+
+static gboolean gst_nonstream_audio_decoder_copy_sticky_event(G_GNUC_UNUSED GstPad *pad, GstEvent **event, gpointer user_data)
+{
+	GstNonstreamAudioDecoderStickyEventCopyContext *ctx = user_data;
+	GstEvent *stem_event;
+
+	if (GST_EVENT_TYPE(*event) == GST_EVENT_STREAM_START)
+		stem_event = gst_nonstream_audio_decoder_create_stem_stream_start(ctx->dec, ctx->stem, *event);
+	else
+		stem_event = gst_event_ref(*event);
+
+	gst_pad_store_sticky_event(ctx->stem->pad, stem_event);
+	gst_event_unref(stem_event);
+
+	return TRUE;
+}
+
+
+static GstPad* gst_nonstream_audio_decoder_request_new_pad(GstElement *element, GstPadTemplate *templ, gchar const *name, G_GNUC_UNUSED GstCaps const *caps)
+{
+	GstNonstreamAudioDecoder *dec = GST_NONSTREAM_AUDIO_DECODER(element);
+	GstNonstreamAudioDecoderClass *klass = GST_NONSTREAM_AUDIO_DECODER_GET_CLASS(dec);
+	GstNonstreamAudioDecoderStem stem;
+	gchar *pad_name;
+	guint i;
+
+	if (klass->decode_stems == NULL)
+	{
+		GST_WARNING_OBJECT(dec, "cannot create stem pad: subclass does not support stems");
+		return NULL;
+	}
+
+	if (g_strcmp0(GST_PAD_TEMPLATE_NAME_TEMPLATE(templ), GST_NONSTREAM_AUDIO_DECODER_STEM_SRC_NAME) != 0)
+	{
+		GST_WARNING_OBJECT(dec, "cannot create pad from unknown template \"%s\"", GST_PAD_TEMPLATE_NAME_TEMPLATE(templ));
+		return NULL;
+	}
+
+	GST_OBJECT_LOCK(dec);
+
+	if (name != NULL)
+	{
+		if (sscanf(name, "src_%u", &(stem.index)) != 1)
+		{
+			GST_OBJECT_UNLOCK(dec);
+			GST_WARNING_OBJECT(dec, "invalid stem pad name \"%s\"", name);
+			return NULL;
+		}
+
+		for (i = 0; i < dec->stems->len; ++i)
+		{
+			if (g_array_index(dec->stems, GstNonstreamAudioDecoderStem, i).index == stem.index)
+			{
+				GST_OBJECT_UNLOCK(dec);
+				GST_WARNING_OBJECT(dec, "stem pad \"%s\" already exists", name);
+				return NULL;
+			}
+		}
+	}
+	else
+	{
+		/* pick the lowest index that is not in use yet */
+		gboolean in_use = TRUE;
+		for (stem.index = 0; in_use; )
+		{
+			in_use = FALSE;
+			for (i = 0; i < dec->stems->len; ++i)
+			{
+				if (g_array_index(dec->stems, GstNonstreamAudioDecoderStem, i).index == stem.index)
+				{
+					in_use = TRUE;
+					++stem.index;
+					break;
+				}
+			}
+		}
+	}
+
+	GST_OBJECT_UNLOCK(dec);
+
+	/* Once the media is loaded, the number of stems is known. Before that,
+	 * any index is accepted; unknown stems are filled with silence. */
+	GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+	if (dec->loaded_mode && (klass->get_num_stems != NULL) && (stem.index >= klass->get_num_stems(dec)))
+	{
+		guint num_stems = klass->get_num_stems(dec);
+		GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+		GST_WARNING_OBJECT(dec, "cannot create pad for stem %u: there are only %u stems", stem.index, num_stems);
+		return NULL;
+	}
+	GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+
+	pad_name = g_strdup_printf("src_%u", stem.index);
+	stem.pad = gst_pad_new_from_template(templ, pad_name);
+	g_free(pad_name);
+
+	/* the stem pads accept the same events and queries as the main source pad */
+	gst_pad_set_event_function(stem.pad, GST_DEBUG_FUNCPTR(gst_nonstream_audio_decoder_src_event));
+	gst_pad_set_query_function(stem.pad, GST_DEBUG_FUNCPTR(gst_nonstream_audio_decoder_src_query));
+	gst_pad_use_fixed_caps(stem.pad);
+
+	GST_DEBUG_OBJECT(dec, "creating pad for stem %u", stem.index);
+
+	/* The main source pad's sticky events are not copied here, since this
+	 * runs in an application thread, and the output task might push events
+	 * at the same time. Instead, the stem is marked as pending, and the
+	 * output task copies the events before it pushes anything to the pad. */
+	stem.pending = TRUE;
+
+	GST_OBJECT_LOCK(dec);
+	/* another request for the same index may have been made meanwhile */
+	for (i = 0; i < dec->stems->len; ++i)
+	{
+		if (g_array_index(dec->stems, GstNonstreamAudioDecoderStem, i).index == stem.index)
+		{
+			GST_OBJECT_UNLOCK(dec);
+			GST_WARNING_OBJECT(dec, "stem pad for stem %u already exists", stem.index);
+			gst_object_unref(gst_object_ref_sink(stem.pad));
+			return NULL;
+		}
+	}
+	g_array_append_val(dec->stems, stem);
+	GST_OBJECT_UNLOCK(dec);
+
+	gst_pad_set_active(stem.pad, TRUE);
+	gst_element_add_pad(element, stem.pad);
+
+	return stem.pad;
+}
+
+
+static void gst_nonstream_audio_decoder_release_pad(GstElement *element, GstPad *pad)
+{
+	GstNonstreamAudioDecoder *dec = GST_NONSTREAM_AUDIO_DECODER(element);
+	guint i;
+	gboolean found = FALSE;
+
+	GST_OBJECT_LOCK(dec);
+	for (i = 0; i < dec->stems->len; ++i)
+	{
+		if (g_array_index(dec->stems, GstNonstreamAudioDecoderStem, i).pad == pad)
+		{
+			g_array_remove_index(dec->stems, i);
+			found = TRUE;
+			break;
+		}
+	}
+	GST_OBJECT_UNLOCK(dec);
+
+	if (!found)
+	{
+		GST_WARNING_OBJECT(dec, "cannot release unknown pad %s", GST_PAD_NAME(pad));
+		return;
+	}
+
+	GST_DEBUG_OBJECT(dec, "releasing stem pad %s", GST_PAD_NAME(pad));
+
+	gst_pad_set_active(pad, FALSE);
+	gst_element_remove_pad(element, pad);
+}
+
+
 
 static gboolean gst_nonstream_audio_decoder_sink_event(GstPad *pad, GstObject *parent, GstEvent *event)
 {
@@ -827,7 +1278,9 @@ static gboolean gst_nonstream_audio_decoder_sink_event(GstPad *pad, GstObject *p
 					return FALSE;
 				}
 
-				adapter_buffer = gst_adapter_take_buffer(dec->input_data_adapter, avail_size);
+				/* _fast does not merge the accumulated memories; subclasses
+				 * that can read them one by one avoid a full copy this way */
+				adapter_buffer = gst_adapter_take_buffer_fast(dec->input_data_adapter, avail_size);
 
 				if (!gst_nonstream_audio_decoder_load_from_buffer(dec, adapter_buffer))
 				{
@@ -913,7 +1366,8 @@ static GstFlowReturn gst_nonstream_audio_decoder_chain(G_GNUC_UNUSED GstPad *pad
 		avail_size = gst_adapter_available(dec->input_data_adapter);
 		if (avail_size >= dec->upstream_size)
 		{
-			GstBuffer *adapter_buffer = gst_adapter_take_buffer(dec->input_data_adapter, avail_size);
+			/* see the EOS handling in the sink event function for why _fast is used */
+			GstBuffer *adapter_buffer = gst_adapter_take_buffer_fast(dec->input_data_adapter, avail_size);
 
 			if (gst_nonstream_audio_decoder_load_from_buffer(dec, adapter_buffer))
 				flow_ret = gst_nonstream_audio_decoder_start_task(dec) ? GST_FLOW_OK : GST_FLOW_ERROR;
@@ -936,7 +1390,27 @@ static gboolean gst_nonstream_audio_decoder_src_event(GstPad *pad, GstObject *pa
 	{
 		case GST_EVENT_SEEK:
 		{
-			res = gst_nonstream_audio_decoder_do_seek(dec, event);
+			/* If stem pads are present, a seek sent to the pipeline reaches
+			 * this element once through each source pad. Only the first one
+			 * is carried out. */
+			guint32 seqnum = gst_event_get_seqnum(event);
+			gboolean is_duplicate;
+
+			GST_OBJECT_LOCK(dec);
+			is_duplicate = dec->last_seek_seqnum_valid && (dec->last_seek_seqnum == seqnum);
+			dec->last_seek_seqnum = seqnum;
+			dec->last_seek_seqnum_valid = TRUE;
+			GST_OBJECT_UNLOCK(dec);
+
+			if (is_duplicate)
+			{
+				GST_DEBUG_OBJECT(dec, "seek event with sequence number %" G_GUINT32_FORMAT " was already handled", seqnum);
+				gst_event_unref(event);
+				res = TRUE;
+			}
+			else
+				res = gst_nonstream_audio_decoder_do_seek(dec, event);
+
 			break;
 		}
 
@@ -969,6 +1443,33 @@ static gboolean gst_nonstream_audio_decoder_src_event(GstPad *pad, GstObject *pa
 			break;
 		}
 
+		case GST_EVENT_QOS:
+		{
+			gdouble proportion;
+			GstClockTimeDiff jitter;
+
+			/* Stem pads are pushed from the same task as the main source pad,
+			 * so their sinks report the same lateness. Counting their events
+			 * too would degrade the quality once per stem pad. */
+			if (pad != dec->srcpad)
+			{
+				res = gst_pad_event_default(pad, parent, event);
+				break;
+			}
+
+			gst_event_parse_qos(event, NULL, &proportion, &jitter, NULL);
+
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+			dec->qos_proportion = proportion;
+			dec->qos_jitter = jitter;
+			if (dec->qos_enabled && dec->loaded_mode)
+				gst_nonstream_audio_decoder_handle_qos(dec, proportion, jitter);
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+
+			res = gst_pad_event_default(pad, parent, event);
+			break;
+		}
+
 		default:
 			res = gst_pad_event_default(pad, parent, event);
 	}
@@ -1095,6 +1596,50 @@ static gboolean gst_nonstream_audio_decoder_src_query(GstPad *pad, GstObject *pa
 			break;
 		}
 
+		case GST_QUERY_CUSTOM:
+		{
+			GstStructure *state = gst_query_writable_structure(query);
+
+			if ((state == NULL) || !gst_structure_has_name(state, GST_NONSTREAM_AUDIO_DECODER_MODULE_STATE_QUERY))
+			{
+				res = gst_pad_query_default(pad, parent, query);
+				break;
+			}
+
+			if (!(dec->loaded_mode))
+			{
+				GST_DEBUG_OBJECT(parent, "cannot respond to module state query: nothing is loaded yet");
+				break;
+			}
+
+			GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+
+			if (klass->tell != NULL)
+			{
+				gst_structure_set(state, "position", G_TYPE_UINT64, (guint64)(klass->tell(dec)), NULL);
+				res = TRUE;
+			}
+
+			if (klass->get_module_position != NULL)
+			{
+				gint order, pattern, row;
+				if (klass->get_module_position(dec, &order, &pattern, &row))
+				{
+					gst_structure_set(state, "order", G_TYPE_INT, order, "pattern", G_TYPE_INT, pattern, "row", G_TYPE_INT, row, NULL);
+					res = TRUE;
+				}
+			}
+
+			if ((klass->get_module_state != NULL) && klass->get_module_state(dec, state))
+				res = TRUE;
+
+			GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+
+			GST_LOG_OBJECT(parent, "responding to module state query: %" GST_PTR_FORMAT, (gpointer)state);
+
+			break;
+		}
+
 		default:
 			res = gst_pad_query_default(pad, parent, query);
 	}
@@ -1104,35 +1649,203 @@ static gboolean gst_nonstream_audio_decoder_src_query(GstPad *pad, GstObject *pa
 
 
 
-static void gst_nonstream_audio_decoder_set_initial_state(GstNonstreamAudioDecoder *dec)
+static void gst_nonstream_audio_decoder_activate_pending_stems(GstNonstreamAudioDecoder *dec)
 {
-	dec->upstream_size = -1;
-	dec->loaded_mode = FALSE;
-
-	dec->subsong_duration = GST_CLOCK_TIME_NONE;
+	/* Must be called from the output task, so no events can be pushed
+	 * while the sticky events are copied. Requested stem pads start to
+	 * receive events and buffers afterwards. */
 
-	dec->output_format_changed = FALSE;
-	gst_audio_info_init(&(dec->output_audio_info));
-	dec->num_decoded_samples = 0;
-	dec->cur_pos_in_samples = 0;
-	gst_segment_init(&(dec->cur_segment), GST_FORMAT_TIME);
-	dec->discont = FALSE;
+	GstNonstreamAudioDecoderStickyEventCopyContext ctx;
+	GstNonstreamAudioDecoderStem stem;
+	gboolean found;
+	guint i;
 
-	dec->toc = NULL;
+	do
+	{
+		found = FALSE;
 
-	dec->allocator = NULL;
-}
+		GST_OBJECT_LOCK(dec);
+		for (i = 0; i < dec->stems->len; ++i)
+		{
+			if (g_array_index(dec->stems, GstNonstreamAudioDecoderStem, i).pending)
+			{
+				stem = g_array_index(dec->stems, GstNonstreamAudioDecoderStem, i);
+				gst_object_ref(stem.pad);
+				found = TRUE;
+				break;
+			}
+		}
+		GST_OBJECT_UNLOCK(dec);
 
+		if (!found)
+			break;
 
-static void gst_nonstream_audio_decoder_cleanup_state(GstNonstreamAudioDecoder *dec)
-{
-	gst_adapter_clear(dec->input_data_adapter);
+		GST_DEBUG_OBJECT(dec, "activating pad for stem %u", stem.index);
 
-	if (dec->allocator != NULL)
-	{
-		gst_object_unref(dec->allocator);
-		dec->allocator = NULL;
-	}
+		ctx.dec = dec;
+		ctx.stem = &stem;
+		gst_pad_sticky_events_foreach(dec->srcpad, gst_nonstream_audio_decoder_copy_sticky_event, &ctx);
+
+		/* the pad may have been released in the meantime */
+		GST_OBJECT_LOCK(dec);
+		for (i = 0; i < dec->stems->len; ++i)
+		{
+			GstNonstreamAudioDecoderStem *listed_stem = &g_array_index(dec->stems, GstNonstreamAudioDecoderStem, i);
+			if (listed_stem->pad == stem.pad)
+			{
+				listed_stem->pending = FALSE;
+				break;
+			}
+		}
+		GST_OBJECT_UNLOCK(dec);
+
+		gst_object_unref(stem.pad);
+	}
+	while (TRUE);
+}
+
+
+static GstNonstreamAudioDecoderStem* gst_nonstream_audio_decoder_get_stems(GstNonstreamAudioDecoder *dec, guint *num_stems)
+{
+	/* Returns a copy of the list of active stems, with a reference to each
+	 * pad, so the stems can be used without holding the object lock.
+	 * Pending stems are left out. */
+
+	GstNonstreamAudioDecoderStem *stems = NULL;
+	guint i;
+
+	GST_OBJECT_LOCK(dec);
+	*num_stems = 0;
+	if (dec->stems->len > 0)
+	{
+		stems = g_new(GstNonstreamAudioDecoderStem, dec->stems->len);
+		for (i = 0; i < dec->stems->len; ++i)
+		{
+			GstNonstreamAudioDecoderStem *stem = &g_array_index(dec->stems, GstNonstreamAudioDecoderStem, i);
+			if (stem->pending)
+				continue;
+
+			stems[*num_stems] = *stem;
+			gst_object_ref(stems[*num_stems].pad);
+			++(*num_stems);
+		}
+	}
+	GST_OBJECT_UNLOCK(dec);
+
+	if (*num_stems == 0)
+	{
+		g_free(stems);
+		stems = NULL;
+	}
+
+	return stems;
+}
+
+
+static void gst_nonstream_audio_decoder_free_stems(GstNonstreamAudioDecoderStem *stems, guint num_stems)
+{
+	guint i;
+
+	for (i = 0; i < num_stems; ++i)
+		gst_object_unref(stems[i].pad);
+	g_free(stems);
+}
+
+
+static GstEvent* gst_nonstream_audio_decoder_create_stem_stream_start(GstNonstreamAudioDecoder *dec, GstNonstreamAudioDecoderStem const *stem, GstEvent *stream_start)
+{
+	/* each stem is a stream of its own, so it needs its own stream ID;
+	 * the group ID is kept, since all stems belong together */
+
+	gchar *stream_id;
+	GstEvent *event;
+	guint group_id;
+
+	stream_id = gst_pad_create_stream_id_printf(stem->pad, GST_ELEMENT_CAST(dec), "stem-%u", stem->index);
+	event = gst_event_new_stream_start(stream_id);
+	g_free(stream_id);
+
+	if (gst_event_parse_group_id(stream_start, &group_id))
+		gst_event_set_group_id(event, group_id);
+	gst_event_set_seqnum(event, gst_event_get_seqnum(stream_start));
+
+	return event;
+}
+
+
+static gboolean gst_nonstream_audio_decoder_push_event(GstNonstreamAudioDecoder *dec, GstEvent *event)
+{
+	/* Pushes the event downstream through the main source pad and all stem pads */
+
+	GstNonstreamAudioDecoderStem *stems;
+	guint num_stems, i;
+
+	stems = gst_nonstream_audio_decoder_get_stems(dec, &num_stems);
+	for (i = 0; i < num_stems; ++i)
+	{
+		GstEvent *stem_event;
+
+		if (GST_EVENT_TYPE(event) == GST_EVENT_STREAM_START)
+			stem_event = gst_nonstream_audio_decoder_create_stem_stream_start(dec, &(stems[i]), event);
+		else
+			stem_event = gst_event_ref(event);
+
+		gst_pad_push_event(stems[i].pad, stem_event);
+	}
+	gst_nonstream_audio_decoder_free_stems(stems, num_stems);
+
+	return gst_pad_push_event(dec->srcpad, event);
+}
+
+
+static void gst_nonstream_audio_decoder_set_initial_state(GstNonstreamAudioDecoder *dec)
+{
+	dec->upstream_size = -1;
+	dec->loaded_mode = FALSE;
+
+	dec->subsong_duration = GST_CLOCK_TIME_NONE;
+
+	dec->output_format_changed = FALSE;
+	gst_audio_info_init(&(dec->output_audio_info));
+	dec->num_decoded_samples = 0;
+	dec->cur_pos_in_samples = 0;
+	gst_segment_init(&(dec->cur_segment), GST_FORMAT_TIME);
+	dec->discont = FALSE;
+	dec->playback_from_start = FALSE;
+	dec->playback_rate = 1.0;
+	dec->speed_factor = 1.0;
+	dec->segment_update_pending = FALSE;
+
+	dec->quality_degradation = 0;
+	dec->qos_proportion = 1.0;
+	dec->qos_jitter = 0;
+	dec->qos_num_late_events = 0;
+	dec->qos_num_healthy_events = 0;
+	dec->qos_last_change_time = 0;
+
+	dec->loudness = NULL;
+	dec->loudness_from_start = FALSE;
+
+	dec->toc = NULL;
+	dec->subsong_durations_changed = FALSE;
+
+	dec->last_seek_seqnum_valid = FALSE;
+
+	dec->content_digest_valid = FALSE;
+
+	dec->allocator = NULL;
+}
+
+
+static void gst_nonstream_audio_decoder_cleanup_state(GstNonstreamAudioDecoder *dec)
+{
+	gst_adapter_clear(dec->input_data_adapter);
+
+	if (dec->allocator != NULL)
+	{
+		gst_object_unref(dec->allocator);
+		dec->allocator = NULL;
+	}
 
 	if (dec->toc != NULL)
 	{
@@ -1140,6 +1853,12 @@ static void gst_nonstream_audio_decoder_cleanup_state(GstNonstreamAudioDecoder *
 		dec->toc = NULL;
 	}
 
+	if (dec->loudness != NULL)
+	{
+		gst_nonstream_audio_loudness_free(dec->loudness);
+		dec->loudness = NULL;
+	}
+
 	gst_nonstream_audio_decoder_set_initial_state(dec);
 }
 
@@ -1181,7 +1900,7 @@ static gboolean gst_nonstream_audio_decoder_negotiate_default(GstNonstreamAudioD
 
 	GST_DEBUG_OBJECT(dec, "setting src caps %" GST_PTR_FORMAT, (gpointer)caps);
 
-	res = gst_pad_push_event(dec->srcpad, gst_event_new_caps(caps));
+	res = gst_nonstream_audio_decoder_push_event(dec, gst_event_new_caps(caps));
 	/* clear any pending reconfigure flag */
 	gst_pad_check_reconfigure(dec->srcpad);
 
@@ -1300,6 +2019,11 @@ static gboolean gst_nonstream_audio_decoder_load_from_buffer(GstNonstreamAudioDe
 
 	GST_LOG_OBJECT(dec, "read %" G_GSIZE_FORMAT " bytes from upstream", gst_buffer_get_size(buffer));
 
+	/* Identify the song for the duration database before loading,
+	 * so the subclass can already look up durations in load_from_buffer */
+	if (dec->duration_db_path != NULL)
+		gst_nonstream_audio_decoder_compute_content_digest(dec, buffer);
+
 	initial_position = 0;
 	load_ok = klass->load_from_buffer(dec, buffer, dec->current_subsong, dec->subsong_mode, &initial_position, &(dec->output_mode), &(dec->num_loops));
 	gst_buffer_unref(buffer);
@@ -1375,12 +2099,12 @@ static gboolean gst_nonstream_audio_decoder_finish_load(GstNonstreamAudioDecoder
 
 
 	/* Handle the subsong duration */
-	if (klass->get_subsong_duration != NULL)
 	{
 		GstClockTime duration;
 		GST_TRACE_OBJECT(dec, "requesting subsong duration");
-		duration = klass->get_subsong_duration(dec, dec->current_subsong);
-		gst_nonstream_audio_decoder_update_subsong_duration(dec, duration);
+		duration = gst_nonstream_audio_decoder_query_current_duration(dec);
+		if ((klass->get_subsong_duration != NULL) || (duration != GST_CLOCK_TIME_NONE))
+			gst_nonstream_audio_decoder_update_subsong_duration(dec, duration);
 	}
 
 
@@ -1395,7 +2119,7 @@ static gboolean gst_nonstream_audio_decoder_finish_load(GstNonstreamAudioDecoder
 		if (tags != NULL)
 			tags = gst_nonstream_audio_decoder_add_main_tags(dec, tags);
 		if (tags != NULL)
-			gst_pad_push_event(dec->srcpad, gst_event_new_tag(tags));
+			gst_nonstream_audio_decoder_push_event(dec, gst_event_new_tag(tags));
 	}
 	else
 	{
@@ -1403,7 +2127,7 @@ static gboolean gst_nonstream_audio_decoder_finish_load(GstNonstreamAudioDecoder
 
 		GstTagList *tags = gst_tag_list_new_empty();
 		tags = gst_nonstream_audio_decoder_add_main_tags(dec, tags);
-		gst_pad_push_event(dec->srcpad, gst_event_new_tag(tags));
+		gst_nonstream_audio_decoder_push_event(dec, gst_event_new_tag(tags));
 	}
 
 
@@ -1418,7 +2142,7 @@ static gboolean gst_nonstream_audio_decoder_finish_load(GstNonstreamAudioDecoder
 
 		event = gst_event_new_stream_start(stream_id);
 		gst_event_set_group_id(event, gst_util_group_id_next());
-		gst_pad_push_event(dec->srcpad, event);
+		gst_nonstream_audio_decoder_push_event(dec, event);
 		g_free(stream_id);
 	}
 
@@ -1439,6 +2163,9 @@ static gboolean gst_nonstream_audio_decoder_finish_load(GstNonstreamAudioDecoder
 	/* Send new segment downstream */
 	gst_nonstream_audio_decoder_output_new_segment(dec, initial_position);
 
+	gst_nonstream_audio_decoder_restart_loudness_analysis(dec, initial_position);
+	dec->playback_from_start = (initial_position == 0);
+
 	dec->loaded_mode = TRUE;
 
 	GST_TRACE_OBJECT(dec, "exit finish_load");
@@ -1493,6 +2220,7 @@ static gboolean gst_nonstream_audio_decoder_switch_to_subsong(GstNonstreamAudioD
 		GstEvent *fevent;
 		GstClockTime new_position;
 		GstClockTime new_subsong_duration = GST_CLOCK_TIME_NONE;
+		gboolean subsong_mode_changed = FALSE;
 
 
 		/* Check if (a) new_subsong is already the current subsong
@@ -1539,7 +2267,7 @@ static gboolean gst_nonstream_audio_decoder_switch_to_subsong(GstNonstreamAudioD
 		else
 			GST_DEBUG_OBJECT(dec, "sending flush start event (no sequence number)");
 
-		gst_pad_push_event(dec->srcpad, gst_event_ref(fevent));
+		gst_nonstream_audio_decoder_push_event(dec, gst_event_ref(fevent));
 	        /* unlock upstream pull_range */
 		if (klass->loads_from_sinkpad)
 		        gst_pad_push_event(dec->sinkpad, fevent);
@@ -1553,6 +2281,13 @@ static gboolean gst_nonstream_audio_decoder_switch_to_subsong(GstNonstreamAudioD
 		GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
 
 
+		/* The analysis is restarted for the new subsong below; post what
+		 * was collected for the current one before that. This is done with
+		 * the stream lock held, since the output task feeds the analyzer
+		 * outside of the decoder lock. */
+		if (dec->loudness_analysis_enabled)
+			gst_nonstream_audio_decoder_publish_loudness_results(dec, FALSE);
+
 		if (!(klass->set_current_subsong(dec, new_subsong, &new_position)))
 		{
 			/* Switch failed. Do _not_ exit early from here - playback must
@@ -1567,6 +2302,13 @@ static gboolean gst_nonstream_audio_decoder_switch_to_subsong(GstNonstreamAudioD
 				new_position = 0;
 			GST_WARNING_OBJECT(dec, "switching to new subsong %u failed", new_subsong);
 		}
+		else if (dec->subsong_mode != GST_NONSTREM_AUDIO_SUBSONG_MODE_SINGLE)
+		{
+			/* subclasses leave the other subsong modes when the subsong is set */
+			GST_DEBUG_OBJECT(dec, "switching to the SINGLE subsong mode");
+			dec->subsong_mode = GST_NONSTREM_AUDIO_SUBSONG_MODE_SINGLE;
+			subsong_mode_changed = TRUE;
+		}
 
 		/* Flushing seek resets the base time, which means num_decoded_samples
 		 * needs to be set to 0, since it defines the segment.base value */
@@ -1582,7 +2324,7 @@ static gboolean gst_nonstream_audio_decoder_switch_to_subsong(GstNonstreamAudioD
 		else
 			GST_DEBUG_OBJECT(dec, "sending flush stop event (no sequence number)");
 
-		gst_pad_push_event(dec->srcpad, gst_event_ref(fevent));
+		gst_nonstream_audio_decoder_push_event(dec, gst_event_ref(fevent));
 	        /* unlock upstream pull_range */
 		if (klass->loads_from_sinkpad)
 		        gst_pad_push_event(dec->sinkpad, fevent);
@@ -1591,13 +2333,19 @@ static gboolean gst_nonstream_audio_decoder_switch_to_subsong(GstNonstreamAudioD
 
 
 		/* use the new subsong's duration (if one exists) */
-		if (klass->get_subsong_duration != NULL)
-			new_subsong_duration = klass->get_subsong_duration(dec, new_subsong);
+		new_subsong_duration = gst_nonstream_audio_decoder_query_subsong_duration(dec, new_subsong);
 		gst_nonstream_audio_decoder_update_subsong_duration(dec, new_subsong_duration);
 
+		/* the TOC entry times depend on the subsong mode */
+		if (subsong_mode_changed)
+			gst_nonstream_audio_decoder_update_toc(dec, klass);
+
 		/* create a new segment for the new subsong */
 		gst_nonstream_audio_decoder_output_new_segment(dec, new_position);
 
+		gst_nonstream_audio_decoder_restart_loudness_analysis(dec, new_position);
+		dec->playback_from_start = (new_position == 0);
+
 		/* use the new subsong's tags (if any exist) */
 		if (klass->get_subsong_tags != NULL)
 		{
@@ -1605,7 +2353,7 @@ static gboolean gst_nonstream_audio_decoder_switch_to_subsong(GstNonstreamAudioD
 			if (subsong_tags != NULL)
 				subsong_tags = gst_nonstream_audio_decoder_add_main_tags(dec, subsong_tags);
 			if (subsong_tags != NULL)
-				gst_pad_push_event(dec->srcpad, gst_event_new_tag(subsong_tags));
+				gst_nonstream_audio_decoder_push_event(dec, gst_event_new_tag(subsong_tags));
 		}
 
 		GST_DEBUG_OBJECT(dec, "successfully switched to new subsong %u", new_subsong);
@@ -1652,6 +2400,7 @@ static void gst_nonstream_audio_decoder_update_toc(GstNonstreamAudioDecoder *dec
 	/* must be called with lock */
 
 	guint num_subsongs, i;
+	GstClockTime subsong_start = 0;
 
 	if (dec->toc != NULL)
 	{
@@ -1685,10 +2434,12 @@ static void gst_nonstream_audio_decoder_update_toc(GstNonstreamAudioDecoder *dec
 		GstClockTime duration;
 		GstTagList *tags;
 
-		duration = (klass->get_subsong_duration != NULL) ? klass->get_subsong_duration(dec, i) : GST_CLOCK_TIME_NONE;
+		duration = gst_nonstream_audio_decoder_query_subsong_duration(dec, i);
 		tags = (klass->get_subsong_tags != NULL) ? klass->get_subsong_tags(dec, i) : NULL;
 		if (!tags)
 			tags = gst_tag_list_new_empty();
+		else
+			tags = gst_tag_list_make_writable(tags);
 
 		uid = g_strdup_printf("nonstream-subsong-%05u", i);
 		entry = gst_toc_entry_new(GST_TOC_ENTRY_TYPE_TRACK, uid);
@@ -1698,12 +2449,26 @@ static void gst_nonstream_audio_decoder_update_toc(GstNonstreamAudioDecoder *dec
 		if (duration != GST_CLOCK_TIME_NONE)
 			gst_tag_list_add(tags, GST_TAG_MERGE_KEEP, GST_TAG_DURATION, duration, NULL);
 
-		/* FIXME: TOC does not allow GST_CLOCK_TIME_NONE as a stop value */
-		if (duration == GST_CLOCK_TIME_NONE)
-			duration = G_MAXINT64;
+		if (dec->subsong_mode == GST_NONSTREM_AUDIO_SUBSONG_MODE_ALL)
+		{
+			/* The subsongs are played one after the other, so each one starts
+			 * where the previous one ends. After a subsong with an unknown
+			 * duration, the start times are unknown as well. */
+			gint64 start = (subsong_start != GST_CLOCK_TIME_NONE) ? (gint64)subsong_start : -1;
+			gint64 stop = ((subsong_start != GST_CLOCK_TIME_NONE) && (duration != GST_CLOCK_TIME_NONE)) ? (gint64)(subsong_start + duration) : G_MAXINT64;
+
+			gst_toc_entry_set_start_stop_times(entry, start, stop);
+			subsong_start = (stop != G_MAXINT64) ? (GstClockTime)stop : GST_CLOCK_TIME_NONE;
+		}
+		else
+		{
+			/* FIXME: TOC does not allow GST_CLOCK_TIME_NONE as a stop value */
+			if (duration == GST_CLOCK_TIME_NONE)
+				duration = G_MAXINT64;
 
-		/* Subsongs always start at 00:00 */
-		gst_toc_entry_set_start_stop_times(entry, 0, duration);
+			/* Subsongs always start at 00:00 */
+			gst_toc_entry_set_start_stop_times(entry, 0, duration);
+		}
 		gst_toc_entry_set_tags(entry, tags);
 
 		/* NOTE: *not* adding loop count via gst_toc_entry_set_loop(), since
@@ -1723,7 +2488,58 @@ static void gst_nonstream_audio_decoder_update_toc(GstNonstreamAudioDecoder *dec
 		g_free(uid);
 	}
 
-	gst_pad_push_event(dec->srcpad, gst_event_new_toc(dec->toc, FALSE));
+	gst_nonstream_audio_decoder_push_event(dec, gst_event_new_toc(dec->toc, FALSE));
+}
+
+
+static GstClockTime gst_nonstream_audio_decoder_query_subsong_duration(GstNonstreamAudioDecoder *dec, guint subsong)
+{
+	/* must be called with lock */
+
+	GstNonstreamAudioDecoderClass *klass = GST_NONSTREAM_AUDIO_DECODER_GET_CLASS(dec);
+	GstClockTime duration = GST_CLOCK_TIME_NONE;
+
+	if (klass->get_subsong_duration != NULL)
+		duration = klass->get_subsong_duration(dec, subsong);
+
+	/* Fall back to the duration database if the subclass does not know the
+	 * duration. Stored durations are single passes without loops, so they
+	 * do not apply if loops are added. */
+	if ((duration == GST_CLOCK_TIME_NONE) && (dec->num_loops == 0) && gst_nonstream_audio_decoder_get_stored_duration(dec, subsong, &duration))
+		GST_DEBUG_OBJECT(dec, "using stored duration %" GST_TIME_FORMAT " for subsong %u", GST_TIME_ARGS(duration), subsong);
+
+	return duration;
+}
+
+
+static GstClockTime gst_nonstream_audio_decoder_query_current_duration(GstNonstreamAudioDecoder *dec)
+{
+	/* must be called with lock */
+
+	/* In the ALL subsong mode, all subsongs are played one after the other,
+	 * so the duration is the sum of all subsong durations. If one of them is
+	 * unknown, the sum is unknown as well. */
+
+	GstNonstreamAudioDecoderClass *klass = GST_NONSTREAM_AUDIO_DECODER_GET_CLASS(dec);
+	GstClockTime total_duration = 0;
+	guint num_subsongs, i;
+
+	if ((dec->subsong_mode != GST_NONSTREM_AUDIO_SUBSONG_MODE_ALL) || (klass->get_num_subsongs == NULL))
+		return gst_nonstream_audio_decoder_query_subsong_duration(dec, dec->current_subsong);
+
+	num_subsongs = klass->get_num_subsongs(dec);
+	if (num_subsongs == 0)
+		return gst_nonstream_audio_decoder_query_subsong_duration(dec, dec->current_subsong);
+
+	for (i = 0; i < num_subsongs; ++i)
+	{
+		GstClockTime duration = gst_nonstream_audio_decoder_query_subsong_duration(dec, i);
+		if (duration == GST_CLOCK_TIME_NONE)
+			return GST_CLOCK_TIME_NONE;
+		total_duration += duration;
+	}
+
+	return total_duration;
 }
 
 
@@ -1738,6 +2554,112 @@ static void gst_nonstream_audio_decoder_update_subsong_duration(GstNonstreamAudi
 }
 
 
+static void gst_nonstream_audio_decoder_compute_content_digest(GstNonstreamAudioDecoder *dec, GstBuffer *buffer)
+{
+	/* must be called with lock */
+
+	/* The memories are hashed one by one. Mapping the entire buffer
+	 * would merge them, and since the buffer is writable, the merged
+	 * copy would replace them, which defeats subclasses that read the
+	 * memories individually. */
+
+	GstMapInfo map;
+	GChecksum *checksum;
+	gsize digest_length = sizeof(dec->content_digest);
+	guint num_memories, i;
+
+	dec->content_digest_valid = FALSE;
+
+	checksum = g_checksum_new(G_CHECKSUM_MD5);
+
+	num_memories = gst_buffer_n_memory(buffer);
+	for (i = 0; i < num_memories; ++i)
+	{
+		GstMemory *memory = gst_buffer_peek_memory(buffer, i);
+
+		if (!gst_memory_map(memory, &map, GST_MAP_READ))
+		{
+			GST_WARNING_OBJECT(dec, "could not map memory #%u of the input buffer; duration database will not be used", i);
+			g_checksum_free(checksum);
+			return;
+		}
+
+		g_checksum_update(checksum, map.data, map.size);
+		gst_memory_unmap(memory, &map);
+	}
+
+	g_checksum_get_digest(checksum, dec->content_digest, &digest_length);
+	g_checksum_free(checksum);
+
+	dec->content_digest_valid = (digest_length == sizeof(dec->content_digest));
+}
+
+
+static void gst_nonstream_audio_decoder_get_duration_db_key(GstNonstreamAudioDecoder *dec, guint8 *key)
+{
+	/* must be called with lock */
+
+	/* The same song data can yield different durations with different
+	 * decoders, or with different decoder settings, so these are part
+	 * of the key. The settings hash is queried each time, since the
+	 * settings may change after loading. */
+
+	GstNonstreamAudioDecoderClass *klass = GST_NONSTREAM_AUDIO_DECODER_GET_CLASS(dec);
+	GChecksum *checksum;
+	gchar const *type_name = G_OBJECT_TYPE_NAME(dec);
+	guint64 settings_hash = 0;
+	gsize key_length = GST_NONSTREAM_AUDIO_DURATION_DB_KEY_SIZE;
+
+	if (klass->get_duration_settings_hash != NULL)
+		settings_hash = GUINT64_TO_LE(klass->get_duration_settings_hash(dec));
+
+	checksum = g_checksum_new(G_CHECKSUM_MD5);
+	g_checksum_update(checksum, dec->content_digest, sizeof(dec->content_digest));
+	g_checksum_update(checksum, (guchar const *)type_name, strlen(type_name) + 1);
+	g_checksum_update(checksum, (guchar const *)&settings_hash, sizeof(settings_hash));
+	g_checksum_get_digest(checksum, key, &key_length);
+	g_checksum_free(checksum);
+}
+
+
+static void gst_nonstream_audio_decoder_store_played_duration(GstNonstreamAudioDecoder *dec)
+{
+	/* must be called with lock */
+
+	GstNonstreamAudioDecoderClass *klass = GST_NONSTREAM_AUDIO_DECODER_GET_CLASS(dec);
+	GstClockTime duration;
+
+	/* The position at the end only equals the duration if playback
+	 * started at the beginning, ran up to the natural end of the subsong,
+	 * and no loops were added */
+	if (!(dec->playback_from_start) || (dec->num_loops != 0) || (dec->subsong_mode == GST_NONSTREM_AUDIO_SUBSONG_MODE_ALL))
+		return;
+
+	/* a segment stop position cuts the playback short */
+	if (GST_CLOCK_TIME_IS_VALID(dec->cur_segment.stop))
+		return;
+
+	/* If the subclass knows the duration, it ends playback there. This is
+	 * either the actual duration (nothing to learn then), or a play length
+	 * limit for songs which may not end at all (such as a default length
+	 * after which the output is faded out). Such a partial play must not be
+	 * stored as the duration. */
+	if ((klass->get_subsong_duration != NULL) && GST_CLOCK_TIME_IS_VALID(klass->get_subsong_duration(dec, dec->current_subsong)))
+		return;
+
+	/* sped up or slowed down playback does not reflect the actual duration */
+	if ((dec->playback_rate != 1.0) || (dec->speed_factor != 1.0))
+		return;
+
+	if (!GST_AUDIO_INFO_IS_VALID(&(dec->output_audio_info)))
+		return;
+
+	duration = gst_util_uint64_scale_int(dec->cur_pos_in_samples, GST_SECOND, dec->output_audio_info.rate);
+	GST_DEBUG_OBJECT(dec, "subsong %u was played to its end; storing duration %" GST_TIME_FORMAT, dec->current_subsong, GST_TIME_ARGS(duration));
+	gst_nonstream_audio_decoder_store_duration(dec, dec->current_subsong, duration);
+}
+
+
 static void gst_nonstream_audio_decoder_output_new_segment(GstNonstreamAudioDecoder *dec, GstClockTime start_position)
 {
 	/* must be called with lock */
@@ -1751,6 +2673,10 @@ static void gst_nonstream_audio_decoder_output_new_segment(GstNonstreamAudioDeco
 	segment.time = start_position;
 	segment.offset = 0;
 	segment.position = 0;
+	/* the subclass renders at the new speed already, so the timestamps run
+	 * at the normal rate, while the stream time advances faster or slower */
+	segment.applied_rate = dec->playback_rate * dec->speed_factor;
+	dec->segment_update_pending = FALSE;
 
 	/* note that num_decoded_samples isn't being reset; it is the
 	 * analogue to the segment base value, and thus is supposed to
@@ -1771,7 +2697,7 @@ static void gst_nonstream_audio_decoder_output_new_segment(GstNonstreamAudioDeco
 	dec->cur_segment = segment;
 	dec->discont = TRUE;
 
-	gst_pad_push_event(dec->srcpad, gst_event_new_segment(&segment));
+	gst_nonstream_audio_decoder_push_event(dec, gst_event_new_segment(&segment));
 }
 
 
@@ -1839,6 +2765,41 @@ static gboolean gst_nonstream_audio_decoder_do_seek(GstNonstreamAudioDecoder *de
 		return FALSE;
 	}
 
+#if GST_CHECK_VERSION(1, 18, 0)
+	if (flags & GST_SEEK_FLAG_INSTANT_RATE_CHANGE)
+	{
+		/* The subclass changes its playback speed right away. Since it
+		 * renders at the new speed, there is no need to send an
+		 * instant-rate-change event downstream. A new segment with the
+		 * new applied rate is sent before the next buffer instead. */
+
+		if ((klass->set_playback_rate == NULL) || (start_type != GST_SEEK_TYPE_NONE) || (stop_type != GST_SEEK_TYPE_NONE))
+		{
+			GST_DEBUG_OBJECT(dec, "cannot perform instant rate change");
+			return FALSE;
+		}
+
+		GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
+		res = TRUE;
+		if (rate != dec->playback_rate)
+		{
+			res = klass->set_playback_rate(dec, rate);
+			if (res)
+			{
+				dec->playback_rate = rate;
+				dec->playback_from_start = FALSE;
+				dec->segment_update_pending = TRUE;
+			}
+		}
+		GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
+
+		GST_DEBUG_OBJECT(dec, "instant rate change to %f %s", rate, res ? "succeeded" : "failed");
+
+		gst_event_unref(event);
+		return res;
+	}
+#endif
+
 	flush = ((flags & GST_SEEK_FLAG_FLUSH) == GST_SEEK_FLAG_FLUSH);
 
 	if (flush)
@@ -1848,7 +2809,7 @@ static gboolean gst_nonstream_audio_decoder_do_seek(GstNonstreamAudioDecoder *de
 
 		GST_DEBUG_OBJECT(dec, "sending flush start event with sequence number %" G_GUINT32_FORMAT, seqnum);
 
-		gst_pad_push_event(dec->srcpad, gst_event_ref(fevent));
+		gst_nonstream_audio_decoder_push_event(dec, gst_event_ref(fevent));
 	        /* unlock upstream pull_range */
 		if (klass->loads_from_sinkpad)
 		        gst_pad_push_event(dec->sinkpad, fevent);
@@ -1909,10 +2870,41 @@ static gboolean gst_nonstream_audio_decoder_do_seek(GstNonstreamAudioDecoder *de
 	res = klass->seek(dec, &new_position);
 	segment.position = new_position;
 
+	/* Let the subclass apply the rate if it can; the output then runs at
+	 * the normal rate, and the segment records the applied one. This is
+	 * only done once the seek succeeded. If it failed, playback continues
+	 * at the position it was at, so it continues at the previous rate. */
+	if (!res)
+	{
+		segment.rate = dec->cur_segment.rate;
+		segment.applied_rate = dec->cur_segment.applied_rate;
+	}
+	else if ((klass->set_playback_rate != NULL) && ((rate == dec->playback_rate) || klass->set_playback_rate(dec, rate)))
+	{
+		dec->playback_rate = rate;
+		segment.rate = 1.0;
+		segment.applied_rate = rate * dec->speed_factor;
+	}
+	else if (klass->set_playback_rate != NULL)
+		GST_DEBUG_OBJECT(dec, "subclass cannot apply rate %f - leaving it to downstream", rate);
+
 	dec->cur_segment = segment;
 	dec->cur_pos_in_samples = gst_util_uint64_scale_int(dec->cur_segment.position, dec->output_audio_info.rate, GST_SECOND);
 	dec->num_decoded_samples = 0;
 
+	if (res)
+	{
+		gst_nonstream_audio_decoder_restart_loudness_analysis(dec, new_position);
+		dec->playback_from_start = (new_position == 0);
+
+		/* in the ALL subsong mode, seeking can move to another subsong */
+		if ((dec->subsong_mode == GST_NONSTREM_AUDIO_SUBSONG_MODE_ALL) && (klass->get_current_subsong != NULL))
+			dec->current_subsong = klass->get_current_subsong(dec);
+	}
+
+	/* the seek segment below already contains the current applied rate */
+	dec->segment_update_pending = FALSE;
+
 	GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
 
 	if (flush)
@@ -1922,7 +2914,7 @@ static gboolean gst_nonstream_audio_decoder_do_seek(GstNonstreamAudioDecoder *de
 
 		GST_DEBUG_OBJECT(dec, "sending flush stop event with sequence number %" G_GUINT32_FORMAT, seqnum);
 
-		gst_pad_push_event(dec->srcpad, gst_event_ref(fevent));
+		gst_nonstream_audio_decoder_push_event(dec, gst_event_ref(fevent));
 		if (klass->loads_from_sinkpad)
 		        gst_pad_push_event(dec->sinkpad, fevent);
 		else
@@ -1944,7 +2936,7 @@ static gboolean gst_nonstream_audio_decoder_do_seek(GstNonstreamAudioDecoder *de
 			);
 		}
 
-		gst_pad_push_event(dec->srcpad, gst_event_new_segment(&segment));
+		gst_nonstream_audio_decoder_push_event(dec, gst_event_new_segment(&segment));
 
 		GST_INFO_OBJECT(dec, "seek succeeded");
 
@@ -1963,6 +2955,171 @@ static gboolean gst_nonstream_audio_decoder_do_seek(GstNonstreamAudioDecoder *de
 }
 
 
+static void gst_nonstream_audio_decoder_handle_qos(GstNonstreamAudioDecoder *dec, gdouble proportion, GstClockTimeDiff jitter)
+{
+	/* must be called with lock */
+
+	gint64 now = g_get_monotonic_time();
+
+	if ((jitter > 0) && (proportion > 1.0))
+	{
+		/* output is arriving late, and the lateness is getting worse */
+
+		dec->qos_num_healthy_events = 0;
+		dec->qos_num_late_events++;
+
+		if ((dec->qos_num_late_events >= QOS_NUM_LATE_EVENTS_FOR_DEGRADATION) && ((now - dec->qos_last_change_time) >= QOS_DEGRADATION_HOLDOFF))
+		{
+			GST_DEBUG_OBJECT(dec, "decoder is falling behind (proportion %f jitter %" G_GINT64_FORMAT "); trying to degrade quality", proportion, jitter);
+			gst_nonstream_audio_decoder_set_quality_degradation(dec, dec->quality_degradation + 1);
+			dec->qos_num_late_events = 0;
+			dec->qos_last_change_time = now;
+		}
+	}
+	else if ((jitter < 0) && (proportion < QOS_HEALTHY_PROPORTION))
+	{
+		/* output is on time, with headroom to spare */
+
+		dec->qos_num_late_events = 0;
+
+		if (dec->quality_degradation == 0)
+			return;
+
+		dec->qos_num_healthy_events++;
+
+		if ((dec->qos_num_healthy_events >= QOS_NUM_HEALTHY_EVENTS_FOR_RECOVERY) && ((now - dec->qos_last_change_time) >= QOS_RECOVERY_HOLDOFF))
+		{
+			GST_DEBUG_OBJECT(dec, "decoder is keeping up again (proportion %f jitter %" G_GINT64_FORMAT "); restoring quality", proportion, jitter);
+			gst_nonstream_audio_decoder_set_quality_degradation(dec, dec->quality_degradation - 1);
+			dec->qos_num_healthy_events = 0;
+			dec->qos_last_change_time = now;
+		}
+	}
+	else
+	{
+		/* in between; neither counts towards a change */
+		dec->qos_num_late_events = 0;
+		dec->qos_num_healthy_events = 0;
+	}
+}
+
+
+static void gst_nonstream_audio_decoder_set_quality_degradation(GstNonstreamAudioDecoder *dec, guint degradation)
+{
+	/* must be called with lock */
+
+	GstNonstreamAudioDecoderClass *klass = GST_NONSTREAM_AUDIO_DECODER_GET_CLASS(dec);
+
+	if (degradation == dec->quality_degradation)
+		return;
+
+	if (klass->set_quality_degradation == NULL)
+	{
+		GST_TRACE_OBJECT(dec, "cannot call set_quality_degradation, since it is NULL");
+		return;
+	}
+
+	if (klass->set_quality_degradation(dec, degradation))
+	{
+		GST_INFO_OBJECT(dec, "quality degradation changed from %u to %u", dec->quality_degradation, degradation);
+		dec->quality_degradation = degradation;
+	}
+	else
+		GST_DEBUG_OBJECT(dec, "subclass does not support quality degradation %u; staying at %u", degradation, dec->quality_degradation);
+}
+
+
+static void gst_nonstream_audio_decoder_restart_loudness_analysis(GstNonstreamAudioDecoder *dec, GstClockTime start_position)
+{
+	/* must be called with lock, and either from the output task or
+	 * with the stream lock held, since the output task feeds the
+	 * analyzer without holding the lock */
+
+	/* Results are only meaningful if they cover the entire (sub)song.
+	 * If playback starts somewhere else, keep analyzing (so the analyzer
+	 * state stays consistent), but do not publish anything at the end. */
+	dec->loudness_from_start = (start_position == 0);
+
+	if (dec->loudness != NULL)
+		gst_nonstream_audio_loudness_reset(dec->loudness);
+
+	GST_DEBUG_OBJECT(dec, "restarting loudness analysis at position %" GST_TIME_FORMAT, GST_TIME_ARGS(start_position));
+}
+
+
+static void gst_nonstream_audio_decoder_publish_loudness_results(GstNonstreamAudioDecoder *dec, gboolean complete)
+{
+	/* must be called with lock, and either from the output task or with
+	 * the stream lock held (see restart_loudness_analysis); complete is
+	 * FALSE if playback of the (sub)song did not reach its end, in which
+	 * case only the element message is posted, and no ReplayGain tags
+	 * are sent */
+
+	GstNonstreamAudioDecoderClass *klass = GST_NONSTREAM_AUDIO_DECODER_GET_CLASS(dec);
+	gdouble integrated_loudness, loudness_range, true_peak;
+	GstTagList *tags = NULL;
+
+	if (dec->loudness == NULL)
+		return;
+
+	if (!(dec->loudness_from_start))
+	{
+		GST_DEBUG_OBJECT(dec, "loudness analysis did not cover the entire (sub)song; not publishing results");
+		return;
+	}
+
+	if (!gst_nonstream_audio_loudness_get_results(dec->loudness, &integrated_loudness, &loudness_range, &true_peak))
+	{
+		GST_DEBUG_OBJECT(dec, "output too short or too quiet for a loudness measurement");
+		return;
+	}
+
+	GST_INFO_OBJECT(dec, "subsong %u: integrated loudness %.2f LUFS, loudness range %.2f LU, true peak %f%s", dec->current_subsong, integrated_loudness, loudness_range, true_peak, complete ? "" : " (incomplete)");
+
+	/* Send the ReplayGain tags downstream, along with the existing tags,
+	 * since a tag event replaces the previous tags of the same scope */
+	if (complete)
+	{
+		if (klass->get_subsong_tags != NULL)
+			tags = klass->get_subsong_tags(dec, dec->current_subsong);
+		if (tags == NULL)
+			tags = gst_tag_list_new_empty();
+		else
+			tags = gst_tag_list_make_writable(tags);
+		tags = gst_nonstream_audio_decoder_add_main_tags(dec, tags);
+
+		gst_tag_list_add(
+			tags, GST_TAG_MERGE_REPLACE,
+			GST_TAG_TRACK_GAIN, GST_NONSTREAM_AUDIO_LOUDNESS_REPLAYGAIN_REFERENCE - integrated_loudness,
+			GST_TAG_TRACK_PEAK, true_peak,
+			GST_TAG_REFERENCE_LEVEL, REPLAYGAIN_REFERENCE_LEVEL,
+			NULL
+		);
+
+		gst_nonstream_audio_decoder_push_event(dec, gst_event_new_tag(tags));
+	}
+
+	gst_element_post_message(
+		GST_ELEMENT(dec),
+		gst_message_new_element(
+			GST_OBJECT(dec),
+			gst_structure_new(
+				"nonstream-audio-loudness",
+				"subsong", G_TYPE_UINT, dec->current_subsong,
+				"integrated-loudness", G_TYPE_DOUBLE, integrated_loudness,
+				"loudness-range", G_TYPE_DOUBLE, loudness_range,
+				"true-peak", G_TYPE_DOUBLE, true_peak,
+				"complete", G_TYPE_BOOLEAN, complete,
+				NULL
+			)
+		)
+	);
+
+	/* publish only once per (sub)song */
+	dec->loudness_from_start = FALSE;
+}
+
+
 static GstTagList * gst_nonstream_audio_decoder_add_main_tags(GstNonstreamAudioDecoder *dec, GstTagList *tags)
 {
 	GstNonstreamAudioDecoderClass *klass = GST_NONSTREAM_AUDIO_DECODER_GET_CLASS(dec);
@@ -2005,19 +3162,65 @@ static void gst_nonstream_audio_decoder_output_task(GstNonstreamAudioDecoder *de
 	GstFlowReturn flow;
 	GstBuffer *outbuf;
 	guint num_samples;
+	GstNonstreamAudioAnalysisMeta *analysis_meta;
+	GstClockTime track_position = GST_CLOCK_TIME_NONE;
+	gint order = -1, pattern = -1, row = -1;
+	GstNonstreamAudioLoudness *loudness = NULL;
+	GstNonstreamAudioDecoderStem *stems = NULL;
+	guint num_stems = 0, i;
+	GstBuffer **stem_buffers = NULL;
 
 	GstNonstreamAudioDecoderClass *klass;
 	klass = GST_NONSTREAM_AUDIO_DECODER_CLASS(G_OBJECT_GET_CLASS(dec));
 	g_assert(klass->decode != NULL);
 
+	/* stem pads requested since the last iteration get the sticky events first */
+	gst_nonstream_audio_decoder_activate_pending_stems(dec);
+
 	GST_NONSTREAM_AUDIO_DECODER_LOCK_MUTEX(dec);
 
+	/* the subclass found out more subsong durations since the last decode call */
+	if (G_UNLIKELY(dec->subsong_durations_changed))
+	{
+		GstClockTime duration;
+
+		dec->subsong_durations_changed = FALSE;
+
+		duration = gst_nonstream_audio_decoder_query_current_duration(dec);
+		if (duration != dec->subsong_duration)
+		{
+			GST_DEBUG_OBJECT(dec, "duration of current subsong is now known: %" GST_TIME_FORMAT, GST_TIME_ARGS(duration));
+			gst_nonstream_audio_decoder_update_subsong_duration(dec, duration);
+		}
+
+		gst_nonstream_audio_decoder_update_toc(dec, klass);
+	}
+
+	/* the playback speed changed without a flushing seek; continue with
+	 * a segment that has the new applied rate */
+	if (G_UNLIKELY(dec->segment_update_pending))
+		gst_nonstream_audio_decoder_output_new_segment(dec, (klass->tell != NULL) ? klass->tell(dec) : 0);
+
+	/* get the position before decoding, since the analysis
+	 * meta describes the position at the start of the buffer */
+	if (dec->analysis_meta_enabled)
+	{
+		if (klass->tell != NULL)
+			track_position = klass->tell(dec);
+		if ((klass->get_module_position != NULL) && !(klass->get_module_position(dec, &order, &pattern, &row)))
+			order = pattern = row = -1;
+	}
+
 	/* perform the actual decoding */
 	if (!(klass->decode(dec, &outbuf, &num_samples)))
 	{
 		/* EOS case */
+		if (dec->duration_db_path != NULL)
+			gst_nonstream_audio_decoder_store_played_duration(dec);
+		if (dec->loudness_analysis_enabled)
+			gst_nonstream_audio_decoder_publish_loudness_results(dec, TRUE);
 		GST_INFO_OBJECT(dec, "decode() reports end -> sending EOS event");
-		gst_pad_push_event(dec->srcpad, gst_event_new_eos());
+		gst_nonstream_audio_decoder_push_event(dec, gst_event_new_eos());
 		goto pause_unlock;
 	}
 
@@ -2040,6 +3243,21 @@ static void gst_nonstream_audio_decoder_output_task(GstNonstreamAudioDecoder *de
 		dec->discont = FALSE;
 	}
 
+	if (dec->analysis_meta_enabled)
+	{
+		analysis_meta = gst_buffer_add_nonstream_audio_analysis_meta(outbuf);
+		analysis_meta->track_position = track_position;
+		analysis_meta->order = order;
+		analysis_meta->pattern = pattern;
+		analysis_meta->row = row;
+
+		/* compute the levels of the block decode() just produced, before
+		 * any other processing; the samples are most likely still in the
+		 * cache at this point. output_audio_info already describes the
+		 * buffer even if decode() just changed the output format. */
+		gst_nonstream_audio_analysis_meta_compute_levels(analysis_meta, &(dec->output_audio_info), outbuf, num_samples);
+	}
+
 	GST_LOG_OBJECT(
 		dec,
 		"output buffer stats: num_samples = %u  duration = %" GST_TIME_FORMAT "  cur_pos_in_samples = %" G_GUINT64_FORMAT "  timestamp = %" GST_TIME_FORMAT,
@@ -2068,8 +3286,95 @@ static void gst_nonstream_audio_decoder_output_task(GstNonstreamAudioDecoder *de
 		}
 	}
 
+	if (dec->loudness_analysis_enabled)
+	{
+		/* (re)create the analyzer if necessary; if the output format changed
+		 * mid-playback, the results no longer cover the whole (sub)song */
+		if ((dec->loudness != NULL) && !gst_nonstream_audio_loudness_is_compatible(dec->loudness, &(dec->output_audio_info)))
+		{
+			GST_DEBUG_OBJECT(dec, "output format changed; restarting loudness analysis");
+			gst_nonstream_audio_loudness_free(dec->loudness);
+			dec->loudness = NULL;
+			dec->loudness_from_start = FALSE;
+		}
+
+		if (dec->loudness == NULL)
+		{
+			dec->loudness = gst_nonstream_audio_loudness_new(&(dec->output_audio_info));
+			if (dec->loudness == NULL)
+			{
+				GST_WARNING_OBJECT(dec, "cannot analyze loudness of this output format; disabling loudness analysis");
+				dec->loudness_analysis_enabled = FALSE;
+			}
+		}
+
+		/* The analyzer is only modified by this task and by code that runs
+		 * while holding the stream lock, so it can be used without the
+		 * decoder lock */
+		loudness = dec->loudness;
+	}
+
+	/* render the stems for the same span of the song */
+	if (klass->decode_stems != NULL)
+		stems = gst_nonstream_audio_decoder_get_stems(dec, &num_stems);
+	if (num_stems > 0)
+	{
+		guint *stem_indices = g_new(guint, num_stems);
+		stem_buffers = g_new0(GstBuffer*, num_stems);
+
+		for (i = 0; i < num_stems; ++i)
+			stem_indices[i] = stems[i].index;
+
+		if (!(klass->decode_stems(dec, stem_indices, stem_buffers, num_stems, num_samples)))
+			GST_WARNING_OBJECT(dec, "decode_stems() failed; filling missing stems with silence");
+
+		g_free(stem_indices);
+
+		for (i = 0; i < num_stems; ++i)
+		{
+			if (stem_buffers[i] == NULL)
+			{
+				GstMapInfo map;
+
+				stem_buffers[i] = gst_nonstream_audio_decoder_allocate_output_buffer(dec, num_samples * GST_AUDIO_INFO_BPF(&(dec->output_audio_info)));
+				if (stem_buffers[i] == NULL)
+					continue;
+
+				gst_buffer_map(stem_buffers[i], &map, GST_MAP_WRITE);
+				gst_audio_format_fill_silence(dec->output_audio_info.finfo, map.data, map.size);
+				gst_buffer_unmap(stem_buffers[i], &map);
+
+#if GST_CHECK_VERSION(1, 16, 0)
+				if (GST_AUDIO_INFO_LAYOUT(&(dec->output_audio_info)) == GST_AUDIO_LAYOUT_NON_INTERLEAVED)
+					gst_buffer_add_audio_meta(stem_buffers[i], &(dec->output_audio_info), num_samples, NULL);
+#endif
+			}
+
+			gst_buffer_copy_into(stem_buffers[i], outbuf, GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS, 0, -1);
+		}
+	}
+
 	GST_NONSTREAM_AUDIO_DECODER_UNLOCK_MUTEX(dec);
 
+	if (loudness != NULL)
+		gst_nonstream_audio_loudness_process(loudness, outbuf, num_samples);
+
+	/* Push the stems before the main output. Errors in stem pads (for
+	 * example, unlinked pads) do not affect the rest of the playback. */
+	for (i = 0; i < num_stems; ++i)
+	{
+		GstFlowReturn stem_flow;
+
+		if (stem_buffers[i] == NULL)
+			continue;
+
+		stem_flow = gst_pad_push(stems[i].pad, stem_buffers[i]);
+		if ((stem_flow != GST_FLOW_OK) && (stem_flow != GST_FLOW_NOT_LINKED) && (stem_flow != GST_FLOW_FLUSHING))
+			GST_WARNING_OBJECT(dec, "pushing buffer through stem pad %s failed: %s", GST_PAD_NAME(stems[i].pad), gst_flow_get_name(stem_flow));
+	}
+	g_free(stem_buffers);
+	gst_nonstream_audio_decoder_free_stems(stems, num_stems);
+
 	/* push new samples downstream
 	 * no need to unref buffer - gst_pad_push() does it in
 	 * all cases (success and failure) */
@@ -2167,6 +3472,48 @@ void gst_nonstream_audio_decoder_handle_loop(GstNonstreamAudioDecoder *dec, GstC
 }
 
 
+/**
+ * gst_nonstream_audio_decoder_handle_subsong_change:
+ * @dec: a #GstNonstreamAudioDecoder
+ * @new_subsong: Index of the subsong that is now being played
+ *
+ * Reports that playback moved on to another subsong without a
+ * set_current_subsong() call. This happens in the
+ * GST_NONSTREAM_AUDIO_SUBSONG_MODE_ALL subsong mode, where the subclass
+ * plays all subsongs one after the other in one continuous stream.
+ *
+ * The loudness analysis results of the finished subsong are published,
+ * the analysis restarts for the new one, the current-subsong property
+ * reflects the new subsong, and the new subsong's tags are sent downstream.
+ * The segment is not changed, since the position keeps referring to the
+ * timeline of all subsongs.
+ *
+ * This function must be called with the decoder mutex lock held, from
+ * within @decode, before the first samples of the new subsong are returned.
+ */
+void gst_nonstream_audio_decoder_handle_subsong_change(GstNonstreamAudioDecoder *dec, guint new_subsong)
+{
+	GstNonstreamAudioDecoderClass *klass = GST_NONSTREAM_AUDIO_DECODER_GET_CLASS(dec);
+
+	GST_DEBUG_OBJECT(dec, "handle_subsong_change() invoked with new_subsong = %u", new_subsong);
+
+	if (dec->loudness_analysis_enabled)
+		gst_nonstream_audio_decoder_publish_loudness_results(dec, TRUE);
+
+	dec->current_subsong = new_subsong;
+	gst_nonstream_audio_decoder_restart_loudness_analysis(dec, 0);
+
+	if (klass->get_subsong_tags != NULL)
+	{
+		GstTagList *subsong_tags = klass->get_subsong_tags(dec, new_subsong);
+		if (subsong_tags != NULL)
+			subsong_tags = gst_nonstream_audio_decoder_add_main_tags(dec, subsong_tags);
+		if (subsong_tags != NULL)
+			gst_nonstream_audio_decoder_push_event(dec, gst_event_new_tag(subsong_tags));
+	}
+}
+
+
 /**
  * gst_nonstream_audio_decoder_set_output_format:
  * @dec: a #GstNonstreamAudioDecoder
@@ -2439,3 +3786,137 @@ GstBuffer* gst_nonstream_audio_decoder_allocate_output_buffer(GstNonstreamAudioD
 
 	return gst_buffer_new_allocate(dec->allocator, size, &(dec->allocation_params));
 }
+
+
+static gboolean gst_nonstream_audio_decoder_open_duration_db(GstNonstreamAudioDecoder *dec)
+{
+	/* must be called with lock */
+
+	if (dec->duration_db != NULL)
+		return TRUE;
+
+	if ((dec->duration_db_path == NULL) || dec->duration_db_open_failed || !(dec->content_digest_valid))
+		return FALSE;
+
+	dec->duration_db = gst_nonstream_audio_duration_db_open(dec->duration_db_path);
+	if (dec->duration_db == NULL)
+	{
+		/* do not try again until the path is changed */
+		GST_WARNING_OBJECT(dec, "could not open duration database \"%s\"", dec->duration_db_path);
+		dec->duration_db_open_failed = TRUE;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+/**
+ * gst_nonstream_audio_decoder_get_stored_duration:
+ * @dec: Decoder instance
+ * @subsong: Index of the subsong whose duration shall be looked up
+ * @duration: Pointer to a GstClockTime value which is set to the stored duration
+ *
+ * Looks up the duration of a subsong of the current song in the duration
+ * database. Subclasses which compute durations in an expensive way should
+ * call this first, and only compute the duration if nothing was found.
+ *
+ * This function may only be called from within @load_from_buffer and
+ * vfuncs which are called after loading. It must be called with the
+ * decoder mutex lock held.
+ *
+ * Returns: TRUE if a duration was found, FALSE otherwise (also if there is
+ * no duration database, or if the song was not loaded from the sinkpad)
+ */
+gboolean gst_nonstream_audio_decoder_get_stored_duration(GstNonstreamAudioDecoder *dec, guint subsong, GstClockTime *duration)
+{
+	guint8 key[GST_NONSTREAM_AUDIO_DURATION_DB_KEY_SIZE];
+
+	g_return_val_if_fail(duration != NULL, FALSE);
+
+	if (!gst_nonstream_audio_decoder_open_duration_db(dec))
+		return FALSE;
+
+	gst_nonstream_audio_decoder_get_duration_db_key(dec, key);
+	return gst_nonstream_audio_duration_db_lookup(dec->duration_db, key, subsong, duration);
+}
+
+
+/**
+ * gst_nonstream_audio_decoder_store_duration:
+ * @dec: Decoder instance
+ * @subsong: Index of the subsong whose duration shall be stored
+ * @duration: Duration of the subsong
+ *
+ * Stores the duration of a subsong of the current song in the duration
+ * database, replacing any previously stored value. Subclasses call this
+ * after measuring a duration. Invalid durations are ignored, as are calls
+ * made while no duration database is in use.
+ *
+ * This function may only be called from within @load_from_buffer and
+ * vfuncs which are called after loading. It must be called with the
+ * decoder mutex lock held.
+ */
+void gst_nonstream_audio_decoder_store_duration(GstNonstreamAudioDecoder *dec, guint subsong, GstClockTime duration)
+{
+	guint8 key[GST_NONSTREAM_AUDIO_DURATION_DB_KEY_SIZE];
+
+	if (!GST_CLOCK_TIME_IS_VALID(duration))
+		return;
+
+	if (!gst_nonstream_audio_decoder_open_duration_db(dec))
+		return;
+
+	gst_nonstream_audio_decoder_get_duration_db_key(dec, key);
+	if (!gst_nonstream_audio_duration_db_store(dec->duration_db, key, subsong, duration))
+		GST_WARNING_OBJECT(dec, "could not store duration of subsong %u", subsong);
+}
+
+
+/**
+ * gst_nonstream_audio_decoder_set_speed_factor:
+ * @dec: Decoder instance
+ * @speed_factor: Factor by which the subclass speeds up playback
+ *
+ * Informs the base class that the subclass plays the song faster or slower
+ * than normal on its own accord (for example because of a tempo property),
+ * independently of seek rates. The base class then sends a new segment with
+ * an updated applied_rate before the next @decode call, and does not store
+ * the played duration in the duration database.
+ *
+ * This function must be called with the decoder mutex lock held.
+ */
+void gst_nonstream_audio_decoder_set_speed_factor(GstNonstreamAudioDecoder *dec, gdouble speed_factor)
+{
+	g_return_if_fail(GST_IS_NONSTREAM_AUDIO_DECODER(dec));
+	g_return_if_fail(speed_factor > 0.0);
+
+	if (speed_factor == dec->speed_factor)
+		return;
+
+	dec->speed_factor = speed_factor;
+	dec->playback_from_start = FALSE;
+	if (dec->loaded_mode)
+		dec->segment_update_pending = TRUE;
+}
+
+
+/**
+ * gst_nonstream_audio_decoder_subsong_durations_changed:
+ * @dec: Decoder instance
+ *
+ * Informs the base class that @get_subsong_duration now returns
+ * different values than before, typically because the subclass determines
+ * the durations in the background after loading. Before the next @decode
+ * call, the base class then updates the current duration (posting a
+ * duration-changed message if it differs) and sends an updated TOC
+ * downstream.
+ *
+ * This function can be called from any thread. It must be called with the
+ * decoder mutex lock held.
+ */
+void gst_nonstream_audio_decoder_subsong_durations_changed(GstNonstreamAudioDecoder *dec)
+{
+	g_return_if_fail(GST_IS_NONSTREAM_AUDIO_DECODER(dec));
+	dec->subsong_durations_changed = TRUE;
+}
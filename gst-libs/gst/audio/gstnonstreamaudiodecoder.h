@@ -25,6 +25,9 @@
 #include <gst/base/gstadapter.h>
 #include <gst/audio/audio.h>
 
+#include "gstnonstreamaudioloudness.h"
+#include "gstnonstreamaudiodurationdb.h"
+
 
 G_BEGIN_DECLS
 
@@ -85,6 +88,22 @@ typedef enum
  * The name of the template for the source pad.
  */
 #define GST_NONSTREAM_AUDIO_DECODER_SRC_NAME     "src"
+/**
+ * GST_NONSTREAM_AUDIO_DECODER_STEM_SRC_NAME:
+ *
+ * The name of the template for the stem source request pads. Subclasses which
+ * implement @decode_stems add a request pad template with this name. The number
+ * in the pad name is the index of the stem the pad carries.
+ */
+#define GST_NONSTREAM_AUDIO_DECODER_STEM_SRC_NAME "src_%u"
+
+/**
+ * GST_NONSTREAM_AUDIO_DECODER_MODULE_STATE_QUERY:
+ *
+ * The name of the structure in custom queries asking for the playback state
+ * of the engine. See the #GstNonstreamAudioDecoder description for details.
+ */
+#define GST_NONSTREAM_AUDIO_DECODER_MODULE_STATE_QUERY "nonstream-audio-module-state"
 
 /**
  * GST_NONSTREAM_AUDIO_DECODER_SINK_PAD:
@@ -162,9 +181,51 @@ struct _GstNonstreamAudioDecoder
 	guint64 cur_pos_in_samples, num_decoded_samples;
 	GstSegment cur_segment;
 	gboolean discont;
+	/* TRUE if playback of the current (sub)song started at its beginning */
+	gboolean playback_from_start;
+	/* playback_rate is the rate of the last seek, applied by the subclass;
+	 * speed_factor is a speedup the subclass applies on its own. Both end
+	 * up in the segment's applied_rate. */
+	gdouble playback_rate, speed_factor;
+	gboolean segment_update_pending;
+
+	/* QoS states */
+	gboolean qos_enabled;
+	/* 0 = full quality as configured; each increment means cheaper rendering */
+	guint quality_degradation;
+	gdouble qos_proportion;
+	GstClockTimeDiff qos_jitter;
+	guint qos_num_late_events, qos_num_healthy_events;
+	gint64 qos_last_change_time;
+
+	/* analysis */
+	gboolean analysis_meta_enabled;
+	gboolean loudness_analysis_enabled;
+	GstNonstreamAudioLoudness *loudness;
+	/* TRUE if the loudness analysis covers the (sub)song from its beginning */
+	gboolean loudness_from_start;
 
 	/* metadata */
 	GstToc *toc;
+	/* set by subclasses which determine durations after loading;
+	 * the output task then updates the duration and the TOC */
+	gboolean subsong_durations_changed;
+
+	/* stem source pads; the array contains GstNonstreamAudioDecoderStem
+	 * entries and is protected by the object lock */
+	GArray *stems;
+	/* seek events arrive once per source pad; only the first one is handled */
+	guint32 last_seek_seqnum;
+	gboolean last_seek_seqnum_valid;
+
+	/* duration database; the content digest identifies the loaded song data,
+	 * and is combined with the element type and subclass settings to form the
+	 * database key */
+	gchar *duration_db_path;
+	GstNonstreamAudioDurationDb *duration_db;
+	gboolean duration_db_open_failed;
+	guint8 content_digest[GST_NONSTREAM_AUDIO_DURATION_DB_KEY_SIZE];
+	gboolean content_digest_valid;
 
 	/* allocation */
 	GstAllocator *allocator;
@@ -198,7 +259,12 @@ struct _GstNonstreamAudioDecoder
  *                              playback position (but isn't required to). In case it chooses a different starting
  *                              position, the function must pass this position to *initial_position.
  *                              The subclass does not have to unref the input buffer; the base class does that
- *                              already.
+ *                              already. Subclasses which no longer need the data once parsing is done can
+ *                              drop the buffer's memory with gst_buffer_remove_all_memory() to reduce the
+ *                              peak memory usage (if gst_buffer_is_writable() returns TRUE).
+ *                              The buffer usually consists of multiple memories. Mapping the whole
+ *                              buffer merges them into one copy; subclasses which can read the data
+ *                              in pieces can map the memories one by one instead.
  * @load_from_custom:           Required if loads_from_sinkpad is set to FALSE.
  *                              Loads the media in a way defined by the custom sink. Data is not supplied;
  *                              the derived class has to handle this on its own. Otherwise, this function is
@@ -216,7 +282,11 @@ struct _GstNonstreamAudioDecoder
  *                              position. In case it chooses a different starting position, the function must pass
  *                              this position to *initial_position.
  *                              This function switches the subsong mode to GST_NONSTREM_AUDIO_SUBSONG_MODE_SINGLE
- *                              automatically.
+ *                              automatically; after it succeeds, the base class switches its subsong mode
+ *                              as well. In the GST_NONSTREM_AUDIO_SUBSONG_MODE_ALL subsong mode, subclasses
+ *                              call gst_nonstream_audio_decoder_handle_subsong_change() when playback moves
+ *                              on to the next subsong, and @get_current_subsong must report the subsong
+ *                              a seek moved to.
  *                              If this function is implemented by the subclass, @get_current_subsong and
  *                              @get_num_subsongs should be implemented as well.
  * @get_current_subsong:        Optional.
@@ -239,7 +309,9 @@ struct _GstNonstreamAudioDecoder
  *                              Returns the duration of a subsong. Returns GST_CLOCK_TIME_NONE if duration is unknown.
  * @get_subsong_tags:           Optional.
  *                              Returns tags for a subsong, or NULL if there are no tags.
- *                              Returned tags will be unref'd.
+ *                              Returned tags will be unref'd. The subclass can return a new
+ *                              reference to a tag list it keeps; the base class makes the
+ *                              tag list writable before modifying it.
  * @set_subsong_mode:           Optional.
  *                              Sets the current subsong mode. Since this might influence the current playback position,
  *                              this function must set the initial_position integer argument to a defined value.
@@ -286,6 +358,61 @@ struct _GstNonstreamAudioDecoder
  *                              Proposes buffer allocation parameters for upstream elements.
  *                              Subclasses should chain up to the parent implementation to
  *                              invoke the default handler.
+ * @set_quality_degradation:    Optional.
+ *                              Called when QoS events from downstream indicate that the decoder
+ *                              cannot keep up (or has recovered). A degradation of 0 means full
+ *                              quality, as configured by the subclass' properties. Each higher value
+ *                              must make rendering cheaper (for example by using a simpler resampler
+ *                              or disabling effects). Property values must not be modified; the
+ *                              degradation is applied on top of them. Returns FALSE if the subclass
+ *                              cannot go that far down; the base class then stays at the current
+ *                              degradation. Returning to a lower degradation must always succeed.
+ *                              The current degradation is stored in the quality_degradation field,
+ *                              which subclasses should take into account when they reapply their
+ *                              render settings (for example when a property is changed).
+ * @get_module_position:        Optional.
+ *                              Retrieves the current position in tracker-style terms: the current
+ *                              order, the pattern this order refers to, and the row within that
+ *                              pattern. Values that are not known must be set to -1. Only used if
+ *                              the analysis-meta property is enabled, in which case it is called
+ *                              right before each @decode call. Returns FALSE if the position could
+ *                              not be retrieved.
+ * @get_module_state:           Optional.
+ *                              Adds engine-specific playback state fields (such as "speed", "tempo",
+ *                              and "channel-vu") to the structure of a module state query. Called with
+ *                              the decoder lock held, so the values are those of the most recently
+ *                              rendered buffer. Returns FALSE if no state could be retrieved.
+ * @set_playback_rate:          Optional.
+ *                              Changes the playback speed by the given factor, for example by scaling the
+ *                              song's tempo. Called when a seek event with a rate other than the current
+ *                              one arrives, including instant rate change seeks. For regular seeks, this
+ *                              is called after @seek succeeded, and not at all if it failed. If set, the
+ *                              base class does not forward the rate downstream, and sets the segment's
+ *                              applied_rate instead. Returns FALSE if the rate is not supported, in which
+ *                              case the rate is handled downstream.
+ * @get_num_stems:              Optional.
+ *                              Returns the number of stems (separately renderable channels or voice
+ *                              groups) of the loaded media. Stem source pads with higher indices
+ *                              cannot be requested once the media is loaded.
+ * @decode_stems:               Optional.
+ *                              Renders the stems with the given indices into the buffers array.
+ *                              Called right after each successful @decode call if stem source pads
+ *                              are present. The subclass allocates the buffers with
+ *                              gst_nonstream_audio_decoder_allocate_output_buffer(). Each one must
+ *                              contain exactly num_samples samples in the current output format,
+ *                              covering the same span of the song as the buffer @decode just produced.
+ *                              Ideally, all stems added together give the regular output. Stem indices
+ *                              the subclass does not know must be filled with silence. Timestamps
+ *                              and offsets are set by the base class. Returns FALSE if rendering
+ *                              failed; buffers that were not allocated are then replaced with silence.
+ *                              If this is set, a pad template named
+ *                              GST_NONSTREAM_AUDIO_DECODER_STEM_SRC_NAME must be added as well.
+ * @get_duration_settings_hash: Optional.
+ *                              Returns a hash of the subclass' current settings which change
+ *                              subsong durations (such as a fade length or a playlist). It becomes
+ *                              part of the duration database key, so durations measured with
+ *                              different settings are kept apart. Not needed if no setting of the
+ *                              subclass affects durations.
  *
  * Subclasses can override any of the available optional virtual methods or not, as
  * needed. At minimum, @load_from_buffer (or @load_from_custom), @get_supported_output_modes,
@@ -347,8 +474,21 @@ struct _GstNonstreamAudioDecoderClass
 	gboolean (*decide_allocation)(GstNonstreamAudioDecoder *dec, GstQuery *query);
 	gboolean (*propose_allocation)(GstNonstreamAudioDecoder *dec, GstQuery * query);
 
+	gboolean (*set_quality_degradation)(GstNonstreamAudioDecoder *dec, guint degradation);
+
+	gboolean (*get_module_position)(GstNonstreamAudioDecoder *dec, gint *order, gint *pattern, gint *row);
+
+	gboolean (*get_module_state)(GstNonstreamAudioDecoder *dec, GstStructure *state);
+
+	gboolean (*set_playback_rate)(GstNonstreamAudioDecoder *dec, gdouble rate);
+
+	guint    (*get_num_stems)(GstNonstreamAudioDecoder *dec);
+	gboolean (*decode_stems)(GstNonstreamAudioDecoder *dec, guint const *stem_indices, GstBuffer **buffers, guint num_stems, guint num_samples);
+
+	guint64  (*get_duration_settings_hash)(GstNonstreamAudioDecoder *dec);
+
 	/*< private >*/
-	gpointer _gst_reserved[GST_PADDING_LARGE];
+	gpointer _gst_reserved[GST_PADDING_LARGE - 7];
 };
 
 
@@ -356,6 +496,7 @@ GType gst_nonstream_audio_decoder_get_type(void);
 
 
 void gst_nonstream_audio_decoder_handle_loop(GstNonstreamAudioDecoder *dec, GstClockTime new_position);
+void gst_nonstream_audio_decoder_handle_subsong_change(GstNonstreamAudioDecoder *dec, guint new_subsong);
 
 gboolean gst_nonstream_audio_decoder_set_output_format(GstNonstreamAudioDecoder *dec, GstAudioInfo const *audio_info);
 gboolean gst_nonstream_audio_decoder_set_output_format_simple(GstNonstreamAudioDecoder *dec, guint sample_rate, GstAudioFormat sample_format, guint num_channels);
@@ -364,6 +505,13 @@ void gst_nonstream_audio_decoder_get_downstream_info(GstNonstreamAudioDecoder *d
 
 GstBuffer* gst_nonstream_audio_decoder_allocate_output_buffer(GstNonstreamAudioDecoder *dec, gsize size);
 
+gboolean gst_nonstream_audio_decoder_get_stored_duration(GstNonstreamAudioDecoder *dec, guint subsong, GstClockTime *duration);
+void gst_nonstream_audio_decoder_store_duration(GstNonstreamAudioDecoder *dec, guint subsong, GstClockTime duration);
+
+void gst_nonstream_audio_decoder_subsong_durations_changed(GstNonstreamAudioDecoder *dec);
+
+void gst_nonstream_audio_decoder_set_speed_factor(GstNonstreamAudioDecoder *dec, gdouble speed_factor);
+
 
 G_END_DECLS
 
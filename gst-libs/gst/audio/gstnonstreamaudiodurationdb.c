@@ -0,0 +1,497 @@
+/*
+ *   Disk-persistent subsong duration database for non-streaming audio decoders
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <gst/gst.h>
+
+#include "gstnonstreamaudiodurationdb.h"
+
+#ifdef HAVE_SYS_MMAN_H
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#endif
+
+
+GST_DEBUG_CATEGORY_EXTERN(nonstream_audiodecoder_debug);
+#define GST_CAT_DEFAULT nonstream_audiodecoder_debug
+
+
+/* File layout: a header, followed by a power-of-two number of fixed-size
+ * slots, which form an open addressing hash table with linear probing.
+ * Values are stored in host byte order; the byte order mark in the header
+ * makes sure a file written on a host with a different byte order is
+ * rejected instead of misinterpreted. */
+
+#define DURATION_DB_MAGIC "GSTNADB1"
+#define DURATION_DB_BYTE_ORDER_MARK 0x01020304u
+#define DURATION_DB_INITIAL_NUM_SLOTS 4096
+/* grow the table once it is more than 3/4 full */
+#define DURATION_DB_MAX_LOAD_NUMERATOR 3
+#define DURATION_DB_MAX_LOAD_DENOMINATOR 4
+
+
+typedef struct
+{
+	gchar magic[8];
+	guint32 byte_order_mark;
+	guint32 num_slots;
+	guint32 num_entries;
+	guint32 reserved[3];
+}
+DurationDbHeader;
+
+
+typedef struct
+{
+	guint8 key[GST_NONSTREAM_AUDIO_DURATION_DB_KEY_SIZE];
+	guint32 subsong;
+	guint32 used;
+	guint64 duration;
+}
+DurationDbSlot;
+
+
+G_STATIC_ASSERT(sizeof(DurationDbHeader) == 32);
+G_STATIC_ASSERT(sizeof(DurationDbSlot) == 32);
+
+
+struct _GstNonstreamAudioDurationDb
+{
+	gchar *filename;
+	gint fd;
+	guint8 *mapping;
+	gsize mapping_size;
+};
+
+
+#ifdef HAVE_SYS_MMAN_H
+
+
+/* fcntl() record locks are per-process, so they do not serialize
+ * accesses from multiple decoder instances within the same process;
+ * this mutex does */
+static GMutex duration_db_mutex;
+
+
+static gsize duration_db_file_size(guint32 num_slots)
+{
+	return sizeof(DurationDbHeader) + (gsize)num_slots * sizeof(DurationDbSlot);
+}
+
+
+static DurationDbHeader* duration_db_get_header(GstNonstreamAudioDurationDb *db)
+{
+	return (DurationDbHeader *)(db->mapping);
+}
+
+
+static DurationDbSlot* duration_db_get_slots(GstNonstreamAudioDurationDb *db)
+{
+	return (DurationDbSlot *)(db->mapping + sizeof(DurationDbHeader));
+}
+
+
+static guint32 duration_db_hash(guint8 const *key, guint subsong)
+{
+	/* the key is an MD5 digest, so its bits are already well distributed */
+	guint64 k0, k1;
+	memcpy(&k0, key, sizeof(k0));
+	memcpy(&k1, key + sizeof(k0), sizeof(k1));
+	k0 ^= k1 ^ ((guint64)subsong * G_GUINT64_CONSTANT(0x9E3779B97F4A7C15));
+	return (guint32)(k0 ^ (k0 >> 32));
+}
+
+
+static gboolean duration_db_lock(GstNonstreamAudioDurationDb *db, gboolean exclusive)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = exclusive ? F_WRLCK : F_RDLCK;
+	fl.l_whence = SEEK_SET;
+
+	while (fcntl(db->fd, F_SETLKW, &fl) == -1)
+	{
+		if (errno != EINTR)
+		{
+			GST_WARNING("could not lock duration database \"%s\": %s", db->filename, g_strerror(errno));
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+
+static void duration_db_unlock(GstNonstreamAudioDurationDb *db)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_UNLCK;
+	fl.l_whence = SEEK_SET;
+	fcntl(db->fd, F_SETLK, &fl);
+}
+
+
+static gboolean duration_db_map(GstNonstreamAudioDurationDb *db, gsize size)
+{
+	gpointer mapping;
+
+	if (db->mapping != NULL)
+	{
+		munmap(db->mapping, db->mapping_size);
+		db->mapping = NULL;
+		db->mapping_size = 0;
+	}
+
+	mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, db->fd, 0);
+	if (mapping == MAP_FAILED)
+	{
+		GST_WARNING("could not map duration database \"%s\": %s", db->filename, g_strerror(errno));
+		return FALSE;
+	}
+
+	db->mapping = mapping;
+	db->mapping_size = size;
+
+	return TRUE;
+}
+
+
+/* Must be called with the file lock held. Remaps the file if another
+ * process (or instance) resized it since it was last mapped. */
+static gboolean duration_db_sync_mapping(GstNonstreamAudioDurationDb *db)
+{
+	struct stat st;
+
+	if (fstat(db->fd, &st) != 0)
+		return FALSE;
+
+	if ((gsize)(st.st_size) == db->mapping_size)
+		return TRUE;
+
+	if ((gsize)(st.st_size) < sizeof(DurationDbHeader))
+		return FALSE;
+
+	if (!duration_db_map(db, st.st_size))
+		return FALSE;
+
+	return duration_db_file_size(duration_db_get_header(db)->num_slots) == db->mapping_size;
+}
+
+
+static DurationDbSlot* duration_db_find_slot(DurationDbSlot *slots, guint32 num_slots, guint8 const *key, guint subsong)
+{
+	/* Returns the slot containing the key, or the empty slot where
+	 * it would have to be inserted. The table is never allowed to fill
+	 * up, so NULL is only returned if the file is damaged. */
+
+	guint32 mask = num_slots - 1;
+	guint32 index = duration_db_hash(key, subsong) & mask;
+	guint32 num_probes;
+
+	for (num_probes = 0; num_probes < num_slots; ++num_probes)
+	{
+		DurationDbSlot *slot = &(slots[index]);
+		if (!(slot->used) || ((slot->subsong == subsong) && (memcmp(slot->key, key, GST_NONSTREAM_AUDIO_DURATION_DB_KEY_SIZE) == 0)))
+			return slot;
+		index = (index + 1) & mask;
+	}
+
+	return NULL;
+}
+
+
+static gboolean duration_db_grow(GstNonstreamAudioDurationDb *db)
+{
+	/* must be called with the exclusive file lock held */
+
+	DurationDbHeader *header = duration_db_get_header(db);
+	guint32 old_num_slots = header->num_slots;
+	guint32 new_num_slots = old_num_slots * 2;
+	DurationDbSlot *old_slots, *new_slots;
+	guint32 i;
+
+	GST_DEBUG("growing duration database \"%s\" from %" G_GUINT32_FORMAT " to %" G_GUINT32_FORMAT " slots", db->filename, old_num_slots, new_num_slots);
+
+	/* the old contents have to be rehashed into the new table,
+	 * which occupies the same region of the file */
+	old_slots = g_malloc(old_num_slots * sizeof(DurationDbSlot));
+	memcpy(old_slots, duration_db_get_slots(db), old_num_slots * sizeof(DurationDbSlot));
+
+	if (ftruncate(db->fd, duration_db_file_size(new_num_slots)) != 0)
+	{
+		GST_WARNING("could not grow duration database \"%s\": %s", db->filename, g_strerror(errno));
+		g_free(old_slots);
+		return FALSE;
+	}
+
+	if (!duration_db_map(db, duration_db_file_size(new_num_slots)))
+	{
+		/* restore the old size; the contents are still intact, and
+		 * the next access maps the file again */
+		if (ftruncate(db->fd, duration_db_file_size(old_num_slots)) != 0)
+			GST_WARNING("could not restore size of duration database \"%s\": %s", db->filename, g_strerror(errno));
+		g_free(old_slots);
+		return FALSE;
+	}
+
+	header = duration_db_get_header(db);
+	new_slots = duration_db_get_slots(db);
+	memset(new_slots, 0, new_num_slots * sizeof(DurationDbSlot));
+
+	for (i = 0; i < old_num_slots; ++i)
+	{
+		if (old_slots[i].used)
+			*duration_db_find_slot(new_slots, new_num_slots, old_slots[i].key, old_slots[i].subsong) = old_slots[i];
+	}
+
+	header->num_slots = new_num_slots;
+
+	g_free(old_slots);
+
+	return TRUE;
+}
+
+
+GstNonstreamAudioDurationDb* gst_nonstream_audio_duration_db_open(gchar const *filename)
+{
+	GstNonstreamAudioDurationDb *db;
+	DurationDbHeader *header;
+	struct stat st;
+
+	g_assert(filename != NULL);
+
+	db = g_slice_new0(GstNonstreamAudioDurationDb);
+	db->filename = g_strdup(filename);
+	db->fd = g_open(filename, O_RDWR | O_CREAT, 0644);
+	if (db->fd < 0)
+	{
+		GST_WARNING("could not open duration database \"%s\": %s", filename, g_strerror(errno));
+		goto error;
+	}
+
+	g_mutex_lock(&duration_db_mutex);
+
+	if (!duration_db_lock(db, TRUE))
+		goto error_unlock_mutex;
+
+	if (fstat(db->fd, &st) != 0)
+		goto error_unlock;
+
+	if (st.st_size == 0)
+	{
+		/* newly created file; initialize it */
+		GST_DEBUG("initializing new duration database \"%s\"", filename);
+
+		if ((ftruncate(db->fd, duration_db_file_size(DURATION_DB_INITIAL_NUM_SLOTS)) != 0) || !duration_db_map(db, duration_db_file_size(DURATION_DB_INITIAL_NUM_SLOTS)))
+			goto error_unlock;
+
+		header = duration_db_get_header(db);
+		memcpy(header->magic, DURATION_DB_MAGIC, sizeof(header->magic));
+		header->byte_order_mark = DURATION_DB_BYTE_ORDER_MARK;
+		header->num_slots = DURATION_DB_INITIAL_NUM_SLOTS;
+		header->num_entries = 0;
+	}
+	else
+	{
+		/* Existing file. Never touch it unless it really is a duration
+		 * database, since the path might point to an unrelated file. */
+		if (((gsize)(st.st_size) < sizeof(DurationDbHeader)) || !duration_db_map(db, st.st_size))
+			goto error_invalid;
+
+		header = duration_db_get_header(db);
+		if ((memcmp(header->magic, DURATION_DB_MAGIC, sizeof(header->magic)) != 0)
+		 || (header->byte_order_mark != DURATION_DB_BYTE_ORDER_MARK)
+		 || (header->num_slots == 0)
+		 || ((header->num_slots & (header->num_slots - 1)) != 0)
+		 || (duration_db_file_size(header->num_slots) != db->mapping_size))
+			goto error_invalid;
+	}
+
+	duration_db_unlock(db);
+	g_mutex_unlock(&duration_db_mutex);
+
+	GST_DEBUG("opened duration database \"%s\" with %" G_GUINT32_FORMAT " entries", filename, header->num_entries);
+
+	return db;
+
+error_invalid:
+	GST_WARNING("\"%s\" is not a valid duration database", filename);
+error_unlock:
+	duration_db_unlock(db);
+error_unlock_mutex:
+	g_mutex_unlock(&duration_db_mutex);
+error:
+	gst_nonstream_audio_duration_db_close(db);
+	return NULL;
+}
+
+
+void gst_nonstream_audio_duration_db_close(GstNonstreamAudioDurationDb *db)
+{
+	if (db == NULL)
+		return;
+
+	/* Closing any descriptor of a file releases all of the process' fcntl()
+	 * locks on that file, including those held by other instances. Hold the
+	 * mutex, so this cannot happen while another instance accesses the file. */
+	g_mutex_lock(&duration_db_mutex);
+	if (db->mapping != NULL)
+		munmap(db->mapping, db->mapping_size);
+	if (db->fd >= 0)
+		close(db->fd);
+	g_mutex_unlock(&duration_db_mutex);
+
+	g_free(db->filename);
+	g_slice_free(GstNonstreamAudioDurationDb, db);
+}
+
+
+gboolean gst_nonstream_audio_duration_db_lookup(GstNonstreamAudioDurationDb *db, guint8 const *key, guint subsong, GstClockTime *duration)
+{
+	DurationDbSlot *slot;
+	gboolean found = FALSE;
+
+	g_assert(db != NULL);
+	g_assert(key != NULL);
+	g_assert(duration != NULL);
+
+	g_mutex_lock(&duration_db_mutex);
+
+	if (!duration_db_lock(db, FALSE))
+		goto finish;
+
+	if (duration_db_sync_mapping(db))
+	{
+		slot = duration_db_find_slot(duration_db_get_slots(db), duration_db_get_header(db)->num_slots, key, subsong);
+		if ((slot != NULL) && slot->used)
+		{
+			*duration = slot->duration;
+			found = TRUE;
+		}
+	}
+
+	duration_db_unlock(db);
+
+finish:
+	g_mutex_unlock(&duration_db_mutex);
+
+	return found;
+}
+
+
+gboolean gst_nonstream_audio_duration_db_store(GstNonstreamAudioDurationDb *db, guint8 const *key, guint subsong, GstClockTime duration)
+{
+	DurationDbHeader *header;
+	DurationDbSlot *slot;
+	gboolean ret = FALSE;
+
+	g_assert(db != NULL);
+	g_assert(key != NULL);
+	g_return_val_if_fail(GST_CLOCK_TIME_IS_VALID(duration), FALSE);
+
+	g_mutex_lock(&duration_db_mutex);
+
+	if (!duration_db_lock(db, TRUE))
+		goto finish;
+
+	if (!duration_db_sync_mapping(db))
+		goto unlock;
+
+	header = duration_db_get_header(db);
+	slot = duration_db_find_slot(duration_db_get_slots(db), header->num_slots, key, subsong);
+	if (slot == NULL)
+		goto unlock;
+
+	if (slot->used)
+	{
+		/* avoid dirtying the page if nothing changes */
+		if (slot->duration != duration)
+			slot->duration = duration;
+		ret = TRUE;
+		goto unlock;
+	}
+
+	if ((guint64)(header->num_entries + 1) * DURATION_DB_MAX_LOAD_DENOMINATOR > (guint64)(header->num_slots) * DURATION_DB_MAX_LOAD_NUMERATOR)
+	{
+		if (!duration_db_grow(db))
+			goto unlock;
+
+		header = duration_db_get_header(db);
+		slot = duration_db_find_slot(duration_db_get_slots(db), header->num_slots, key, subsong);
+		if (slot == NULL)
+			goto unlock;
+	}
+
+	memcpy(slot->key, key, GST_NONSTREAM_AUDIO_DURATION_DB_KEY_SIZE);
+	slot->subsong = subsong;
+	slot->duration = duration;
+	slot->used = 1;
+	header->num_entries++;
+
+	ret = TRUE;
+
+unlock:
+	duration_db_unlock(db);
+
+finish:
+	g_mutex_unlock(&duration_db_mutex);
+
+	return ret;
+}
+
+
+#else /* HAVE_SYS_MMAN_H */
+
+
+GstNonstreamAudioDurationDb* gst_nonstream_audio_duration_db_open(gchar const *filename)
+{
+	GST_WARNING("cannot open duration database \"%s\": memory-mapped files are not supported on this platform", filename);
+	return NULL;
+}
+
+
+void gst_nonstream_audio_duration_db_close(G_GNUC_UNUSED GstNonstreamAudioDurationDb *db)
+{
+}
+
+
+gboolean gst_nonstream_audio_duration_db_lookup(G_GNUC_UNUSED GstNonstreamAudioDurationDb *db, G_GNUC_UNUSED guint8 const *key, G_GNUC_UNUSED guint subsong, G_GNUC_UNUSED GstClockTime *duration)
+{
+	return FALSE;
+}
+
+
+gboolean gst_nonstream_audio_duration_db_store(G_GNUC_UNUSED GstNonstreamAudioDurationDb *db, G_GNUC_UNUSED guint8 const *key, G_GNUC_UNUSED guint subsong, G_GNUC_UNUSED GstClockTime duration)
+{
+	return FALSE;
+}
+
+
+#endif /* HAVE_SYS_MMAN_H */
@@ -0,0 +1,54 @@
+/*
+ *   Disk-persistent subsong duration database for non-streaming audio decoders
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef _GST_NONSTREAM_AUDIO_DURATION_DB_H_
+#define _GST_NONSTREAM_AUDIO_DURATION_DB_H_
+
+#include <gst/gst.h>
+
+
+G_BEGIN_DECLS
+
+
+/**
+ * GstNonstreamAudioDurationDb:
+ *
+ * Opaque handle to a duration database. The database is a hash table stored in a
+ * memory-mapped file, and maps a content key (the MD5 digest of the song data) plus
+ * a subsong index to a duration. The file can be shared by several decoder instances
+ * and processes at the same time; access is serialized with file locks.
+ */
+typedef struct _GstNonstreamAudioDurationDb GstNonstreamAudioDurationDb;
+
+
+/* Size of the content keys, in bytes (an MD5 digest) */
+#define GST_NONSTREAM_AUDIO_DURATION_DB_KEY_SIZE 16
+
+
+GstNonstreamAudioDurationDb* gst_nonstream_audio_duration_db_open(gchar const *filename);
+void gst_nonstream_audio_duration_db_close(GstNonstreamAudioDurationDb *db);
+
+gboolean gst_nonstream_audio_duration_db_lookup(GstNonstreamAudioDurationDb *db, guint8 const *key, guint subsong, GstClockTime *duration);
+gboolean gst_nonstream_audio_duration_db_store(GstNonstreamAudioDurationDb *db, guint8 const *key, guint subsong, GstClockTime duration);
+
+
+G_END_DECLS
+
+
+#endif /* _GST_NONSTREAM_AUDIO_DURATION_DB_H_ */
@@ -0,0 +1,678 @@
+/*
+ *   EBU R128 loudness analysis for non-streaming audio decoders
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gst/gst.h>
+#include <gst/audio/audio.h>
+
+#include "gstnonstreamaudioloudness.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+/* The measurement works with 100 ms subblocks. Four consecutive subblocks
+ * form a 400 ms gating block (giving the 75% overlap BS.1770 requires),
+ * and 30 consecutive subblocks form a 3 s short-term window, which is
+ * what the loudness range measurement (EBU Tech 3342) is based on. */
+#define NUM_SUBBLOCKS_PER_GATING_BLOCK 4
+#define NUM_SUBBLOCKS_PER_SHORT_TERM_WINDOW 30
+
+#define ABSOLUTE_GATE -70.0
+#define INTEGRATED_RELATIVE_GATE -10.0
+#define RANGE_RELATIVE_GATE -20.0
+#define RANGE_LOWER_PERCENTILE 0.10
+#define RANGE_UPPER_PERCENTILE 0.95
+
+/* True peak is measured by upsampling by this factor with a
+ * polyphase windowed-sinc interpolator, as BS.1770 suggests */
+#define TRUE_PEAK_OVERSAMPLING 4
+#define TRUE_PEAK_TAPS_PER_PHASE 12
+
+#define MAX_CHANNELS 64
+
+
+typedef struct
+{
+	gdouble b0, b1, b2, a1, a2;
+}
+KWeightingStage;
+
+
+struct _GstNonstreamAudioLoudness
+{
+	GstAudioFormat format;
+	guint sample_rate, num_channels;
+	gdouble channel_weights[MAX_CHANNELS];
+
+	/* K-weighting filter: high shelf followed by a high pass.
+	 * The states are stored as [state_index * num_channels + channel],
+	 * with state indices 0,1 = shelf z1,z2, and 2,3 = high pass z1,z2. */
+	KWeightingStage shelf, highpass;
+	gdouble *filter_states;
+
+	/* Subblock accumulation */
+	guint subblock_length, subblock_position;
+	gdouble *subblock_sums;
+	gdouble recent_subblocks[NUM_SUBBLOCKS_PER_SHORT_TERM_WINDOW];
+	guint64 num_subblocks;
+
+	GArray *gating_block_energies;
+	GArray *short_term_energies;
+
+	/* True peak interpolator; coefficients are stored as [tap][phase],
+	 * and the history uses a mirrored layout (see update_true_peak()) */
+	gfloat interpolator[TRUE_PEAK_TAPS_PER_PHASE][TRUE_PEAK_OVERSAMPLING];
+	gfloat *interpolator_history;
+	guint interpolator_position;
+	gfloat true_peak;
+
+	/* Samples converted to float, one subblock at most */
+	gfloat *scratch;
+};
+
+
+static void init_k_weighting(GstNonstreamAudioLoudness *loudness);
+static void init_interpolator(GstNonstreamAudioLoudness *loudness);
+static void k_weight_and_accumulate(GstNonstreamAudioLoudness *loudness, gfloat const *samples, guint num_frames);
+static void update_true_peak(GstNonstreamAudioLoudness *loudness, gfloat const *samples, guint num_frames);
+static void finish_subblock(GstNonstreamAudioLoudness *loudness);
+
+static gdouble energy_to_loudness(gdouble energy);
+static gdouble loudness_to_energy(gdouble loudness);
+static int compare_doubles(void const *first, void const *second);
+
+
+
+GstNonstreamAudioLoudness* gst_nonstream_audio_loudness_new(GstAudioInfo const *info)
+{
+	GstNonstreamAudioLoudness *loudness;
+	guint ch, num_channels;
+
+	g_return_val_if_fail(info != NULL, NULL);
+
+	num_channels = GST_AUDIO_INFO_CHANNELS(info);
+
+	if ((num_channels == 0) || (num_channels > MAX_CHANNELS) || (GST_AUDIO_INFO_RATE(info) < 10))
+		return NULL;
+	if (GST_AUDIO_INFO_LAYOUT(info) != GST_AUDIO_LAYOUT_INTERLEAVED)
+		return NULL;
+	if ((GST_AUDIO_INFO_FORMAT(info) != GST_AUDIO_FORMAT_F32) && (GST_AUDIO_INFO_FORMAT(info) != GST_AUDIO_FORMAT_S16))
+		return NULL;
+
+	loudness = g_slice_new0(GstNonstreamAudioLoudness);
+
+	loudness->format = GST_AUDIO_INFO_FORMAT(info);
+	loudness->sample_rate = GST_AUDIO_INFO_RATE(info);
+	loudness->num_channels = num_channels;
+
+	/* BS.1770 channel weights: surround channels are weighted with +1.5 dB,
+	 * LFE channels are excluded, everything else is weighted with 0 dB */
+	for (ch = 0; ch < num_channels; ++ch)
+	{
+		gdouble weight = 1.0;
+
+		if (!GST_AUDIO_INFO_IS_UNPOSITIONED(info))
+		{
+			switch (GST_AUDIO_INFO_POSITION(info, ch))
+			{
+				case GST_AUDIO_CHANNEL_POSITION_LFE1:
+				case GST_AUDIO_CHANNEL_POSITION_LFE2:
+					weight = 0.0;
+					break;
+
+				case GST_AUDIO_CHANNEL_POSITION_SIDE_LEFT:
+				case GST_AUDIO_CHANNEL_POSITION_SIDE_RIGHT:
+				case GST_AUDIO_CHANNEL_POSITION_REAR_LEFT:
+				case GST_AUDIO_CHANNEL_POSITION_REAR_RIGHT:
+					weight = 1.41253754;
+					break;
+
+				default:
+					break;
+			}
+		}
+
+		loudness->channel_weights[ch] = weight;
+	}
+
+	loudness->subblock_length = MAX(loudness->sample_rate / 10, 1);
+
+	loudness->filter_states = g_new0(gdouble, num_channels * 4);
+	loudness->subblock_sums = g_new0(gdouble, num_channels);
+	loudness->interpolator_history = g_new0(gfloat, num_channels * TRUE_PEAK_TAPS_PER_PHASE * 2);
+	loudness->scratch = g_new(gfloat, loudness->subblock_length * num_channels);
+
+	loudness->gating_block_energies = g_array_new(FALSE, FALSE, sizeof(gdouble));
+	loudness->short_term_energies = g_array_new(FALSE, FALSE, sizeof(gdouble));
+
+	init_k_weighting(loudness);
+	init_interpolator(loudness);
+
+	gst_nonstream_audio_loudness_reset(loudness);
+
+	return loudness;
+}
+
+
+void gst_nonstream_audio_loudness_free(GstNonstreamAudioLoudness *loudness)
+{
+	if (loudness == NULL)
+		return;
+
+	g_free(loudness->filter_states);
+	g_free(loudness->subblock_sums);
+	g_free(loudness->interpolator_history);
+	g_free(loudness->scratch);
+	g_array_free(loudness->gating_block_energies, TRUE);
+	g_array_free(loudness->short_term_energies, TRUE);
+
+	g_slice_free(GstNonstreamAudioLoudness, loudness);
+}
+
+
+gboolean gst_nonstream_audio_loudness_is_compatible(GstNonstreamAudioLoudness const *loudness, GstAudioInfo const *info)
+{
+	g_return_val_if_fail(loudness != NULL, FALSE);
+	g_return_val_if_fail(info != NULL, FALSE);
+
+	return
+		(GST_AUDIO_INFO_FORMAT(info) == loudness->format) &&
+		(GST_AUDIO_INFO_LAYOUT(info) == GST_AUDIO_LAYOUT_INTERLEAVED) &&
+		(guint)(GST_AUDIO_INFO_RATE(info)) == loudness->sample_rate &&
+		(guint)(GST_AUDIO_INFO_CHANNELS(info)) == loudness->num_channels;
+}
+
+
+void gst_nonstream_audio_loudness_reset(GstNonstreamAudioLoudness *loudness)
+{
+	g_return_if_fail(loudness != NULL);
+
+	memset(loudness->filter_states, 0, sizeof(gdouble) * loudness->num_channels * 4);
+	memset(loudness->subblock_sums, 0, sizeof(gdouble) * loudness->num_channels);
+	memset(loudness->interpolator_history, 0, sizeof(gfloat) * loudness->num_channels * TRUE_PEAK_TAPS_PER_PHASE * 2);
+	memset(loudness->recent_subblocks, 0, sizeof(loudness->recent_subblocks));
+
+	loudness->subblock_position = 0;
+	loudness->num_subblocks = 0;
+	loudness->interpolator_position = 0;
+	loudness->true_peak = 0.0f;
+
+	g_array_set_size(loudness->gating_block_energies, 0);
+	g_array_set_size(loudness->short_term_energies, 0);
+}
+
+
+void gst_nonstream_audio_loudness_process(GstNonstreamAudioLoudness *loudness, GstBuffer *buffer, guint num_samples)
+{
+	GstMapInfo map;
+	guint num_channels, frame_size;
+
+	g_return_if_fail(loudness != NULL);
+	g_return_if_fail(GST_IS_BUFFER(buffer));
+
+	if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+		return;
+
+	num_channels = loudness->num_channels;
+	frame_size = num_channels * ((loudness->format == GST_AUDIO_FORMAT_F32) ? sizeof(gfloat) : sizeof(gint16));
+	num_samples = MIN(num_samples, map.size / frame_size);
+
+	/* Process the samples in chunks that end at subblock boundaries */
+	{
+		guint8 const *data = map.data;
+
+		while (num_samples > 0)
+		{
+			guint i;
+			guint num_chunk_samples = MIN(num_samples, loudness->subblock_length - loudness->subblock_position);
+			guint num_chunk_values = num_chunk_samples * num_channels;
+
+			if (loudness->format == GST_AUDIO_FORMAT_F32)
+			{
+				memcpy(loudness->scratch, data, num_chunk_values * sizeof(gfloat));
+			}
+			else
+			{
+				gint16 const *in = (gint16 const *)data;
+				for (i = 0; i < num_chunk_values; ++i)
+					loudness->scratch[i] = in[i] * (1.0f / 32768.0f);
+			}
+
+			k_weight_and_accumulate(loudness, loudness->scratch, num_chunk_samples);
+			update_true_peak(loudness, loudness->scratch, num_chunk_samples);
+
+			loudness->subblock_position += num_chunk_samples;
+			if (loudness->subblock_position == loudness->subblock_length)
+				finish_subblock(loudness);
+
+			data += num_chunk_samples * frame_size;
+			num_samples -= num_chunk_samples;
+		}
+	}
+
+	gst_buffer_unmap(buffer, &map);
+}
+
+
+gboolean gst_nonstream_audio_loudness_get_results(GstNonstreamAudioLoudness const *loudness, gdouble *integrated_loudness, gdouble *loudness_range, gdouble *true_peak)
+{
+	guint i, num_values;
+	gdouble sum, threshold;
+	gdouble const *energies;
+	gdouble absolute_threshold = loudness_to_energy(ABSOLUTE_GATE);
+
+	g_return_val_if_fail(loudness != NULL, FALSE);
+
+
+	/* Integrated loudness: gate blocks with the absolute threshold, then
+	 * again with a threshold relative to the loudness of the remaining blocks */
+
+	energies = (gdouble const *)(loudness->gating_block_energies->data);
+
+	sum = 0.0;
+	num_values = 0;
+	for (i = 0; i < loudness->gating_block_energies->len; ++i)
+	{
+		if (energies[i] > absolute_threshold)
+		{
+			sum += energies[i];
+			num_values++;
+		}
+	}
+
+	if (num_values == 0)
+		return FALSE; /* too short, or silent */
+
+	threshold = MAX(loudness_to_energy(energy_to_loudness(sum / num_values) + INTEGRATED_RELATIVE_GATE), absolute_threshold);
+
+	sum = 0.0;
+	num_values = 0;
+	for (i = 0; i < loudness->gating_block_energies->len; ++i)
+	{
+		if (energies[i] > threshold)
+		{
+			sum += energies[i];
+			num_values++;
+		}
+	}
+
+	if (integrated_loudness != NULL)
+		*integrated_loudness = (num_values > 0) ? energy_to_loudness(sum / num_values) : ABSOLUTE_GATE;
+
+
+	/* Loudness range: the same two-step gating, but with short-term
+	 * windows and a -20 LU relative gate; the range is the difference
+	 * between the 10th and 95th percentiles of the remaining values */
+
+	if (loudness_range != NULL)
+	{
+		gdouble *values;
+
+		energies = (gdouble const *)(loudness->short_term_energies->data);
+		values = g_new(gdouble, MAX(loudness->short_term_energies->len, 1));
+
+		sum = 0.0;
+		num_values = 0;
+		for (i = 0; i < loudness->short_term_energies->len; ++i)
+		{
+			if (energies[i] > absolute_threshold)
+			{
+				sum += energies[i];
+				num_values++;
+			}
+		}
+
+		*loudness_range = 0.0;
+
+		if (num_values > 0)
+		{
+			threshold = MAX(loudness_to_energy(energy_to_loudness(sum / num_values) + RANGE_RELATIVE_GATE), absolute_threshold);
+
+			num_values = 0;
+			for (i = 0; i < loudness->short_term_energies->len; ++i)
+			{
+				if (energies[i] > threshold)
+					values[num_values++] = energy_to_loudness(energies[i]);
+			}
+
+			if (num_values > 0)
+			{
+				qsort(values, num_values, sizeof(gdouble), compare_doubles);
+				*loudness_range =
+					values[(guint)((num_values - 1) * RANGE_UPPER_PERCENTILE + 0.5)] -
+					values[(guint)((num_values - 1) * RANGE_LOWER_PERCENTILE + 0.5)];
+			}
+		}
+
+		g_free(values);
+	}
+
+
+	if (true_peak != NULL)
+		*true_peak = loudness->true_peak;
+
+	return TRUE;
+}
+
+
+
+static void init_k_weighting(GstNonstreamAudioLoudness *loudness)
+{
+	/* Filter coefficients are computed from the analog prototypes, so
+	 * that any sample rate is supported (BS.1770 only lists coefficients
+	 * for 48 kHz). The prototype parameters are the ones that reproduce
+	 * the 48 kHz coefficients from the specification. */
+
+	gdouble const rate = loudness->sample_rate;
+	gdouble f0, gain, q, k, vh, vb, a0;
+
+	/* Stage 1: high shelf, modeling the acoustic effect of the head */
+	f0 = 1681.974450955533;
+	gain = 3.999843853973347;
+	q = 0.7071752369554196;
+
+	k = tan(G_PI * f0 / rate);
+	vh = pow(10.0, gain / 20.0);
+	vb = pow(vh, 0.4996667741545416);
+	a0 = 1.0 + k / q + k * k;
+
+	loudness->shelf.b0 = (vh + vb * k / q + k * k) / a0;
+	loudness->shelf.b1 = 2.0 * (k * k - vh) / a0;
+	loudness->shelf.b2 = (vh - vb * k / q + k * k) / a0;
+	loudness->shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+	loudness->shelf.a2 = (1.0 - k / q + k * k) / a0;
+
+	/* Stage 2: RLB high pass */
+	f0 = 38.13547087602444;
+	q = 0.5003270373238773;
+
+	k = tan(G_PI * f0 / rate);
+	a0 = 1.0 + k / q + k * k;
+
+	loudness->highpass.b0 = 1.0;
+	loudness->highpass.b1 = -2.0;
+	loudness->highpass.b2 = 1.0;
+	loudness->highpass.a1 = 2.0 * (k * k - 1.0) / a0;
+	loudness->highpass.a2 = (1.0 - k / q + k * k) / a0;
+}
+
+
+static void init_interpolator(GstNonstreamAudioLoudness *loudness)
+{
+	/* Blackman-windowed sinc lowpass with its cutoff at the original
+	 * Nyquist frequency, split into TRUE_PEAK_OVERSAMPLING phases.
+	 * Each phase is normalized to unity DC gain. */
+
+	guint const num_taps = TRUE_PEAK_TAPS_PER_PHASE * TRUE_PEAK_OVERSAMPLING;
+	gdouble const center = (num_taps - 1) / 2.0;
+	guint phase, tap;
+
+	for (phase = 0; phase < TRUE_PEAK_OVERSAMPLING; ++phase)
+	{
+		gdouble phase_sum = 0.0;
+		gdouble coeffs[TRUE_PEAK_TAPS_PER_PHASE];
+
+		for (tap = 0; tap < TRUE_PEAK_TAPS_PER_PHASE; ++tap)
+		{
+			guint n = phase + tap * TRUE_PEAK_OVERSAMPLING;
+			gdouble x = (n - center) / TRUE_PEAK_OVERSAMPLING;
+			gdouble sinc = (fabs(x) < 1e-9) ? 1.0 : (sin(G_PI * x) / (G_PI * x));
+			gdouble window = 0.42 - 0.5 * cos(2.0 * G_PI * n / (num_taps - 1)) + 0.08 * cos(4.0 * G_PI * n / (num_taps - 1));
+
+			coeffs[tap] = sinc * window;
+			phase_sum += coeffs[tap];
+		}
+
+		for (tap = 0; tap < TRUE_PEAK_TAPS_PER_PHASE; ++tap)
+			loudness->interpolator[tap][phase] = coeffs[tap] / phase_sum;
+	}
+}
+
+
+static void k_weight_and_accumulate(GstNonstreamAudioLoudness *loudness, gfloat const *samples, guint num_frames)
+{
+	guint const num_channels = loudness->num_channels;
+	KWeightingStage const *s1 = &(loudness->shelf);
+	KWeightingStage const *s2 = &(loudness->highpass);
+	gdouble *states = loudness->filter_states;
+	guint i, ch;
+
+#ifdef __SSE2__
+	if (num_channels == 2)
+	{
+		/* Stereo is by far the most common case; filter both channels at
+		 * once, with one channel per vector lane. The filters use the
+		 * transposed direct form II. */
+
+		__m128d const s1b0 = _mm_set1_pd(s1->b0), s1b1 = _mm_set1_pd(s1->b1), s1b2 = _mm_set1_pd(s1->b2);
+		__m128d const s1a1 = _mm_set1_pd(s1->a1), s1a2 = _mm_set1_pd(s1->a2);
+		__m128d const s2b0 = _mm_set1_pd(s2->b0), s2b1 = _mm_set1_pd(s2->b1), s2b2 = _mm_set1_pd(s2->b2);
+		__m128d const s2a1 = _mm_set1_pd(s2->a1), s2a2 = _mm_set1_pd(s2->a2);
+
+		__m128d z11 = _mm_loadu_pd(states + 0), z12 = _mm_loadu_pd(states + 2);
+		__m128d z21 = _mm_loadu_pd(states + 4), z22 = _mm_loadu_pd(states + 6);
+		__m128d sum = _mm_loadu_pd(loudness->subblock_sums);
+
+		for (i = 0; i < num_frames; ++i)
+		{
+			__m128d x = _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((__m128i const *)(samples + i * 2))));
+			__m128d y1, y2;
+
+			y1 = _mm_add_pd(_mm_mul_pd(s1b0, x), z11);
+			z11 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(s1b1, x), _mm_mul_pd(s1a1, y1)), z12);
+			z12 = _mm_sub_pd(_mm_mul_pd(s1b2, x), _mm_mul_pd(s1a2, y1));
+
+			y2 = _mm_add_pd(_mm_mul_pd(s2b0, y1), z21);
+			z21 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(s2b1, y1), _mm_mul_pd(s2a1, y2)), z22);
+			z22 = _mm_sub_pd(_mm_mul_pd(s2b2, y1), _mm_mul_pd(s2a2, y2));
+
+			sum = _mm_add_pd(sum, _mm_mul_pd(y2, y2));
+		}
+
+		_mm_storeu_pd(states + 0, z11);
+		_mm_storeu_pd(states + 2, z12);
+		_mm_storeu_pd(states + 4, z21);
+		_mm_storeu_pd(states + 6, z22);
+		_mm_storeu_pd(loudness->subblock_sums, sum);
+	}
+	else
+#endif
+	{
+		for (ch = 0; ch < num_channels; ++ch)
+		{
+			gdouble z11 = states[0 * num_channels + ch], z12 = states[1 * num_channels + ch];
+			gdouble z21 = states[2 * num_channels + ch], z22 = states[3 * num_channels + ch];
+			gdouble sum = loudness->subblock_sums[ch];
+
+			if (loudness->channel_weights[ch] == 0.0)
+				continue;
+
+			for (i = 0; i < num_frames; ++i)
+			{
+				gdouble x = samples[i * num_channels + ch];
+				gdouble y1, y2;
+
+				y1 = s1->b0 * x + z11;
+				z11 = s1->b1 * x - s1->a1 * y1 + z12;
+				z12 = s1->b2 * x - s1->a2 * y1;
+
+				y2 = s2->b0 * y1 + z21;
+				z21 = s2->b1 * y1 - s2->a1 * y2 + z22;
+				z22 = s2->b2 * y1 - s2->a2 * y2;
+
+				sum += y2 * y2;
+			}
+
+			states[0 * num_channels + ch] = z11;
+			states[1 * num_channels + ch] = z12;
+			states[2 * num_channels + ch] = z21;
+			states[3 * num_channels + ch] = z22;
+			loudness->subblock_sums[ch] = sum;
+		}
+	}
+
+	/* Flush tiny filter states to zero, otherwise silence makes
+	 * them decay into denormals, which are very slow to process */
+	for (i = 0; i < num_channels * 4; ++i)
+	{
+		if (fabs(states[i]) < 1e-30)
+			states[i] = 0.0;
+	}
+}
+
+
+static void update_true_peak(GstNonstreamAudioLoudness *loudness, gfloat const *samples, guint num_frames)
+{
+	/* The interpolator history of each channel holds 2*TRUE_PEAK_TAPS_PER_PHASE
+	 * entries. Each sample is written twice, TRUE_PEAK_TAPS_PER_PHASE entries
+	 * apart, so the most recent TRUE_PEAK_TAPS_PER_PHASE samples are always
+	 * available as one contiguous block, without any wraparound handling. */
+
+	guint const num_channels = loudness->num_channels;
+	guint const history_length = TRUE_PEAK_TAPS_PER_PHASE * 2;
+	guint position = loudness->interpolator_position;
+	gfloat peak = loudness->true_peak;
+	guint i, ch, tap;
+
+#ifdef __SSE2__
+	__m128 const abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	__m128 peak_vec = _mm_set1_ps(peak);
+#endif
+
+	for (i = 0; i < num_frames; ++i)
+	{
+		for (ch = 0; ch < num_channels; ++ch)
+		{
+			gfloat *history = loudness->interpolator_history + ch * history_length;
+			gfloat const *newest;
+			gfloat x = samples[i * num_channels + ch];
+
+			history[position] = x;
+			history[position + TRUE_PEAK_TAPS_PER_PHASE] = x;
+			/* newest[-tap] is the sample from tap steps ago */
+			newest = history + position + TRUE_PEAK_TAPS_PER_PHASE;
+
+#ifdef __SSE2__
+			{
+				/* all phases at once, one per vector lane */
+				__m128 acc = _mm_setzero_ps();
+				for (tap = 0; tap < TRUE_PEAK_TAPS_PER_PHASE; ++tap)
+					acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(newest[-(gint)tap]), _mm_loadu_ps(loudness->interpolator[tap])));
+				peak_vec = _mm_max_ps(peak_vec, _mm_and_ps(acc, abs_mask));
+			}
+#else
+			{
+				guint phase;
+				for (phase = 0; phase < TRUE_PEAK_OVERSAMPLING; ++phase)
+				{
+					gfloat acc = 0.0f;
+					for (tap = 0; tap < TRUE_PEAK_TAPS_PER_PHASE; ++tap)
+						acc += newest[-(gint)tap] * loudness->interpolator[tap][phase];
+					peak = MAX(peak, fabsf(acc));
+				}
+			}
+#endif
+
+			/* the interpolated values may undershoot the actual samples */
+			peak = MAX(peak, fabsf(x));
+		}
+
+		position = (position + 1) % TRUE_PEAK_TAPS_PER_PHASE;
+	}
+
+#ifdef __SSE2__
+	{
+		gfloat lanes[4];
+		guint lane;
+		_mm_storeu_ps(lanes, peak_vec);
+		for (lane = 0; lane < 4; ++lane)
+			peak = MAX(peak, lanes[lane]);
+	}
+#endif
+
+	loudness->interpolator_position = position;
+	loudness->true_peak = peak;
+}
+
+
+static void finish_subblock(GstNonstreamAudioLoudness *loudness)
+{
+	guint ch, i;
+	gdouble energy = 0.0;
+	guint64 n;
+
+	for (ch = 0; ch < loudness->num_channels; ++ch)
+	{
+		energy += loudness->channel_weights[ch] * loudness->subblock_sums[ch];
+		loudness->subblock_sums[ch] = 0.0;
+	}
+	energy /= loudness->subblock_length;
+
+	loudness->recent_subblocks[loudness->num_subblocks % NUM_SUBBLOCKS_PER_SHORT_TERM_WINDOW] = energy;
+	loudness->num_subblocks++;
+	loudness->subblock_position = 0;
+
+	n = loudness->num_subblocks;
+
+	if (n >= NUM_SUBBLOCKS_PER_GATING_BLOCK)
+	{
+		gdouble block_energy = 0.0;
+		for (i = 0; i < NUM_SUBBLOCKS_PER_GATING_BLOCK; ++i)
+			block_energy += loudness->recent_subblocks[(n - 1 - i) % NUM_SUBBLOCKS_PER_SHORT_TERM_WINDOW];
+		block_energy /= NUM_SUBBLOCKS_PER_GATING_BLOCK;
+		g_array_append_val(loudness->gating_block_energies, block_energy);
+	}
+
+	if (n >= NUM_SUBBLOCKS_PER_SHORT_TERM_WINDOW)
+	{
+		gdouble window_energy = 0.0;
+		for (i = 0; i < NUM_SUBBLOCKS_PER_SHORT_TERM_WINDOW; ++i)
+			window_energy += loudness->recent_subblocks[i];
+		window_energy /= NUM_SUBBLOCKS_PER_SHORT_TERM_WINDOW;
+		g_array_append_val(loudness->short_term_energies, window_energy);
+	}
+}
+
+
+static gdouble energy_to_loudness(gdouble energy)
+{
+	return -0.691 + 10.0 * log10(MAX(energy, 1e-20));
+}
+
+
+static gdouble loudness_to_energy(gdouble loudness)
+{
+	return pow(10.0, (loudness + 0.691) / 10.0);
+}
+
+
+static int compare_doubles(void const *first, void const *second)
+{
+	gdouble a = *((gdouble const *)first);
+	gdouble b = *((gdouble const *)second);
+	return (a > b) - (a < b);
+}
@@ -0,0 +1,60 @@
+/*
+ *   EBU R128 loudness analysis for non-streaming audio decoders
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef _GST_NONSTREAM_AUDIO_LOUDNESS_H_
+#define _GST_NONSTREAM_AUDIO_LOUDNESS_H_
+
+#include <gst/gst.h>
+#include <gst/audio/audio.h>
+
+
+G_BEGIN_DECLS
+
+
+/**
+ * GstNonstreamAudioLoudness:
+ *
+ * Opaque loudness analyzer. It measures integrated loudness and loudness
+ * range as defined by ITU-R BS.1770 and EBU Tech 3341/3342, and the true
+ * peak (using 4x oversampling). Samples are fed in with
+ * gst_nonstream_audio_loudness_process(). Only interleaved S16 and F32
+ * samples are supported.
+ */
+typedef struct _GstNonstreamAudioLoudness GstNonstreamAudioLoudness;
+
+
+/* ReplayGain 2.0 reference loudness, in LUFS */
+#define GST_NONSTREAM_AUDIO_LOUDNESS_REPLAYGAIN_REFERENCE -18.0
+
+
+GstNonstreamAudioLoudness* gst_nonstream_audio_loudness_new(GstAudioInfo const *info);
+void gst_nonstream_audio_loudness_free(GstNonstreamAudioLoudness *loudness);
+
+gboolean gst_nonstream_audio_loudness_is_compatible(GstNonstreamAudioLoudness const *loudness, GstAudioInfo const *info);
+void gst_nonstream_audio_loudness_reset(GstNonstreamAudioLoudness *loudness);
+
+void gst_nonstream_audio_loudness_process(GstNonstreamAudioLoudness *loudness, GstBuffer *buffer, guint num_samples);
+
+gboolean gst_nonstream_audio_loudness_get_results(GstNonstreamAudioLoudness const *loudness, gdouble *integrated_loudness, gdouble *loudness_range, gdouble *true_peak);
+
+
+G_END_DECLS
+
+
+#endif /* _GST_NONSTREAM_AUDIO_LOUDNESS_H_ */
@@ -0,0 +1,339 @@
+/*
+ *   Analysis metadata for buffers produced by non-streaming audio decoders
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <math.h>
+#include <string.h>
+#include <gst/gst.h>
+#include <gst/audio/audio.h>
+
+#include "gstnonstreamaudiometa.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+/* Upper bound for the channel count of the temporary level accumulators.
+ * Matches the maximum number of channels GstAudioInfo supports. */
+#define MAX_ACCUMULATOR_CHANNELS 64
+
+
+static gboolean gst_nonstream_audio_analysis_meta_init(GstMeta *meta, gpointer params, GstBuffer *buffer);
+static gboolean gst_nonstream_audio_analysis_meta_transform(GstBuffer *dest, GstMeta *meta, GstBuffer *buffer, GQuark type, gpointer data);
+
+static void accumulate_levels_f32(gfloat const *samples, gsize num_values, guint num_channels, gfloat *peak, gfloat *sum_squares);
+static void accumulate_levels_s16(gint16 const *samples, gsize num_values, guint num_channels, gfloat *peak, gfloat *sum_squares);
+
+
+
+GType gst_nonstream_audio_analysis_meta_api_get_type(void)
+{
+	static volatile gsize nonstream_audio_analysis_meta_api_type = 0;
+	static gchar const *tags[] = { GST_META_TAG_AUDIO_STR, NULL };
+
+	if (g_once_init_enter(&nonstream_audio_analysis_meta_api_type))
+	{
+		GType type_ = gst_meta_api_type_register("GstNonstreamAudioAnalysisMetaAPI", tags);
+		g_once_init_leave(&nonstream_audio_analysis_meta_api_type, type_);
+	}
+
+	return nonstream_audio_analysis_meta_api_type;
+}
+
+
+GstMetaInfo const * gst_nonstream_audio_analysis_meta_get_info(void)
+{
+	static GstMetaInfo const *meta_info = NULL;
+
+	if (g_once_init_enter((GstMetaInfo **)&meta_info))
+	{
+		GstMetaInfo const *info = gst_meta_register(
+			GST_NONSTREAM_AUDIO_ANALYSIS_META_API_TYPE,
+			"GstNonstreamAudioAnalysisMeta",
+			sizeof(GstNonstreamAudioAnalysisMeta),
+			gst_nonstream_audio_analysis_meta_init,
+			NULL,
+			gst_nonstream_audio_analysis_meta_transform
+		);
+		g_once_init_leave((GstMetaInfo **)&meta_info, (GstMetaInfo *)info);
+	}
+
+	return meta_info;
+}
+
+
+GstNonstreamAudioAnalysisMeta* gst_buffer_add_nonstream_audio_analysis_meta(GstBuffer *buffer)
+{
+	g_return_val_if_fail(GST_IS_BUFFER(buffer), NULL);
+	return (GstNonstreamAudioAnalysisMeta *)gst_buffer_add_meta(buffer, GST_NONSTREAM_AUDIO_ANALYSIS_META_INFO, NULL);
+}
+
+
+void gst_nonstream_audio_analysis_meta_compute_levels(GstNonstreamAudioAnalysisMeta *meta, GstAudioInfo const *info, GstBuffer *buffer, guint num_samples)
+{
+	GstMapInfo map;
+	guint num_channels, i;
+	gsize num_values, bytes_per_value, num_frames;
+	gfloat peak[MAX_ACCUMULATOR_CHANNELS];
+	gfloat sum_squares[MAX_ACCUMULATOR_CHANNELS];
+
+	g_return_if_fail(meta != NULL);
+	g_return_if_fail(info != NULL);
+	g_return_if_fail(GST_IS_BUFFER(buffer));
+
+	meta->num_channels = 0;
+
+	num_channels = GST_AUDIO_INFO_CHANNELS(info);
+	if ((num_channels == 0) || (num_channels > MAX_ACCUMULATOR_CHANNELS) || (num_samples == 0))
+		return;
+
+	/* only native-endian S16 and F32 are supported, since
+	 * these are the formats the decoders actually produce */
+	if ((GST_AUDIO_INFO_FORMAT(info) != GST_AUDIO_FORMAT_F32) && (GST_AUDIO_INFO_FORMAT(info) != GST_AUDIO_FORMAT_S16))
+		return;
+
+	if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+		return;
+
+	bytes_per_value = GST_AUDIO_INFO_WIDTH(info) / 8;
+
+	memset(peak, 0, sizeof(gfloat) * num_channels);
+	memset(sum_squares, 0, sizeof(gfloat) * num_channels);
+
+	if (GST_AUDIO_INFO_LAYOUT(info) == GST_AUDIO_LAYOUT_INTERLEAVED)
+	{
+		num_values = MIN((gsize)num_samples * num_channels, map.size / bytes_per_value);
+		num_values -= num_values % num_channels;
+		num_frames = num_values / num_channels;
+
+		if (GST_AUDIO_INFO_FORMAT(info) == GST_AUDIO_FORMAT_F32)
+			accumulate_levels_f32((gfloat const *)(map.data), num_values, num_channels, peak, sum_squares);
+		else
+			accumulate_levels_s16((gint16 const *)(map.data), num_values, num_channels, peak, sum_squares);
+	}
+	else
+	{
+		/* Planar output: by default, the planes are stored one after the
+		 * other, each with num_samples values. Decoders which keep the
+		 * planes further apart (for example when a block came out shorter
+		 * than the allocated size) describe the offsets in a GstAudioMeta.
+		 * Each plane is processed like mono interleaved data. */
+		gsize offsets[MAX_ACCUMULATOR_CHANNELS];
+#if GST_CHECK_VERSION(1, 16, 0)
+		GstAudioMeta *audio_meta = gst_buffer_get_audio_meta(buffer);
+#endif
+
+		num_frames = num_samples;
+
+		for (i = 0; i < num_channels; ++i)
+		{
+#if GST_CHECK_VERSION(1, 16, 0)
+			if ((audio_meta != NULL) && (audio_meta->offsets != NULL) && (i < (guint)(audio_meta->info.channels)))
+				offsets[i] = audio_meta->offsets[i];
+			else
+#endif
+				offsets[i] = (gsize)i * num_samples * bytes_per_value;
+
+			/* never read past the end of the buffer */
+			if (offsets[i] >= map.size)
+				num_frames = 0;
+			else
+				num_frames = MIN(num_frames, (map.size - offsets[i]) / bytes_per_value);
+		}
+
+		for (i = 0; (i < num_channels) && (num_frames > 0); ++i)
+		{
+			guint8 const *plane = map.data + offsets[i];
+
+			if (GST_AUDIO_INFO_FORMAT(info) == GST_AUDIO_FORMAT_F32)
+				accumulate_levels_f32((gfloat const *)plane, num_frames, 1, &(peak[i]), &(sum_squares[i]));
+			else
+				accumulate_levels_s16((gint16 const *)plane, num_frames, 1, &(peak[i]), &(sum_squares[i]));
+		}
+	}
+
+	gst_buffer_unmap(buffer, &map);
+
+	if (num_frames == 0)
+		return;
+
+	meta->num_channels = MIN(num_channels, GST_NONSTREAM_AUDIO_ANALYSIS_META_MAX_CHANNELS);
+	for (i = 0; i < meta->num_channels; ++i)
+	{
+		meta->peak[i] = peak[i];
+		meta->rms[i] = sqrtf(sum_squares[i] / num_frames);
+	}
+}
+
+
+
+static gboolean gst_nonstream_audio_analysis_meta_init(GstMeta *meta, G_GNUC_UNUSED gpointer params, G_GNUC_UNUSED GstBuffer *buffer)
+{
+	GstNonstreamAudioAnalysisMeta *analysis_meta = (GstNonstreamAudioAnalysisMeta *)meta;
+
+	analysis_meta->num_channels = 0;
+	memset(analysis_meta->peak, 0, sizeof(analysis_meta->peak));
+	memset(analysis_meta->rms, 0, sizeof(analysis_meta->rms));
+
+	analysis_meta->track_position = GST_CLOCK_TIME_NONE;
+	analysis_meta->order = -1;
+	analysis_meta->pattern = -1;
+	analysis_meta->row = -1;
+
+	return TRUE;
+}
+
+
+static gboolean gst_nonstream_audio_analysis_meta_transform(GstBuffer *dest, GstMeta *meta, G_GNUC_UNUSED GstBuffer *buffer, GQuark type, gpointer data)
+{
+	GstNonstreamAudioAnalysisMeta *src_meta = (GstNonstreamAudioAnalysisMeta *)meta;
+	GstNonstreamAudioAnalysisMeta *dest_meta;
+
+	/* Only full copies are supported. The levels describe the
+	 * entire buffer, and would be incorrect for a subregion. */
+	if (!GST_META_TRANSFORM_IS_COPY(type) || ((GstMetaTransformCopy *)data)->region)
+		return FALSE;
+
+	dest_meta = gst_buffer_add_nonstream_audio_analysis_meta(dest);
+	if (dest_meta == NULL)
+		return FALSE;
+
+	dest_meta->num_channels = src_meta->num_channels;
+	memcpy(dest_meta->peak, src_meta->peak, sizeof(src_meta->peak));
+	memcpy(dest_meta->rms, src_meta->rms, sizeof(src_meta->rms));
+	dest_meta->track_position = src_meta->track_position;
+	dest_meta->order = src_meta->order;
+	dest_meta->pattern = src_meta->pattern;
+	dest_meta->row = src_meta->row;
+
+	return TRUE;
+}
+
+
+
+/* The level accumulators below operate on interleaved samples. If the number
+ * of channels divides 4 (which covers mono, stereo, and quad output), the
+ * SSE2 versions can process the samples as a flat array, since each vector
+ * lane then always corresponds to the same channel. Other channel counts,
+ * as well as the values that remain after the vectorized loop, are handled
+ * by the scalar code. */
+
+
+static void accumulate_levels_f32(gfloat const *samples, gsize num_values, guint num_channels, gfloat *peak, gfloat *sum_squares)
+{
+	gsize i = 0;
+	guint ch;
+
+#ifdef __SSE2__
+	if ((4 % num_channels) == 0)
+	{
+		__m128 const abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+		__m128 peak_vec = _mm_setzero_ps();
+		__m128 sum_vec = _mm_setzero_ps();
+		gfloat peak_lanes[4], sum_lanes[4];
+		guint lane;
+
+		for (; (i + 4) <= num_values; i += 4)
+		{
+			__m128 v = _mm_loadu_ps(samples + i);
+			peak_vec = _mm_max_ps(peak_vec, _mm_and_ps(v, abs_mask));
+			sum_vec = _mm_add_ps(sum_vec, _mm_mul_ps(v, v));
+		}
+
+		_mm_storeu_ps(peak_lanes, peak_vec);
+		_mm_storeu_ps(sum_lanes, sum_vec);
+
+		for (lane = 0; lane < 4; ++lane)
+		{
+			ch = lane % num_channels;
+			peak[ch] = MAX(peak[ch], peak_lanes[lane]);
+			sum_squares[ch] += sum_lanes[lane];
+		}
+	}
+#endif
+
+	/* i is always a multiple of num_channels here */
+	for (; i < num_values; i += num_channels)
+	{
+		for (ch = 0; ch < num_channels; ++ch)
+		{
+			gfloat v = samples[i + ch];
+			peak[ch] = MAX(peak[ch], fabsf(v));
+			sum_squares[ch] += v * v;
+		}
+	}
+}
+
+
+static void accumulate_levels_s16(gint16 const *samples, gsize num_values, guint num_channels, gfloat *peak, gfloat *sum_squares)
+{
+	gfloat const scale = 1.0f / 32768.0f;
+	gsize i = 0;
+	guint ch;
+
+#ifdef __SSE2__
+	if ((4 % num_channels) == 0)
+	{
+		__m128 const abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+		__m128 const scale_vec = _mm_set1_ps(scale);
+		__m128 peak_vec = _mm_setzero_ps();
+		__m128 sum_vec = _mm_setzero_ps();
+		gfloat peak_lanes[4], sum_lanes[4];
+		guint lane;
+
+		/* 8 values per iteration; since num_channels divides 4, the lanes
+		 * of both halves map to the same channels */
+		for (; (i + 8) <= num_values; i += 8)
+		{
+			__m128i v = _mm_loadu_si128((__m128i const *)(samples + i));
+			/* sign-extend the 16-bit values to 32 bit, then convert to float */
+			__m128 lo = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)), scale_vec);
+			__m128 hi = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16)), scale_vec);
+
+			peak_vec = _mm_max_ps(peak_vec, _mm_max_ps(_mm_and_ps(lo, abs_mask), _mm_and_ps(hi, abs_mask)));
+			sum_vec = _mm_add_ps(sum_vec, _mm_add_ps(_mm_mul_ps(lo, lo), _mm_mul_ps(hi, hi)));
+		}
+
+		_mm_storeu_ps(peak_lanes, peak_vec);
+		_mm_storeu_ps(sum_lanes, sum_vec);
+
+		for (lane = 0; lane < 4; ++lane)
+		{
+			ch = lane % num_channels;
+			peak[ch] = MAX(peak[ch], peak_lanes[lane]);
+			sum_squares[ch] += sum_lanes[lane];
+		}
+	}
+#endif
+
+	/* i is always a multiple of num_channels here */
+	for (; i < num_values; i += num_channels)
+	{
+		for (ch = 0; ch < num_channels; ++ch)
+		{
+			gfloat v = samples[i + ch] * scale;
+			peak[ch] = MAX(peak[ch], fabsf(v));
+			sum_squares[ch] += v * v;
+		}
+	}
+}
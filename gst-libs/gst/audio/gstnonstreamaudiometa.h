@@ -0,0 +1,89 @@
+/*
+ *   Analysis metadata for buffers produced by non-streaming audio decoders
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef _GST_NONSTREAM_AUDIO_META_H_
+#define _GST_NONSTREAM_AUDIO_META_H_
+
+#include <gst/gst.h>
+#include <gst/audio/audio.h>
+
+
+G_BEGIN_DECLS
+
+
+typedef struct _GstNonstreamAudioAnalysisMeta GstNonstreamAudioAnalysisMeta;
+
+
+#define GST_NONSTREAM_AUDIO_ANALYSIS_META_API_TYPE (gst_nonstream_audio_analysis_meta_api_get_type())
+#define GST_NONSTREAM_AUDIO_ANALYSIS_META_INFO (gst_nonstream_audio_analysis_meta_get_info())
+
+/* Levels are computed for at most this many channels. Channels beyond this are ignored. */
+#define GST_NONSTREAM_AUDIO_ANALYSIS_META_MAX_CHANNELS 8
+
+
+/**
+ * GstNonstreamAudioAnalysisMeta:
+ * @meta:           Parent #GstMeta
+ * @num_channels:   Number of valid entries in @peak and @rms. 0 if the levels could not
+ *                  be computed (for example, because the sample format is not supported).
+ * @peak:           Per-channel peak level, as the maximum absolute sample value. Linear
+ *                  scale, 1.0 = full scale.
+ * @rms:            Per-channel RMS level of the buffer. Linear scale, 1.0 = full scale.
+ * @track_position: Position within the current (sub)song at the start of the buffer,
+ *                  as reported by the decoder's @tell function. GST_CLOCK_TIME_NONE if
+ *                  unknown. Unlike the buffer timestamp, this position is reset when
+ *                  playback loops or the subsong changes.
+ * @order:          Current order (position in the order list) for tracker music
+ *                  formats, -1 if not applicable.
+ * @pattern:        Pattern currently being played, -1 if not applicable.
+ * @row:            Row within the current pattern, -1 if not applicable.
+ *
+ * Optional metadata the #GstNonstreamAudioDecoder attaches to output buffers if its
+ * analysis-meta property is enabled. The levels are computed as part of the decoding
+ * step, while the samples are still in the cache, which saves downstream visualization
+ * elements from running their own level analysis.
+ */
+struct _GstNonstreamAudioAnalysisMeta
+{
+	GstMeta meta;
+
+	guint num_channels;
+	gfloat peak[GST_NONSTREAM_AUDIO_ANALYSIS_META_MAX_CHANNELS];
+	gfloat rms[GST_NONSTREAM_AUDIO_ANALYSIS_META_MAX_CHANNELS];
+
+	GstClockTime track_position;
+	gint order, pattern, row;
+};
+
+
+GType gst_nonstream_audio_analysis_meta_api_get_type(void);
+GstMetaInfo const * gst_nonstream_audio_analysis_meta_get_info(void);
+
+#define gst_buffer_get_nonstream_audio_analysis_meta(b) \
+	((GstNonstreamAudioAnalysisMeta*)gst_buffer_get_meta((b), GST_NONSTREAM_AUDIO_ANALYSIS_META_API_TYPE))
+
+GstNonstreamAudioAnalysisMeta* gst_buffer_add_nonstream_audio_analysis_meta(GstBuffer *buffer);
+
+void gst_nonstream_audio_analysis_meta_compute_levels(GstNonstreamAudioAnalysisMeta *meta, GstAudioInfo const *info, GstBuffer *buffer, guint num_samples);
+
+
+G_END_DECLS
+
+
+#endif /* _GST_NONSTREAM_AUDIO_META_H_ */